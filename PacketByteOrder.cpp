@@ -0,0 +1,112 @@
+/*  PacketByteOrder
+
+*/
+#include <string.h>
+#include "PacketByteOrder.h"
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+  #define PACKETBYTEORDER_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #include <arm_neon.h>
+  #define PACKETBYTEORDER_NEON
+#endif
+
+namespace PacketByteOrder{
+
+#if defined(PACKETBYTEORDER_SSE2)
+// swap the two bytes of every 16-bit lane
+static inline __m128i _swapLanes16(__m128i v){
+  return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+#endif
+
+void copySwap16(void* dest, const void* src, size_t count)
+{
+  uint8_t*       d = (uint8_t*) dest;
+  const uint8_t* s = (const uint8_t*) src;
+  size_t i = 0;
+  #if defined(PACKETBYTEORDER_SSE2)
+  for(; i + 8 <= count; i += 8){
+    __m128i v = _mm_loadu_si128((const __m128i*) (s + 2*i));
+    _mm_storeu_si128((__m128i*) (d + 2*i), _swapLanes16(v));
+  }
+  #elif defined(PACKETBYTEORDER_NEON)
+  for(; i + 8 <= count; i += 8){
+    vst1q_u8(d + 2*i, vrev16q_u8(vld1q_u8(s + 2*i)));
+  }
+  #endif
+  for(; i < count; i++){
+    uint16_t x;
+    memcpy(&x, s + 2*i, 2);
+    x = __builtin_bswap16(x);
+    memcpy(d + 2*i, &x, 2);
+  }
+}
+
+void copySwap32(void* dest, const void* src, size_t count)
+{
+  uint8_t*       d = (uint8_t*) dest;
+  const uint8_t* s = (const uint8_t*) src;
+  size_t i = 0;
+  #if defined(PACKETBYTEORDER_SSE2)
+  for(; i + 4 <= count; i += 4){
+    __m128i v = _mm_loadu_si128((const __m128i*) (s + 4*i));
+    //exchange the 16-bit halves of each word, then the bytes of each half
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    _mm_storeu_si128((__m128i*) (d + 4*i), _swapLanes16(v));
+  }
+  #elif defined(PACKETBYTEORDER_NEON)
+  for(; i + 4 <= count; i += 4){
+    vst1q_u8(d + 4*i, vrev32q_u8(vld1q_u8(s + 4*i)));
+  }
+  #endif
+  for(; i < count; i++){
+    uint32_t x;
+    memcpy(&x, s + 4*i, 4);
+    x = __builtin_bswap32(x);
+    memcpy(d + 4*i, &x, 4);
+  }
+}
+
+void copySwap64(void* dest, const void* src, size_t count)
+{
+  uint8_t*       d = (uint8_t*) dest;
+  const uint8_t* s = (const uint8_t*) src;
+  size_t i = 0;
+  #if defined(PACKETBYTEORDER_SSE2)
+  for(; i + 2 <= count; i += 2){
+    __m128i v = _mm_loadu_si128((const __m128i*) (s + 8*i));
+    //reverse the 16-bit quarters of each word, then the bytes of each quarter
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    _mm_storeu_si128((__m128i*) (d + 8*i), _swapLanes16(v));
+  }
+  #elif defined(PACKETBYTEORDER_NEON)
+  for(; i + 2 <= count; i += 2){
+    vst1q_u8(d + 8*i, vrev64q_u8(vld1q_u8(s + 8*i)));
+  }
+  #endif
+  for(; i < count; i++){
+    uint64_t x;
+    memcpy(&x, s + 8*i, 8);
+    x = __builtin_bswap64(x);
+    memcpy(d + 8*i, &x, 8);
+  }
+}
+
+void copySwap(void* dest, const void* src, size_t count, size_t width)
+{
+  switch(width){
+    case 2: copySwap16(dest, src, count); break;
+    case 4: copySwap32(dest, src, count); break;
+    case 8: copySwap64(dest, src, count); break;
+    default:
+      if (dest != src){
+        memmove(dest, src, count*width);
+      }
+  }
+}
+
+} //namespace PacketByteOrder
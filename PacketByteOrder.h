@@ -0,0 +1,61 @@
+/*  
+*/
+#ifndef _PACKET_BYTE_ORDER_H_INCLUDED
+#define _PACKET_BYTE_ORDER_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/******************************************************************************/
+// Byte order of numbers on the wire, and bulk conversion for arrays of 2, 4
+// or 8 byte elements.  Each copySwap function copies 'count' elements from
+// 'src' to 'dest', reversing the bytes of every element on the way.  Neither
+// pointer needs to be aligned, and 'dest' may be the same as 'src' (but must
+// not otherwise overlap it).  SSE2 and NEON builds convert 16 bytes per step;
+// other targets go one element at a time through the compiler's byte swap
+// builtins.
+/******************************************************************************/
+namespace PacketByteOrder{
+  typedef enum OrderCode {
+    LITTLE = 0,
+    BIG    = 1
+  } ORDER;
+  #if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+  const ORDER NATIVE = BIG;
+  #else
+  const ORDER NATIVE = LITTLE;
+  #endif
+  
+  // Only numbers have a byte order; anything else (structs, byte arrays) is
+  // always copied as it is
+  template<typename T> struct IsNumber           { static const bool value = false; };
+  template<> struct IsNumber<short>              { static const bool value = true; };
+  template<> struct IsNumber<unsigned short>     { static const bool value = true; };
+  template<> struct IsNumber<int>                { static const bool value = true; };
+  template<> struct IsNumber<unsigned int>       { static const bool value = true; };
+  template<> struct IsNumber<long>               { static const bool value = true; };
+  template<> struct IsNumber<unsigned long>      { static const bool value = true; };
+  template<> struct IsNumber<long long>          { static const bool value = true; };
+  template<> struct IsNumber<unsigned long long> { static const bool value = true; };
+  template<> struct IsNumber<float>              { static const bool value = true; };
+  template<> struct IsNumber<double>             { static const bool value = true; };
+  
+  // reverse the bytes of a single value in place, 'width' is normally a
+  // constant so this reduces to one byte swap instruction
+  inline void swapInPlace(void* p, size_t width){
+    switch(width){
+      case 2: { uint16_t x; memcpy(&x, p, 2); x = __builtin_bswap16(x); memcpy(p, &x, 2); break; }
+      case 4: { uint32_t x; memcpy(&x, p, 4); x = __builtin_bswap32(x); memcpy(p, &x, 4); break; }
+      case 8: { uint64_t x; memcpy(&x, p, 8); x = __builtin_bswap64(x); memcpy(p, &x, 8); break; }
+    }
+  }
+  
+  void copySwap16(void* dest, const void* src, size_t count);
+  void copySwap32(void* dest, const void* src, size_t count);
+  void copySwap64(void* dest, const void* src, size_t count);
+  // dispatch on element size, plain copy for single bytes
+  void copySwap(void* dest, const void* src, size_t count, size_t width);
+}
+
+#endif /* _PACKET_BYTE_ORDER_H_INCLUDED */
@@ -0,0 +1,39 @@
+/*  
+*/
+#ifndef _PACKET_CRC_H_INCLUDED
+#define _PACKET_CRC_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/******************************************************************************/
+// Table driven checksums for the packet integrity trailer.
+//   CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF, no
+//                       reflection, no final XOR ("123456789" -> 0x29B1)
+//   CRC-32:             the Ethernet/zlib CRC, reflected polynomial
+//                       0xEDB88320, initial value and final XOR 0xFFFFFFFF
+//                       ("123456789" -> 0xCBF43926)
+// Both tables are kept in flash on AVR.  CRC-32 uses the CRC instructions of
+// ARMv8 cores when the compiler targets them.  The running value may be
+// passed back in to checksum data that arrives in pieces.
+/******************************************************************************/
+namespace PacketCRC{
+  // Checksum trailer carried at the end of each packet, the value is its size
+  typedef enum ChecksumMode {
+    NONE  = 0,
+    CRC16 = 2,
+    CRC32 = 4
+  } MODE;
+  
+  uint16_t crc16(const uint8_t* data, size_t len, uint16_t crc = 0xFFFF);
+  // 'crc' is the finished value of the data before this piece, if any
+  uint32_t crc32(const uint8_t* data, size_t len, uint32_t crc = 0x00000000);
+  
+  // Write the trailer for the first 'len' bytes of 'data' just after them,
+  // most significant byte first, or check the one already there; 'len'
+  // excludes the trailer in both cases
+  void appendTrailer(MODE mode, uint8_t* data, size_t len);
+  bool checkTrailer(MODE mode, const uint8_t* data, size_t len);
+}
+
+#endif /* _PACKET_CRC_H_INCLUDED */
@@ -17,9 +17,56 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "PacketCommand.h"
+#include "PacketReliable.h"
+#include "PacketRequestTable.h"
 
 #include <Arduino.h>
 
+//LEB128 helpers shared by the varint methods: seven value bits per byte,
+//least significant group first, with the top bit set on all but the last
+template<typename T>
+static size_t varintSize(T value){
+  size_t n = 1;
+  while (value >= 0x80){
+    value >>= 7;
+    n++;
+  }
+  return n;
+}
+
+template<typename T>
+static void varintEncode(byte* dest, T value){
+  while (value >= 0x80){
+    *dest++ = (byte) (value | 0x80);
+    value >>= 7;
+  }
+  *dest = (byte) value;
+}
+
+//reads at most 'avail' bytes, rejecting encodings longer than T needs or
+//carrying bits beyond its width
+template<typename T>
+static PacketShared::STATUS varintDecode(const byte* src, size_t avail, T& value, size_t& used){
+  const size_t max_len = (8*sizeof(T) + 6)/7;
+  const byte last_mask = (byte) ((1 << (8*sizeof(T) - 7*(max_len - 1))) - 1);
+  T result = 0;
+  size_t n = min(avail, max_len);
+  for(size_t i=0; i < n; i++){
+    byte b = src[i];
+    if (i == max_len - 1 && b > last_mask){
+      return PacketShared::ERROR_INVALID_PACKET;
+    }
+    result |= ((T) (b & 0x7F)) << (7*i);
+    if ((b & 0x80) == 0){
+      value = result;
+      used = i + 1;
+      return PacketShared::SUCCESS;
+    }
+  }
+  //ran out of packet before the last byte
+  return (avail < max_len)? PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS : PacketShared::ERROR_INVALID_PACKET;
+}
+
 /**
  * Constructor makes sure some things are set.
  */
@@ -28,8 +75,22 @@ PacketCommand::PacketCommand(size_t maxCommands,
                              size_t outputBufferSize
                             ){
   _maxCommands = maxCommands;
+  _commandCount = 0;
   //allocate memory for the command lookup and intialize with all null pointers
-  _commandList = (CommandInfo*) calloc(maxCommands, sizeof(CommandInfo));
+  if (maxCommands > 0){
+    _commandList = (CommandInfo*) calloc(maxCommands, sizeof(CommandInfo));
+    _nameHashes  = (uint16_t*) calloc(maxCommands, sizeof(uint16_t));
+  }
+  else{ //commands come from a static table only
+    _commandList = nullptr;
+    _nameHashes  = nullptr;
+  }
+  _staticCommands     = nullptr;
+  _staticCommandCount = 0;
+  //dispatch tables are allocated lazily by addCommand, one per type ID length
+  for(size_t i=0; i < MAX_TYPE_ID_LEN; i++){
+    _dispatchTable[i] = nullptr;
+  }
   //allocate memory for the input buffer
   _inputBufferSize = inputBufferSize;
   if (_inputBufferSize > 0){ //allocate memory
@@ -46,12 +107,62 @@ PacketCommand::PacketCommand(size_t maxCommands,
   else{ //do not allocate anything
     _output_buffer = nullptr;
   }
+  //nothing is on loan from a queue yet
+  _saved_input_buffer = nullptr;
+  _saved_output_buffer = nullptr;
+  _saved_outputBufferSize = 0;
+  setWireByteOrder(PACKETCOMMAND_WIRE_BYTE_ORDER);
+  _checksum_mode = PacketCRC::NONE;
+  _checksum_failures = 0;
+  _pack_buffer   = nullptr;
+  _unpack_buffer = nullptr;
+  _input_unpacked = false;
+  _reassembly      = nullptr;
+  _reassembly_slot = -1;
+  _fragment_msg_id = 0;
+  _reliable        = nullptr;
+  _reliable_seq     = 0;
+  _reliable_pending = false;
+  _requests        = nullptr;
+  _input_request_id = 0;
+  _send_timestamp_micros = 0;
+  _stamp_buffer         = nullptr;
+  _input_send_timestamp = 0;
+  _input_latency        = 0;
+  _clock_offset         = 0;
+  _latency       = nullptr;
+  _latency_size  = 0;
+  _latency_count = 0;
+  #ifdef PACKETCOMMAND_PROFILING
+  _profiles      = nullptr;
+  _profile_size  = 0;
+  _profile_count = 0;
+  _profile_key   = 0;
+  _profile_match_failures    = 0;
+  _profile_unpack_errors     = 0;
+  _profile_last_unpack_error = PacketShared::SUCCESS;
+  #endif
+  _batch_buffer = nullptr;
+  _batch_size   = 0;
+  _batch_len    = 0;
+  _batch_count  = 0;
+  _batch_flags  = 0x00;
+  _batch_delay_micros   = 0;
+  _batch_started_micros = 0;
+  //no default handler or buffered send callback until one is registered,
+  //these are kept by reset()
+  memset(_default_command.type_id, 0, MAX_TYPE_ID_LEN);
+  _default_command.name = "";
+  _default_command.function = nullptr;
+  _default_command.output_flags = 0x00;
+  _send_buffered_callback = nullptr;
   reset();
 }
 
 /**
  * Resets the state of the command handler, undoing any addCommand calls,
- * callback registrations, and buffer state changes.
+ * callback registrations, and buffer state changes.  The default handler and
+ * the buffered send callback are kept.
  */
 PacketShared::STATUS PacketCommand::reset(){
   //wipe the command list clean
@@ -63,6 +174,12 @@ PacketShared::STATUS PacketCommand::reset(){
     _commandList[i].function = nullptr;
   }
   _commandCount = 0;
+  //clear out the dispatch tables, but keep their memory for reuse
+  for(size_t i=0; i < MAX_TYPE_ID_LEN; i++){
+    if (_dispatchTable[i] != nullptr){
+      memset(_dispatchTable[i], 0, DISPATCH_TABLE_SIZE);
+    }
+  }
   //reset input buffer
   _input_index = 0;
   _input_len   = 0;
@@ -91,10 +208,16 @@ PacketShared::STATUS PacketCommand::reset(){
  * by readBuffer, and is used to set up the handler function to deal with the remainder
  * of the command parsing.  The 'name' field is a human-readable string that
  * has no special meaning in the current the implmentation.
+ *
+ * The command is also entered into the dispatch table for its type ID length,
+ * indexed by the last byte of the type ID, so that matchCommand can find it
+ * in constant time.  If a type ID is registered twice the first entry wins,
+ * just as it would in a linear search of the command list.
  */
 PacketShared::STATUS PacketCommand::addCommand(const byte* type_id,
                                                 const char* name,
-                                                void (*function)(PacketCommand&)) {
+                                                void (*function)(PacketCommand&),
+                                                byte outputFlags) {
   byte cur_byte = 0x00;
   size_t type_id_len = strlen((char*) type_id);
   struct CommandInfo new_command;
@@ -109,13 +232,19 @@ PacketShared::STATUS PacketCommand::addCommand(const byte* type_id,
   PACKETCOMMAND_DEBUG_PORT.println("'");
   PACKETCOMMAND_DEBUG_PORT.println(type_id_len);
   #endif
-  if (_commandCount >= _maxCommands - 1){
+  if (_commandCount + 1 >= _maxCommands || _commandCount >= MAX_DISPATCH_COMMANDS){
       #ifdef PACKETCOMMAND_DEBUG
       PACKETCOMMAND_DEBUG_PORT.print(F("### Error: exceeded maxCommands="));
       PACKETCOMMAND_DEBUG_PORT.println(_maxCommands);
       #endif
       return PacketShared::ERROR_EXCEDED_MAX_COMMANDS;
   }
+  if (type_id_len == 0){
+    #ifdef PACKETCOMMAND_DEBUG
+    PACKETCOMMAND_DEBUG_PORT.println(F("### Error: 'type_id' cannot be empty"));
+    #endif
+    return PacketShared::ERROR_INVALID_TYPE_ID;
+  }
   if (type_id_len > MAX_TYPE_ID_LEN){
     #ifdef PACKETCOMMAND_DEBUG
     PACKETCOMMAND_DEBUG_PORT.print(F("### Error: 'type_id' cannot exceed MAX_TYPE_ID_LEN="));
@@ -186,11 +315,29 @@ PacketShared::STATUS PacketCommand::addCommand(const byte* type_id,
   }
   PACKETCOMMAND_DEBUG_PORT.println();
   #endif
+  //make sure there is a dispatch table for this type ID length
+  size_t depth = type_id_len - 1;
+  if (_dispatchTable[depth] == nullptr){
+    _dispatchTable[depth] = (uint8_t*) calloc(DISPATCH_TABLE_SIZE, sizeof(uint8_t));
+    if (_dispatchTable[depth] == nullptr){
+      #ifdef PACKETCOMMAND_DEBUG
+      PACKETCOMMAND_DEBUG_PORT.println(F("### Error: failed to allocate memory for the dispatch table"));
+      #endif
+      return PacketShared::ERROR_MEMALLOC_FAIL;
+    }
+  }
   //finish formatting command info
   new_command.name     = name;
   new_command.function = function;
+  new_command.output_flags = outputFlags;
   _commandList[_commandCount] = new_command;
+  _nameHashes[_commandCount]  = _hashName(name);
   _commandCount++;
+  //table entries hold the list index plus one, so zero marks an empty slot
+  uint8_t* slot = &(_dispatchTable[depth][type_id[depth]]);
+  if (*slot == 0){
+    *slot = (uint8_t) _commandCount;
+  }
   return PacketShared::SUCCESS;
 }
 
@@ -301,7 +448,114 @@ PacketShared::STATUS PacketCommand::processInput(){
   PACKETCOMMAND_DEBUG_PORT.print(F("#\t_input_index="));DEBUG_PORT.println(_input_index);
   PACKETCOMMAND_DEBUG_PORT.print(F("#\t_input_len="));DEBUG_PORT.println(_input_len);
   #endif
+  PacketShared::STATUS pcs = _checkInput();
+  if (pcs != PacketShared::SUCCESS){
+    return pcs;  //corrupted packets never reach a handler
+  }
+  return _processPacket(true);
+}
+
+/**
+ * Unwrap any envelopes and dispatch the packet inside them, or each packet
+ * of a batch, then put the input buffer back as it was
+ */
+PacketShared::STATUS PacketCommand::_processPacket(bool allowBatch){
+  byte*  input_buffer = _input_buffer;
+  size_t input_len    = _input_len;
+  size_t input_index  = _input_index;
+  int    outer_slot   = _reassembly_slot;
+  byte     input_flags      = _input_flags;
+  uint16_t input_request_id = _input_request_id;
+  uint32_t input_send_timestamp = _input_send_timestamp;
+  uint32_t input_latency        = _input_latency;
+  bool     reliable_pending     = _reliable_pending;
+  uint16_t reliable_seq         = _reliable_seq;
+  bool     input_unpacked       = _input_unpacked;
+  _reliable_pending = false;
+  PacketShared::STATUS pcs = _unwrapInput();
+  //a reliable packet whose contents could not be taken is left unacknowledged
+  bool deliver = _reliable_pending && (pcs == PacketShared::SUCCESS ||
+                                       pcs == PacketShared::INCOMPLETE_PACKET ||
+                                       pcs == PacketShared::PACKET_CONSUMED);
+  if (pcs == PacketShared::SUCCESS){
+    if (_input_len - _input_index >= 2 &&
+        _input_buffer[_input_index]   == PacketShared::ENVELOPE_PREFIX &&
+        _input_buffer[_input_index+1] == PacketShared::ENVELOPE_BATCH){
+      //batches are never nested
+      pcs = allowBatch? _processBatch() : PacketShared::ERROR_INVALID_PACKET;
+    }
+    else{
+      pcs = _matchAndDispatch();
+    }
+  }
+  if (_reassembly_slot != outer_slot){
+    _reassembly->release(_reassembly_slot);
+    _reassembly_slot = outer_slot;
+  }
+  if (_input_buffer != input_buffer){
+    _input_buffer = input_buffer;
+    _input_len    = input_len;
+    _input_index  = input_index;
+  }
+  _input_flags      = input_flags;
+  _input_request_id = input_request_id;
+  _input_send_timestamp = input_send_timestamp;
+  _input_latency        = input_latency;
+  if (deliver){
+    _reliable->delivered(_reliable_seq);
+  }
+  _reliable_pending = reliable_pending;
+  _reliable_seq     = reliable_seq;
+  _input_unpacked   = input_unpacked;
+  return pcs;
+}
+
+/**
+ * Dispatch each packet of a batch in turn, as if each had been received on
+ * its own.  A bad packet does not stop the rest; the first error is returned
+ * once all have been tried, unless the batch itself is malformed.
+ */
+PacketShared::STATUS PacketCommand::_processBatch(){
+  byte*  batch_buffer = _input_buffer;
+  size_t batch_len    = _input_len;
+  size_t pos          = _input_index + 2;
+  PacketShared::STATUS result = PacketShared::SUCCESS;
+  while (pos < batch_len){
+    size_t record_len, used;
+    PacketShared::STATUS pcs = varintDecode(batch_buffer + pos, batch_len - pos, record_len, used);
+    if (pcs == PacketShared::SUCCESS && record_len > batch_len - pos - used){
+      pcs = PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;
+    }
+    if (pcs != PacketShared::SUCCESS){
+      #ifdef PACKETCOMMAND_DEBUG
+      PACKETCOMMAND_DEBUG_PORT.println(F("### Error: malformed batch"));
+      #endif
+      result = pcs;
+      break;
+    }
+    pos += used;
+    _input_buffer = batch_buffer + pos;
+    _input_len    = record_len;
+    _input_index  = 0;
+    pcs = _processPacket(false);
+    if (pcs != PacketShared::SUCCESS && result == PacketShared::SUCCESS){
+      result = pcs;
+    }
+    pos += record_len;
+  }
+  _input_buffer = batch_buffer;
+  _input_len    = batch_len;
+  _input_index  = batch_len;
+  return result;
+}
+
+PacketShared::STATUS PacketCommand::_matchAndDispatch(){
   PacketShared::STATUS pcs = matchCommand();
+  #ifdef PACKETCOMMAND_PROFILING
+  if (pcs != PacketShared::SUCCESS || _profile_key == 0){
+    _profile_match_failures++;
+  }
+  #endif
   #ifdef PACKETCOMMAND_DEBUG
   PACKETCOMMAND_DEBUG_PORT.println(F("# (processInput)-after calling matchCommand()"));
   PACKETCOMMAND_DEBUG_PORT.print(F("#\t_input_index="));DEBUG_PORT.println(_input_index);
@@ -313,6 +567,9 @@ PacketShared::STATUS PacketCommand::processInput(){
     CommandInfo cmd = getCurrentCommand();
     PACKETCOMMAND_DEBUG_PORT.println(cmd.name);
     #endif
+    if (_input_flags & PacketShared::IPFLAG_HAS_SEND_TIMESTAMP){
+      _recordLatency();
+    }
   }
   else if (pcs == PacketShared::ERROR_NO_TYPE_ID_MATCH){  //valid ID but no command was matched
     #ifdef PACKETCOMMAND_DEBUG
@@ -331,35 +588,123 @@ PacketShared::STATUS PacketCommand::processInput(){
   return PacketShared::SUCCESS;
 }
 
+/**
+ * Match and dispatch queued input packets in place, one after another, until
+ * the queue is empty, 'maxPackets' have been handled, or 'timeBudgetMicros'
+ * have elapsed (checked before each packet, so a slow handler can overrun it
+ * once).  A zero limit means no limit.  Returns the number of packets taken
+ * off the queue, including any that failed to match.  This is the consumer
+ * side of the queue, so handlers must not dequeue from it themselves.
+ */
+size_t PacketCommand::processQueue(PacketQueue& pq, size_t maxPackets, uint32_t timeBudgetMicros){
+  #ifdef PACKETCOMMAND_DEBUG
+  PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::processQueue"));
+  #endif
+  uint32_t start_micros = (timeBudgetMicros > 0)? micros() : 0;
+  size_t n = 0;
+  while (maxPackets == 0 || n < maxPackets){
+    if (timeBudgetMicros > 0 && n > 0 && (uint32_t) (micros() - start_micros) >= timeBudgetMicros){
+      break;
+    }
+    if (peekInputBuffer(pq) != PacketShared::SUCCESS){
+      break;  //queue is empty
+    }
+    processInput();
+    releaseInputBuffer(pq);
+    n++;
+  }
+  return n;
+}
+
+/**
+ * Verify and strip the checksum trailer of the input packet, if checksums
+ * are enabled.
+ */
+PacketShared::STATUS PacketCommand::_checkInput(){
+  size_t trailer_len = (size_t) _checksum_mode;
+  if (trailer_len == 0){
+    return PacketShared::SUCCESS;
+  }
+  size_t len = _input_len;
+  if (len < trailer_len || !PacketCRC::checkTrailer(_checksum_mode, _input_buffer, len - trailer_len)){
+    #ifdef PACKETCOMMAND_DEBUG
+    PACKETCOMMAND_DEBUG_PORT.println(F("### Error: packet failed its checksum"));
+    #endif
+    _checksum_failures++;
+    return PacketShared::ERROR_CHECKSUM_MISMATCH;
+  }
+  _input_len = len - trailer_len;
+  return PacketShared::SUCCESS;
+}
+
 
 PacketShared::STATUS PacketCommand::lookupCommandByName(const char* name){
   _current_command = _default_command;
+  return lookupCommandByName(name, _current_command);
+}
+
+/**
+ * Find a command by name without disturbing the current command.  The result
+ * can be kept by the caller and passed to setupOutputCommand each time a
+ * packet is built, so that no string comparisons are needed on that path.
+ * Names registered with addCommand are compared by hash first and only
+ * confirmed with strcmp on a hash hit.  Names in a static command table have
+ * no stored hash, since that table uses no heap, and are compared with strcmp.
+ */
+PacketShared::STATUS PacketCommand::lookupCommandByName(const char* name, CommandInfo& command){
   #ifdef PACKETCOMMAND_DEBUG
   PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::lookupCommandByName"));
   PACKETCOMMAND_DEBUG_PORT.print(F("#\tSearching for command named = "));
   PACKETCOMMAND_DEBUG_PORT.println(name);
   #endif
-  for(size_t i=0; i < _maxCommands; i++){
+  if (name == nullptr){
+    return PacketShared::ERROR_NO_COMMAND_NAME_MATCH;
+  }
+  uint16_t name_hash = _hashName(name);
+  for(size_t i=0; i < _commandCount; i++){
     #ifdef PACKETCOMMAND_DEBUG
     PACKETCOMMAND_DEBUG_PORT.print(F("#\tsearching command at index="));
     PACKETCOMMAND_DEBUG_PORT.println(i);
-    PACKETCOMMAND_DEBUG_PORT.print(F("#\t&_commandList[i]="));
-    PACKETCOMMAND_DEBUG_PORT.println((int) &_commandList[i], HEX);
     PACKETCOMMAND_DEBUG_PORT.print(F("#\tname="));
     PACKETCOMMAND_DEBUG_PORT.println(_commandList[i].name);
     #endif
-    if(strcmp(_commandList[i].name,name) == 0){
+    if(_nameHashes[i] == name_hash && _commandList[i].name != nullptr &&
+       strcmp(_commandList[i].name,name) == 0){
        //a match has been found, so save it and stop
        #ifdef PACKETCOMMAND_DEBUG
        PACKETCOMMAND_DEBUG_PORT.println(F("#\tmatch found"));
        #endif
-       _current_command = _commandList[i];
+       command = _commandList[i];
+       return PacketShared::SUCCESS;
+    }
+  }
+  CommandInfo static_command;
+  for(size_t i=0; i < _staticCommandCount; i++){
+    _loadStaticCommand(i, static_command);
+    if(static_command.name != nullptr && strcmp(static_command.name,name) == 0){
+       command = static_command;
        return PacketShared::SUCCESS;
     }
   }
   return PacketShared::ERROR_NO_COMMAND_NAME_MATCH;
 }
 
+/**
+ * 16-bit FNV-1a style hash of a command name, folded down from 32 bits; a
+ * null name hashes like an empty one
+ */
+uint16_t PacketCommand::_hashName(const char* name){
+  uint32_t hash = 2166136261UL;
+  if (name == nullptr){
+    name = "";
+  }
+  while (*name != '\0'){
+    hash ^= (uint8_t) *name++;
+    hash *= 16777619UL;
+  }
+  return (uint16_t) ((hash >> 16) ^ (hash & 0xFFFF));
+}
+
 PacketShared::STATUS PacketCommand::recv() {
   bool gotPacket = false;
   return recv(gotPacket);
@@ -419,7 +764,7 @@ PacketShared::STATUS PacketCommand::set_recvTimestamp(uint32_t timestamp_micros)
 PacketShared::STATUS PacketCommand::matchCommand(){
   byte cur_byte = 0x00;
   _current_command = _default_command;
-  int type_id_index = 0;
+  size_t type_id_index = 0;
   //parse out type_id from header
   #ifdef PACKETCOMMAND_DEBUG
   PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::matchCommand"));
@@ -471,33 +816,50 @@ PacketShared::STATUS PacketCommand::matchCommand(){
     }
   }
   //For a valid type ID 'cur_byte' will be equal to its last byte and all previous
-  //bytes, if they exist,  must have been 0xFF (or nothing), so we only need to check the 
-  //corresponding byte for a match in the registered command list.  Also,
-  //since pkt_index must be < MAX_TYPE_ID_LEN at this point, it should be within
-  //the bounds; and since 'cur_byte' != 0x00 as well, shorter type IDs should
-  //not match since the unused bytes are initialized to 0x00.
-  for(size_t i=0; i < _maxCommands; i++){
-    #ifdef PACKETCOMMAND_DEBUG
-    PACKETCOMMAND_DEBUG_PORT.print(F("# Searching command at index="));
-    PACKETCOMMAND_DEBUG_PORT.println(i);
-    PACKETCOMMAND_DEBUG_PORT.print(F("#\ttype_id["));DEBUG_PORT.print(type_id_index);DEBUG_PORT.print(F("]="));
-    PACKETCOMMAND_DEBUG_PORT.println(_commandList[i].type_id[type_id_index]);
-    #endif
-    if(_commandList[i].type_id[type_id_index] == cur_byte){
-       //a match has been found, so save it and stop
-       #ifdef PACKETCOMMAND_DEBUG
-       PACKETCOMMAND_DEBUG_PORT.println(F("#match found"));
-       #endif
-       _current_command = _commandList[i];
-       return moveInputBufferIndex(1);  //increment to prepare for data unpacking
+  //bytes, if they exist,  must have been 0xFF (or nothing), so the pair 
+  //(type_id_index, cur_byte) identifies a registered command uniquely.  Also,
+  //since type_id_index must be < MAX_TYPE_ID_LEN at this point, it should be within
+  //the bounds; the dispatch table for that length maps 'cur_byte' directly
+  //to the command's position in the list (plus one, zero means unregistered).
+  //Commands from a static table are checked first.
+  if (_staticCommandCount > 0){
+    CommandInfo command;
+    if (_findStaticCommand((uint16_t) ((type_id_index << 8) | cur_byte), command) == PacketShared::SUCCESS){
+      #ifdef PACKETCOMMAND_DEBUG
+      PACKETCOMMAND_DEBUG_PORT.println(F("#match found in static command table"));
+      #endif
+      _current_command = command;
+      #ifdef PACKETCOMMAND_PROFILING
+      _profile_key = typeIdKey(command.type_id);
+      #endif
+      return moveInputBufferIndex(1);  //increment to prepare for data unpacking
     }
   }
+  uint8_t* table = _dispatchTable[type_id_index];
+  #ifdef PACKETCOMMAND_DEBUG
+  PACKETCOMMAND_DEBUG_PORT.print(F("# Looking up dispatch table for type_id_index="));
+  PACKETCOMMAND_DEBUG_PORT.println(type_id_index);
+  #endif
+  if (table != nullptr && table[cur_byte] != 0){
+     //a match has been found, so save it and stop
+     #ifdef PACKETCOMMAND_DEBUG
+     PACKETCOMMAND_DEBUG_PORT.println(F("#match found"));
+     #endif
+     _current_command = _commandList[table[cur_byte] - 1];
+     #ifdef PACKETCOMMAND_PROFILING
+     _profile_key = (uint16_t) ((type_id_index << 8) | cur_byte);
+     #endif
+     return moveInputBufferIndex(1);  //increment to prepare for data unpacking
+  }
   //no type ID has been matched
   if (_default_command.function != nullptr){  //set the default handler if it has been registered
     #ifdef PACKETCOMMAND_DEBUG
     PACKETCOMMAND_DEBUG_PORT.println(F("# Setting the default command handler"));
     #endif
     _current_command.function = _default_command.function;
+    #ifdef PACKETCOMMAND_PROFILING
+    _profile_key = 0;
+    #endif
     return moveInputBufferIndex(1);  //increment to prepare for data unpacking
   }
   else{  //otherwise return and error condition
@@ -508,6 +870,41 @@ PacketShared::STATUS PacketCommand::matchCommand(){
   }
 }
 
+/**
+ * Copy an entry out of the static command table, which lives in flash on AVR
+ */
+void PacketCommand::_loadStaticCommand(size_t index, CommandInfo& command){
+  #if defined(__AVR__)
+  memcpy_P(&command, &_staticCommands[index], sizeof(CommandInfo));
+  #else
+  command = _staticCommands[index];
+  #endif
+}
+
+/**
+ * Binary search of the static command table, which validCommandTable has
+ * guaranteed to be sorted by typeIdKey with no duplicates
+ */
+PacketShared::STATUS PacketCommand::_findStaticCommand(uint16_t key, CommandInfo& command){
+  size_t lo = 0;
+  size_t hi = _staticCommandCount;
+  while (lo < hi){
+    size_t mid = lo + (hi - lo)/2;
+    _loadStaticCommand(mid, command);
+    uint16_t mid_key = typeIdKey(command.type_id);
+    if (mid_key == key){
+      return PacketShared::SUCCESS;
+    }
+    else if (mid_key < key){
+      lo = mid + 1;
+    }
+    else{
+      hi = mid;
+    }
+  }
+  return PacketShared::ERROR_NO_TYPE_ID_MATCH;
+}
+
 /**
  * Send back the currently active command info structure
 */
@@ -531,7 +928,15 @@ PacketShared::STATUS PacketCommand::dispatchCommand() {
   PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::dispatchCommand"));
   #endif
   if (_current_command.function != nullptr){
+    #ifdef PACKETCOMMAND_PROFILING
+    uint16_t key           = _profile_key;  //a handler may match other packets
+    uint32_t unpack_errors = _profile_unpack_errors;
+    uint32_t start_micros  = micros();
+    #endif
     (*_current_command.function)(*this);
+    #ifdef PACKETCOMMAND_PROFILING
+    _recordProfile(key, micros() - start_micros, _profile_unpack_errors - unpack_errors);
+    #endif
     return PacketShared::SUCCESS;
   }
   else{
@@ -564,7 +969,7 @@ PacketShared::STATUS PacketCommand::setupOutputCommandByName(const char* name){
   }
 }
 
-PacketShared::STATUS PacketCommand::setupOutputCommand(PacketCommand::CommandInfo command){
+PacketShared::STATUS PacketCommand::setupOutputCommand(const PacketCommand::CommandInfo& command){
   #ifdef PACKETCOMMAND_DEBUG
   PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::setupOutputCommand"));
   #endif
@@ -574,6 +979,7 @@ PacketShared::STATUS PacketCommand::setupOutputCommand(PacketCommand::CommandInf
       if(cur_byte == 0x00){ break;}
       pack_byte(cur_byte);
   }
+  _output_flags |= command.output_flags;
   return PacketShared::SUCCESS;
 }
 
@@ -587,26 +993,19 @@ PacketShared::STATUS PacketCommand::send(){
 
 // Use the '_send_callback' to send return packet
 PacketShared::STATUS PacketCommand::send(bool& sentPacket){
-  uint32_t timestamp_micros = micros();
   #ifdef PACKETCOMMAND_DEBUG
   PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::send"));
-  PACKETCOMMAND_DEBUG_PORT.print(F("# \ttimestamp_micros: "));
-  PACKETCOMMAND_DEBUG_PORT.println(timestamp_micros);
   #endif
   if (_send_callback != nullptr){
-//    set_sendTimestamp(timestamp_micros);  //markdown the time write now
-//    if (_output_flags & PacketShared::OPFLAG_APPEND_SEND_TIMESTAMP){
-//      if ((_output_len + sizeof(uint32_t)) < PacketShared::DATA_BUFFER_SIZE){ //prevent buffer overrun
-//        pack_uint32(timestamp_micros);
-//      }
-//      else{
-//        #ifdef PACKETCOMMAND_DEBUG
-//        PACKETCOMMAND_DEBUG_PORT.println(F("### Error: appending send timestamp would overrun the output buffer"));
-//        #endif
-//      }
-//    }
+    OutputState saved;
+    PacketShared::STATUS pcs = _prepareOutput(saved);
+    if (pcs != PacketShared::SUCCESS){
+      sentPacket = false;
+      return pcs;
+    }
     //call the callback!
     sentPacket = (*_send_callback)(*this);
+    _restoreOutput(saved);
     return PacketShared::SUCCESS;
   }
   else{
@@ -619,26 +1018,18 @@ PacketShared::STATUS PacketCommand::send(bool& sentPacket){
 
 // Use the '_send_nonblocking_callback' to send return packet
 PacketShared::STATUS PacketCommand::send_nonblocking(){
-  uint32_t timestamp_micros = micros();
   #ifdef PACKETCOMMAND_DEBUG
   PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::send_nonblocking"));
-  PACKETCOMMAND_DEBUG_PORT.print(F("# \ttimestamp_micros: "));
-  PACKETCOMMAND_DEBUG_PORT.println(timestamp_micros);
   #endif
   if (_send_nonblocking_callback != nullptr){
-//    set_sendTimestamp(timestamp_micros);  //markdown the time write now
-//    if (_output_flags & PacketShared::OPFLAG_APPEND_SEND_TIMESTAMP){
-//      if ((_output_len + sizeof(uint32_t)) < PacketShared::DATA_BUFFER_SIZE){ //prevent buffer overrun
-//        pack_uint32(timestamp_micros);
-//      }
-//      else{
-//        #ifdef PACKETCOMMAND_DEBUG
-//        PACKETCOMMAND_DEBUG_PORT.println(F("### Error: appending send timestamp would overrun the output buffer"));
-//        #endif
-//      }
-//    }
+    OutputState saved;
+    PacketShared::STATUS pcs = _prepareOutput(saved);
+    if (pcs != PacketShared::SUCCESS){
+      return pcs;
+    }
     //call the nonblocking send callback
     (*_send_nonblocking_callback)(*this);
+    _restoreOutput(saved);
     return PacketShared::SUCCESS;
   }
   else{
@@ -651,22 +1042,11 @@ PacketShared::STATUS PacketCommand::send_nonblocking(){
 
 // Use the '_send_buffered_callback' to send return packet
 PacketShared::STATUS PacketCommand::send_buffered(){
-  uint32_t timestamp_micros = micros();
   if (_send_buffered_callback != nullptr){
-//    set_sendTimestamp(timestamp_micros);  //markdown the time write now
-//    if (_output_flags & PacketShared::OPFLAG_APPEND_SEND_TIMESTAMP){
-//      if ((_output_len + sizeof(uint32_t)) < PacketShared::DATA_BUFFER_SIZE){ //prevent buffer overrun
-//        pack_uint32(timestamp_micros);
-//      }
-//      else{
-//        #ifdef PACKETCOMMAND_DEBUG
-//        PACKETCOMMAND_DEBUG_PORT.println(F("### Error: appending send timestamp would overrun the output buffer"));
-//        #endif
-//      }
-//    }
-    //call the nonblocking send callback
-    (*_send_buffered_callback)(*this);
-    return PacketShared::SUCCESS;
+    if (_batch_size > 0){
+      return _coalesceOutput();
+    }
+    return _sendBuffered();
   }
   else{
     #ifdef PACKETCOMMAND_DEBUG
@@ -675,17 +1055,648 @@ PacketShared::STATUS PacketCommand::send_buffered(){
     return PacketShared::ERROR_NULL_HANDLER_FUNCTION_POINTER;
   }
 }
+PacketShared::STATUS PacketCommand::_sendBuffered(){
+  OutputState saved;
+  PacketShared::STATUS pcs = _prepareOutput(saved);
+  if (pcs != PacketShared::SUCCESS){
+    return pcs;
+  }
+  //call the nonblocking send callback
+  (*_send_buffered_callback)(*this);
+  _restoreOutput(saved);
+  return PacketShared::SUCCESS;
+}
+
+PacketShared::STATUS PacketCommand::setCoalescing(size_t maxFrameSize, uint32_t flushDelayMicros){
+  PacketShared::STATUS pcs = send_buffered_flush();
+  if (pcs != PacketShared::SUCCESS){
+    return pcs;
+  }
+  if (maxFrameSize > _ownOutputBufferSize()){
+    return PacketShared::ERROR_INVALID_CAPACITY;
+  }
+  if (maxFrameSize > 0 && _scratchBuffer(_batch_buffer, _ownOutputBufferSize()) == nullptr){
+    return PacketShared::ERROR_MEMALLOC_FAIL;
+  }
+  _batch_size         = maxFrameSize;
+  _batch_delay_micros = flushDelayMicros;
+  return PacketShared::SUCCESS;
+}
+
+/**
+ * Add the output packet to the frame being collected, as a record of its
+ * varint length followed by the packet.  The frame is sent first if the
+ * packet would not fit in it, and a packet too long to share a frame is sent
+ * on its own.  Output flags such as OPFLAG_COMPRESS apply to the whole frame,
+ * and a send timestamp is taken once for the frame when it is flushed, so
+ * room is kept for its envelope as soon as any packet in the frame asks for
+ * one.
+ */
+PacketShared::STATUS PacketCommand::_coalesceOutput(){
+  byte   frame_flags = _output_flags | ((_batch_count > 0)? _batch_flags : 0x00);
+  size_t frame_extra = (size_t) _checksum_mode;
+  if (frame_flags & PacketShared::OPFLAG_APPEND_SEND_TIMESTAMP){
+    frame_extra += 6;  //timestamp envelope
+  }
+  size_t frame_limit = _batch_size - min(_batch_size, frame_extra);
+  size_t record_len  = varintSize(_output_len) + _output_len;
+  PacketShared::STATUS pcs;
+  if (_batch_count > 0 && (_batch_len > frame_limit || record_len > frame_limit - _batch_len)){
+    pcs = send_buffered_flush();
+    if (pcs != PacketShared::SUCCESS){
+      return pcs;
+    }
+  }
+  if (frame_limit < 2 || record_len > frame_limit - 2){
+    return _sendBuffered();
+  }
+  if (_batch_count == 0){
+    _batch_buffer[0] = PacketShared::ENVELOPE_PREFIX;
+    _batch_buffer[1] = PacketShared::ENVELOPE_BATCH;
+    _batch_len   = 2;
+    _batch_flags = 0x00;
+    _batch_started_micros = micros();
+  }
+  varintEncode(_batch_buffer + _batch_len, _output_len);
+  memcpy(_batch_buffer + _batch_len + record_len - _output_len, _output_buffer, _output_len);
+  _batch_len   += record_len;
+  _batch_count += 1;
+  _batch_flags |= _output_flags;
+  return send_buffered_poll();
+}
+
+/**
+ * Send the collected frame through the send_buffered callback, leaving the
+ * output buffer as it was.  A frame holding a single packet is sent as that
+ * plain packet.  If it cannot be sent the frame is kept, to go out with the
+ * next flush.
+ */
+PacketShared::STATUS PacketCommand::send_buffered_flush(){
+  if (_batch_count == 0){
+    return PacketShared::SUCCESS;
+  }
+  if (_send_buffered_callback == nullptr){
+    return PacketShared::ERROR_NULL_HANDLER_FUNCTION_POINTER;
+  }
+  OutputState output = {_output_buffer, _output_len};
+  byte output_flags  = _output_flags;
+  if (_batch_count == 1){
+    size_t len, used;
+    varintDecode(_batch_buffer + 2, _batch_len - 2, len, used);
+    _output_buffer = _batch_buffer + 2 + used;
+    _output_len    = len;
+  }
+  else{
+    _output_buffer = _batch_buffer;
+    _output_len    = _batch_len;
+  }
+  _output_flags = _batch_flags;
+  PacketShared::STATUS pcs = _sendBuffered();
+  if (pcs == PacketShared::SUCCESS){
+    _batch_count = 0;
+  }
+  _restoreOutput(output);
+  _output_flags = output_flags;
+  return pcs;
+}
+
+PacketShared::STATUS PacketCommand::send_buffered_poll(){
+  if (_batch_count > 0 && _batch_delay_micros > 0 &&
+      (micros() - _batch_started_micros) >= _batch_delay_micros){
+    return send_buffered_flush();
+  }
+  return PacketShared::SUCCESS;
+}
+
+/**
+ * Send a packet that may be too long for the output buffer or the link.  The
+ * whole packet is the command's type ID followed by 'data'; if it does not
+ * fit in 'maxPacketSize' it is cut into numbered fragments, each sent in a
+ * [ENVELOPE_PREFIX][ENVELOPE_FRAGMENT] envelope with a PacketReassembly
+ * header.  The output buffer is overwritten, and the first send error stops
+ * the rest of the fragments.
+ */
+PacketShared::STATUS PacketCommand::sendFragmented(const CommandInfo& command, const byte* data, size_t len, size_t maxPacketSize){
+  #ifdef PACKETCOMMAND_DEBUG
+  PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::sendFragmented"));
+  #endif
+  size_t id_len = 0;
+  while (id_len < MAX_TYPE_ID_LEN && command.type_id[id_len] != 0x00){ id_len++;}
+  size_t packet_size = _outputBufferSize;
+  if (maxPacketSize > 0 && maxPacketSize < packet_size){
+    packet_size = maxPacketSize;
+  }
+  //every packet carries the checksum trailer, and the timestamp envelope
+  //when the command asks for one
+  size_t trailer_len = (size_t) _checksum_mode;
+  if (command.output_flags & PacketShared::OPFLAG_APPEND_SEND_TIMESTAMP){
+    trailer_len += 6;
+  }
+  size_t total_len   = id_len + len;
+  PacketShared::STATUS pcs;
+  if (total_len + trailer_len <= packet_size){
+    resetOutputBuffer();
+    setupOutputCommand(command);
+    pcs = _packBytes(data, len);
+    if (pcs != PacketShared::SUCCESS){
+      return pcs;
+    }
+    return send();
+  }
+  const size_t header_len = 2 + PacketReassembly::HEADER_SIZE;
+  if (packet_size <= header_len + trailer_len){
+    return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;
+  }
+  size_t chunk_len = packet_size - header_len - trailer_len;
+  size_t count     = (total_len + chunk_len - 1)/chunk_len;
+  if (count > PacketReassembly::MAX_FRAGMENTS || (count - 1)*chunk_len > 0xFFFF){
+    #ifdef PACKETCOMMAND_DEBUG
+    PACKETCOMMAND_DEBUG_PORT.println(F("### Error: packet needs too many fragments"));
+    #endif
+    return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;
+  }
+  byte msg_id = _fragment_msg_id++;
+  for(size_t i=0; i < count; i++){
+    size_t offset = i*chunk_len;
+    size_t end    = min(offset + chunk_len, total_len);
+    resetOutputBuffer();
+    _output_flags |= command.output_flags;
+    pack_byte(PacketShared::ENVELOPE_PREFIX);
+    pack_byte(PacketShared::ENVELOPE_FRAGMENT);
+    pack_byte(msg_id);
+    pack_byte((byte) i);
+    pack_byte((byte) count);
+    pack_byte((byte) (offset >> 8));
+    pack_byte((byte) (offset & 0xFF));
+    //the part of the type ID and the part of the data in this fragment
+    if (offset < id_len){
+      _packBytes(command.type_id + offset, min(end, id_len) - offset);
+    }
+    if (end > id_len){
+      size_t start = (offset > id_len)? offset - id_len : 0;
+      _packBytes(data + start, end - id_len - start);
+    }
+    pcs = send();
+    if (pcs != PacketShared::SUCCESS){
+      return pcs;
+    }
+  }
+  return PacketShared::SUCCESS;
+}
+
+/**
+ * Finish the output packet just before a send callback is called, by
+ * compressing it when OPFLAG_COMPRESS is set, stamping it with the send time
+ * when OPFLAG_APPEND_SEND_TIMESTAMP is set, and then adding the checksum
+ * trailer when enabled.  The callback must take the length it sends during
+ * the call, as _restoreOutput puts the buffer back as it was afterwards, so
+ * that the same packet can be sent again.
+ */
+PacketShared::STATUS PacketCommand::_prepareOutput(OutputState& saved){
+  saved.buffer = _output_buffer;
+  saved.len    = _output_len;
+  if (_output_flags & PacketShared::OPFLAG_COMPRESS){
+    PacketShared::STATUS pcs = _compressOutput();
+    if (pcs != PacketShared::SUCCESS){
+      return pcs;
+    }
+  }
+  if (_output_flags & PacketShared::OPFLAG_APPEND_SEND_TIMESTAMP){
+    PacketShared::STATUS pcs = _stampOutput();
+    if (pcs != PacketShared::SUCCESS){
+      _restoreOutput(saved);
+      return pcs;
+    }
+  }
+  size_t len = _output_len;
+  size_t trailer_len = (size_t) _checksum_mode;
+  if (trailer_len > 0){
+    //the packet may have moved into a scratch buffer, which has the size of
+    //our own output buffer rather than that of a leased queue slot
+    size_t buffer_size = (_output_buffer == saved.buffer)? _outputBufferSize : _ownOutputBufferSize();
+    if (len > buffer_size || trailer_len > buffer_size - len){
+      #ifdef PACKETCOMMAND_DEBUG
+      PACKETCOMMAND_DEBUG_PORT.println(F("### Error: no room in the output buffer for the checksum"));
+      #endif
+      _restoreOutput(saved);
+      return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;
+    }
+    PacketCRC::appendTrailer(_checksum_mode, _output_buffer, len);
+    _output_len = len + trailer_len;
+  }
+  return PacketShared::SUCCESS;
+}
+void PacketCommand::_restoreOutput(const OutputState& saved){
+  _output_buffer = saved.buffer;
+  _output_len    = saved.len;
+}
+
+/**
+ * Replace the output packet with a compressed envelope in the pack buffer,
+ * [ENVELOPE_PREFIX][ENVELOPE_COMPRESSED][PacketLZ data], but only if that is
+ * shorter; packets that do not shrink go out unchanged.
+ */
+PacketShared::STATUS PacketCommand::_compressOutput(){
+  size_t pack_size = _ownOutputBufferSize();
+  byte* pack_buffer = _scratchBuffer(_pack_buffer, pack_size);
+  if (pack_buffer == nullptr){
+    return PacketShared::ERROR_MEMALLOC_FAIL;
+  }
+  size_t len = _output_len;
+  if (len <= 2 || pack_size <= 2){
+    return PacketShared::SUCCESS;
+  }
+  //the compressed data must beat the original by more than the header, and
+  //fit in the pack buffer, which may be smaller than a leased queue slot
+  size_t packed_len = PacketLZ::compress(_output_buffer, len, pack_buffer + 2, min(len - 3, pack_size - 2));
+  if (packed_len == 0){
+    return PacketShared::SUCCESS;
+  }
+  pack_buffer[0] = PacketShared::ENVELOPE_PREFIX;
+  pack_buffer[1] = PacketShared::ENVELOPE_COMPRESSED;
+  _output_buffer = pack_buffer;
+  _output_len    = packed_len + 2;
+  return PacketShared::SUCCESS;
+}
+
+/**
+ * Wrap the output packet in a timestamp envelope in the stamp buffer,
+ * [ENVELOPE_PREFIX][ENVELOPE_TIMESTAMP][micros(), big endian uint32][packet].
+ * The timestamp goes in front rather than at the end, where the receiver
+ * could not tell it from the packet's own data, and is taken as the last
+ * step before the checksum so that it is as close to the send as can be.
+ */
+PacketShared::STATUS PacketCommand::_stampOutput(){
+  size_t stamp_size = _ownOutputBufferSize();
+  byte* stamp_buffer = _scratchBuffer(_stamp_buffer, stamp_size);
+  if (stamp_buffer == nullptr){
+    return PacketShared::ERROR_MEMALLOC_FAIL;
+  }
+  size_t len = _output_len;
+  if (stamp_size < 6 || len > stamp_size - 6){
+    #ifdef PACKETCOMMAND_DEBUG
+    PACKETCOMMAND_DEBUG_PORT.println(F("### Error: no room in the output buffer for the send timestamp"));
+    #endif
+    return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;
+  }
+  memmove(stamp_buffer + 6, _output_buffer, len);
+  uint32_t timestamp_micros = micros();
+  set_sendTimestamp(timestamp_micros);
+  stamp_buffer[0] = PacketShared::ENVELOPE_PREFIX;
+  stamp_buffer[1] = PacketShared::ENVELOPE_TIMESTAMP;
+  stamp_buffer[2] = (byte) (timestamp_micros >> 24);
+  stamp_buffer[3] = (byte) (timestamp_micros >> 16);
+  stamp_buffer[4] = (byte) (timestamp_micros >> 8);
+  stamp_buffer[5] = (byte) timestamp_micros;
+  _output_buffer = stamp_buffer;
+  _output_len    = len + 6;
+  return PacketShared::SUCCESS;
+}
+
+/**
+ * While the input packet is an envelope, point the input buffer at the
+ * packet inside it.  A compressed packet may hold a fragment and a completed
+ * fragmented packet may itself be compressed, but neither envelope is ever
+ * nested in one of its own kind.  A batch is left in place for the caller.
+ * _processPacket puts the original buffer back after dispatch.  Returns
+ * INCOMPLETE_PACKET for a fragment that was stored without completing its
+ * packet.
+ */
+PacketShared::STATUS PacketCommand::_unwrapInput(){
+  while (true){
+    size_t index = _input_index;
+    size_t len   = _input_len;
+    if (index >= len || _input_buffer[index] != PacketShared::ENVELOPE_PREFIX){
+      return PacketShared::SUCCESS;   //a plain packet
+    }
+    if (len - index < 2){
+      return PacketShared::ERROR_INVALID_TYPE_ID;
+    }
+    const byte* contents = _input_buffer + index + 2;
+    size_t contents_len  = len - index - 2;
+    PacketShared::STATUS pcs;
+    switch (_input_buffer[index + 1]){
+      case PacketShared::ENVELOPE_COMPRESSED: {
+        byte* unpack_buffer = _scratchBuffer(_unpack_buffer, _inputBufferSize);
+        if (unpack_buffer == nullptr){
+          return PacketShared::ERROR_MEMALLOC_FAIL;
+        }
+        if (_input_unpacked){
+          //already reading from the unpack buffer, e.g. a batch record
+          return PacketShared::ERROR_INVALID_PACKET;
+        }
+        size_t unpacked_len = 0;
+        pcs = PacketLZ::decompress(contents, contents_len, unpack_buffer, _inputBufferSize, unpacked_len);
+        if (pcs != PacketShared::SUCCESS){
+          #ifdef PACKETCOMMAND_DEBUG
+          PACKETCOMMAND_DEBUG_PORT.println(F("### Error: compressed packet could not be decompressed"));
+          #endif
+          return pcs;
+        }
+        _input_buffer = unpack_buffer;
+        _input_len    = unpacked_len;
+        _input_index  = 0;
+        _input_unpacked = true;
+        break;
+      }
+      case PacketShared::ENVELOPE_FRAGMENT: {
+        if (_reassembly == nullptr || _reassembly_slot >= 0){
+          #ifdef PACKETCOMMAND_DEBUG
+          PACKETCOMMAND_DEBUG_PORT.println(F("### Error: received a fragment with no PacketReassembly attached"));
+          #endif
+          return PacketShared::ERROR_INVALID_PACKET;
+        }
+        int slot = -1;
+        pcs = _reassembly->add(contents, contents_len, slot);
+        if (pcs != PacketShared::SUCCESS){
+          return pcs;
+        }
+        _reassembly_slot = slot;
+        _input_buffer = _reassembly->getBuffer(slot);
+        _input_len    = _reassembly->getLength(slot);
+        _input_index  = 0;
+        _input_unpacked = false;   //the unpack buffer is free again
+        break;
+      }
+      case PacketShared::ENVELOPE_BATCH:
+        return PacketShared::SUCCESS;   //left for _processBatch to walk
+      case PacketShared::ENVELOPE_RELIABLE: {
+        if (_reliable == nullptr || contents_len < 2){
+          return PacketShared::ERROR_INVALID_PACKET;
+        }
+        if (_reliable_pending){
+          return PacketShared::ERROR_INVALID_PACKET;   //never nested
+        }
+        uint16_t seq = ((uint16_t) contents[0] << 8) | contents[1];
+        pcs = _reliable->receiveData(seq);
+        if (pcs != PacketShared::SUCCESS){
+          return pcs;   //a duplicate
+        }
+        _reliable_seq     = seq;   //delivered once the rest is unwrapped
+        _reliable_pending = true;
+        _input_index = index + PacketReliable::HEADER_SIZE;
+        break;
+      }
+      case PacketShared::ENVELOPE_ACK:
+        if (_reliable == nullptr){
+          return PacketShared::ERROR_INVALID_PACKET;
+        }
+        return _reliable->receiveAck(contents, contents_len);
+      case PacketShared::ENVELOPE_QUERY:
+      case PacketShared::ENVELOPE_REPLY: {
+        if (contents_len < 2){
+          return PacketShared::ERROR_INVALID_PACKET;
+        }
+        uint16_t request_id = ((uint16_t) contents[0] << 8) | contents[1];
+        _input_index = index + PacketRequestTable::HEADER_SIZE;
+        if (_input_buffer[index + 1] == PacketShared::ENVELOPE_QUERY){
+          _input_flags     |= PacketShared::IPFLAG_IS_QUERY;
+          _input_request_id = request_id;
+          break;
+        }
+        if (_requests == nullptr){
+          return PacketShared::ERROR_INVALID_PACKET;
+        }
+        return _requests->deliverReply(request_id);
+      }
+      case PacketShared::ENVELOPE_TIMESTAMP: {
+        if (contents_len < 4){
+          return PacketShared::ERROR_INVALID_PACKET;
+        }
+        uint32_t sent = ((uint32_t) contents[0] << 24) | ((uint32_t) contents[1] << 16) |
+                        ((uint32_t) contents[2] << 8)  |  (uint32_t) contents[3];
+        uint32_t received = (_recv_timestamp_micros != 0)? _recv_timestamp_micros : micros();
+        int32_t latency = (int32_t) (received - sent) + _clock_offset;
+        _input_send_timestamp = sent;
+        _input_latency = (latency > 0)? (uint32_t) latency : 0;
+        _input_flags  |= PacketShared::IPFLAG_HAS_SEND_TIMESTAMP;
+        _input_index   = index + 6;
+        break;
+      }
+      default:
+        #ifdef PACKETCOMMAND_DEBUG
+        PACKETCOMMAND_DEBUG_PORT.print(F("### Error: unknown envelope type: "));
+        PACKETCOMMAND_DEBUG_PORT.println(_input_buffer[index + 1], HEX);
+        #endif
+        return PacketShared::ERROR_INVALID_TYPE_ID;
+    }
+  }
+}
+
+/**
+ * Scratch buffers are only allocated once a feature that needs them is used
+ */
+byte* PacketCommand::_scratchBuffer(byte*& buffer, size_t size){
+  if (buffer == nullptr){
+    buffer = (byte*) calloc(size, sizeof(byte));
+    #ifdef PACKETCOMMAND_DEBUG
+    if (buffer == nullptr){
+      PACKETCOMMAND_DEBUG_PORT.println(F("### Error: failed to allocate a scratch buffer"));
+    }
+    #endif
+  }
+  return buffer;
+}
 
 PacketShared::STATUS PacketCommand::set_sendTimestamp(uint32_t timestamp_micros){
   _send_timestamp_micros = timestamp_micros;
   return PacketShared::SUCCESS;
 }
 
+PacketShared::STATUS PacketCommand::beginLatencyHistograms(size_t maxCommands){
+  if (maxCommands == 0){
+    return PacketShared::ERROR_INVALID_CAPACITY;
+  }
+  LatencyEntry* latency = (LatencyEntry*) calloc(maxCommands, sizeof(LatencyEntry));
+  if (latency == nullptr){
+    #ifdef PACKETCOMMAND_DEBUG
+    PACKETCOMMAND_DEBUG_PORT.println(F("### Error: failed to allocate memory for the latency histograms"));
+    #endif
+    return PacketShared::ERROR_MEMALLOC_FAIL;
+  }
+  free(_latency);
+  _latency       = latency;
+  _latency_size  = maxCommands;
+  _latency_count = 0;
+  return PacketShared::SUCCESS;
+}
+
+const PacketLatencyHistogram* PacketCommand::getLatencyHistogram(const CommandInfo& command){
+  uint16_t key = typeIdKey(command.type_id);
+  for(size_t i=0; i < _latency_count; i++){
+    if (_latency[i].key == key){
+      return &_latency[i].histogram;
+    }
+  }
+  return nullptr;
+}
+
+void PacketCommand::resetLatencyHistograms(){
+  _latency_count = 0;
+}
+
+/**
+ * Add the latency of the packet being dispatched to the histogram of the
+ * matched command, starting one if there is room
+ */
+void PacketCommand::_recordLatency(){
+  if (_latency == nullptr){
+    return;
+  }
+  uint16_t key = typeIdKey(_current_command.type_id);
+  size_t i = 0;
+  while (i < _latency_count && _latency[i].key != key){ i++;}
+  if (i == _latency_count){
+    if (_latency_count >= _latency_size){
+      return;   //no room for another command
+    }
+    _latency[i].key = key;
+    _latency[i].histogram.reset();
+    _latency_count++;
+  }
+  _latency[i].histogram.add(_input_latency);
+}
+
+#ifdef PACKETCOMMAND_PROFILING
+PacketShared::STATUS PacketCommand::beginProfiling(size_t maxCommands){
+  if (maxCommands == 0){
+    return PacketShared::ERROR_INVALID_CAPACITY;
+  }
+  CommandProfile* profiles = (CommandProfile*) calloc(maxCommands, sizeof(CommandProfile));
+  if (profiles == nullptr){
+    #ifdef PACKETCOMMAND_DEBUG
+    PACKETCOMMAND_DEBUG_PORT.println(F("### Error: failed to allocate memory for the command profiles"));
+    #endif
+    return PacketShared::ERROR_MEMALLOC_FAIL;
+  }
+  free(_profiles);
+  _profiles     = profiles;
+  _profile_size = maxCommands;
+  resetProfiling();
+  return PacketShared::SUCCESS;
+}
+
+const PacketCommand::CommandProfile* PacketCommand::getCommandProfile(const CommandInfo& command){
+  uint16_t key = typeIdKey(command.type_id);
+  for(size_t i=0; i < _profile_count; i++){
+    if (_profiles[i].key == key){
+      return &_profiles[i];
+    }
+  }
+  return nullptr;
+}
+
+void PacketCommand::resetProfiling(){
+  _profile_count = 0;
+  _profile_match_failures = 0;
+}
+
+/**
+ * Add one dispatch to the counters of the command with 'key', starting an
+ * entry for it if there is room
+ */
+void PacketCommand::_recordProfile(uint16_t key, uint32_t elapsed, uint32_t unpackErrors){
+  if (_profiles == nullptr){
+    return;
+  }
+  size_t i = 0;
+  while (i < _profile_count && _profiles[i].key != key){ i++;}
+  if (i == _profile_count){
+    if (_profile_count >= _profile_size){
+      return;   //no room for another command
+    }
+    memset(&_profiles[i], 0, sizeof(CommandProfile));
+    _profiles[i].key = key;
+    _profile_count++;
+  }
+  CommandProfile& profile = _profiles[i];
+  profile.calls++;
+  profile.total_micros += elapsed;
+  if (elapsed > profile.max_micros){
+    profile.max_micros = elapsed;
+  }
+  if (unpackErrors > 0){
+    profile.unpack_errors    += unpackErrors;
+    profile.last_unpack_error = _profile_last_unpack_error;
+  }
+}
+
+PacketShared::STATUS PacketCommand::addProfilingCommand(const byte* type_id, const char* name){
+  return addCommand(type_id, name, _handleProfiling);
+}
+
+/**
+ * Answer with the profiling counters, starting from the entry whose index is
+ * the optional first byte of the request and going on for as many entries as
+ * fit in the output buffer:
+ *   [type ID] [match failures, uint32] [first index, uint8] [entries, uint8]
+ *   then per entry [key, uint16] [calls, uint32] [total micros, uint64]
+ *                  [max micros, uint32] [unpack errors, uint32]
+ * where 'entries' counts the entries in this reply.
+ * A request sent as a query gets its reply routed back to the querier.
+ */
+void PacketCommand::_handleProfiling(PacketCommand& this_pCmd){
+  CommandInfo command = this_pCmd.getCurrentCommand();
+  byte first = 0;
+  if ((size_t) this_pCmd.getInputBufferIndex() < this_pCmd.getInputLen()){
+    this_pCmd.unpack_byte(first);
+  }
+  if (this_pCmd.inputIsQuery()){
+    this_pCmd.setupOutputReply();
+  }
+  else{
+    this_pCmd.resetOutputBuffer();
+  }
+  this_pCmd.setupOutputCommand(command);
+  //the entry count is filled in once it is known how many fit
+  if (this_pCmd.pack(this_pCmd._profile_match_failures, first, (byte) 0) != PacketShared::SUCCESS){
+    return;
+  }
+  size_t count_index = this_pCmd._output_index - 1;
+  byte   count = 0;
+  for(size_t i=first; i < this_pCmd._profile_count && count < 0xFF; i++){
+    const CommandProfile& profile = this_pCmd._profiles[i];
+    if (this_pCmd.pack(profile.key, profile.calls, profile.total_micros,
+                       profile.max_micros, profile.unpack_errors) != PacketShared::SUCCESS){
+      break;   //the rest can be asked for starting at this entry
+    }
+    count++;
+  }
+  this_pCmd._output_buffer[count_index] = count;
+  this_pCmd.send();
+}
+#endif
+
+/**
+ * Start the output packet with the request ID of the query being handled,
+ * so that the querier's PacketRequestTable can route the reply; follow with
+ * setupOutputCommand and the reply data as usual
+ */
+PacketShared::STATUS PacketCommand::setupOutputReply(){
+  if (!inputIsQuery()){
+    #ifdef PACKETCOMMAND_DEBUG
+    PACKETCOMMAND_DEBUG_PORT.println(F("### Error: setupOutputReply called while not handling a query"));
+    #endif
+    return PacketShared::ERROR_INVALID_PACKET;
+  }
+  resetOutputBuffer();
+  pack_byte(PacketShared::ENVELOPE_PREFIX);
+  pack_byte(PacketShared::ENVELOPE_REPLY);
+  pack_byte((byte) (_input_request_id >> 8));
+  return pack_byte((byte) (_input_request_id & 0xFF));
+}
+
 // Use the '_reply_send_callback' to send a quick reply
 PacketShared::STATUS PacketCommand::reply_send(){
   if (_reply_send_callback != nullptr){
+    OutputState saved;
+    PacketShared::STATUS pcs = _prepareOutput(saved);
+    if (pcs != PacketShared::SUCCESS){
+      return pcs;
+    }
     //call the send callback
     (*_reply_send_callback)(*this);
+    _restoreOutput(saved);
     return PacketShared::SUCCESS;
   }
   else{
@@ -786,32 +1797,34 @@ PacketShared::STATUS PacketCommand::enqueueInputBuffer(PacketQueue& pq){
   #ifdef PACKETCOMMAND_DEBUG
   PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::enqueueInputBuffer"));
   #endif
-  //build a packet struct to hold current buffer state
-  PacketShared::Packet pkt;
-  pkt.length = min((size_t) _input_len, PacketShared::DATA_BUFFER_SIZE);
-  pkt.timestamp = _recv_timestamp_micros;  //this should have been recorded as close to the RX time as possible
-  pkt.flags  = _input_flags;
-  memcpy(pkt.data, _input_buffer, pkt.length);
-  PacketShared::STATUS pqs;
-  pqs = pq.enqueue(pkt);
-  return pqs;
+  //copy the current buffer state straight into the next free slot
+  size_t max_len;
+  byte* slot_data = pq.reserve(max_len, _input_len);  //compact queues take the whole packet
+  if (slot_data == nullptr){
+    return PacketShared::ERROR_QUEUE_OVERFLOW;
+  }
+  size_t len = min((size_t) _input_len, max_len);
+  memcpy(slot_data, _input_buffer, len);
+  //the timestamp should have been recorded as close to the RX time as possible
+  return pq.commit(len, _recv_timestamp_micros, _input_flags);
 }
 
 PacketShared::STATUS PacketCommand::dequeueInputBuffer(PacketQueue& pq){
   #ifdef PACKETCOMMAND_DEBUG
   PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::dequeueInputBuffer"));
   #endif
-  //build a packet struct to hold current buffer state
-  PacketShared::Packet pkt;
-  PacketShared::STATUS pqs;
-  pqs = pq.dequeue(pkt);
-  if(pqs == PacketShared::SUCCESS){
+  //copy the oldest slot straight into the input buffer
+  size_t   len;
+  uint32_t timestamp;
+  byte     flags;
+  byte* slot_data = pq.peek(len, timestamp, flags);
+  if(slot_data != nullptr){
     _input_index = 0;
-    _input_len = min(pkt.length, _inputBufferSize);
-    _input_flags = pkt.flags;
-    _recv_timestamp_micros = pkt.timestamp; //FIXME make sure timestamp is in micros
-    memcpy(_input_buffer, pkt.data, _input_len);
-    return PacketShared::SUCCESS;
+    _input_len = min(len, _inputBufferSize);
+    _input_flags = flags;
+    _recv_timestamp_micros = timestamp; //FIXME make sure timestamp is in micros
+    memcpy(_input_buffer, slot_data, _input_len);
+    return pq.release();
   }
   else{
     //zero out on failure
@@ -819,11 +1832,56 @@ PacketShared::STATUS PacketCommand::dequeueInputBuffer(PacketQueue& pq){
     _input_len   = 0;
     _input_flags = 0x00;
     _recv_timestamp_micros = 0;
-    return pqs;
+    return PacketShared::ERROR_QUEUE_UNDERFLOW;
   }
 }
 
+/**
+ * Point the input buffer at the oldest packet in the queue, without copying
+ * it, so that it can be matched and dispatched in place.  The slot stays
+ * owned by the input buffer until releaseInputBuffer is called, which must
+ * happen before the next packet is received or peeked.
+ */
+PacketShared::STATUS PacketCommand::peekInputBuffer(PacketQueue& pq){
+  #ifdef PACKETCOMMAND_DEBUG
+  PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::peekInputBuffer"));
+  #endif
+  size_t   len;
+  uint32_t timestamp;
+  byte     flags;
+  byte* slot_data = pq.peek(len, timestamp, flags);
+  if(slot_data != nullptr){
+    if (_saved_input_buffer == nullptr){ //not already pointing into a queue
+      _saved_input_buffer = _input_buffer;
+    }
+    _input_buffer = slot_data;
+    _input_index = 0;
+    _input_len = len;
+    _input_flags = flags;
+    _recv_timestamp_micros = timestamp;
+    return PacketShared::SUCCESS;
+  }
+  else{
+    //zero out on failure
+    _input_index = 0;
+    _input_len   = 0;
+    _input_flags = 0x00;
+    _recv_timestamp_micros = 0;
+    return PacketShared::ERROR_QUEUE_UNDERFLOW;
+  }
+}
 
+PacketShared::STATUS PacketCommand::releaseInputBuffer(PacketQueue& pq){
+  #ifdef PACKETCOMMAND_DEBUG
+  PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::releaseInputBuffer"));
+  #endif
+  if (_saved_input_buffer != nullptr){ //restore our own buffer
+    _input_buffer = _saved_input_buffer;
+    _saved_input_buffer = nullptr;
+  }
+  resetInputBuffer();
+  return pq.release();
+}
 
 void  PacketCommand::allocateOutputBuffer(size_t len){
   _outputBufferSize = len;
@@ -875,39 +1933,114 @@ PacketShared::STATUS PacketCommand::enqueueOutputBuffer(PacketQueue& pq){
   #ifdef PACKETCOMMAND_DEBUG
   PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::enqueueOutputBuffer"));
   #endif
-  //build a packet struct to hold current buffer state
-  PacketShared::Packet pkt;
-  pkt.length = min((size_t) _output_len, PacketShared::DATA_BUFFER_SIZE);
-  pkt.timestamp = 0;
-  pkt.flags  = _output_flags;
-  memcpy(pkt.data, _output_buffer, pkt.length);
-  PacketShared::STATUS pqs;
-  pqs = pq.enqueue(pkt);
-  return pqs;
+  //copy the current buffer state straight into the next free slot
+  size_t max_len;
+  byte* slot_data = pq.reserve(max_len, _output_len);  //compact queues take the whole packet
+  if (slot_data == nullptr){
+    return PacketShared::ERROR_QUEUE_OVERFLOW;
+  }
+  size_t len = min((size_t) _output_len, max_len);
+  memcpy(slot_data, _output_buffer, len);
+  return pq.commit(len, 0, _output_flags);
 }
 
 PacketShared::STATUS PacketCommand::dequeueOutputBuffer(PacketQueue& pq){
   #ifdef PACKETCOMMAND_DEBUG
   PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::dequeueOutputBuffer"));
   #endif
-  //build a packet struct to hold current buffer state
-  PacketShared::Packet pkt;
-  PacketShared::STATUS pqs;
-  pqs = pq.dequeue(pkt);
-  if(pqs == PacketShared::SUCCESS){
-    _output_len = min(pkt.length, _outputBufferSize);
+  //copy the oldest slot straight into the output buffer
+  size_t   len;
+  uint32_t timestamp;
+  byte     flags;
+  byte* slot_data = pq.peek(len, timestamp, flags);
+  if(slot_data != nullptr){
+    _output_len = min(len, _outputBufferSize);
     _output_index = _output_len;  //IMPORTANT! set output index end of last entry so stuff could be added properly
-    _output_flags = pkt.flags;
-    memcpy(_output_buffer, pkt.data, _output_len);
-    return PacketShared::SUCCESS;
+    _output_flags = flags;
+    memcpy(_output_buffer, slot_data, _output_len);
+    return pq.release();
   }
   else{
     //zero out on failure
     _output_index = 0;
     _output_len = 0;
     _output_flags = 0x00;
-    return pqs;
+    return PacketShared::ERROR_QUEUE_UNDERFLOW;
+  }
+}
+
+PacketShared::STATUS PacketCommand::enqueueOutputBuffer(PacketPriorityQueue& ppq){
+  #ifdef PACKETCOMMAND_DEBUG
+  PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::enqueueOutputBuffer(PacketPriorityQueue)"));
+  #endif
+  if (ppq.levels() == 0){
+    return PacketShared::ERROR_QUEUE_OVERFLOW;
+  }
+  return enqueueOutputBuffer(ppq.level(ppq.levelFor(_output_buffer, _output_len, _output_flags)));
+}
+
+PacketShared::STATUS PacketCommand::dequeueOutputBuffer(PacketPriorityQueue& ppq){
+  #ifdef PACKETCOMMAND_DEBUG
+  PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::dequeueOutputBuffer(PacketPriorityQueue)"));
+  #endif
+  int level = ppq.highestReady();
+  if (level < 0){
+    //zero out on failure
+    _output_index = 0;
+    _output_len = 0;
+    _output_flags = 0x00;
+    return PacketShared::ERROR_QUEUE_UNDERFLOW;
+  }
+  return dequeueOutputBuffer(ppq.level(level));
+}
+
+PacketShared::STATUS PacketCommand::requeueOutputBuffer(PacketPriorityQueue& ppq){
+  #ifdef PACKETCOMMAND_DEBUG
+  PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::requeueOutputBuffer(PacketPriorityQueue)"));
+  #endif
+  if (ppq.levels() == 0){
+    return PacketShared::ERROR_QUEUE_OVERFLOW;
+  }
+  //back onto the front of its own level
+  return requeueOutputBuffer(ppq.level(ppq.levelFor(_output_buffer, _output_len, _output_flags)));
+}
+
+/**
+ * Point the output buffer at the next free slot of the queue, so that the
+ * pack_* methods build the packet in place.  commitOutputBuffer publishes
+ * the packet and restores the instance's own output buffer.
+ */
+PacketShared::STATUS PacketCommand::reserveOutputBuffer(PacketQueue& pq){
+  #ifdef PACKETCOMMAND_DEBUG
+  PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::reserveOutputBuffer"));
+  #endif
+  size_t max_len;
+  byte* slot_data = pq.reserve(max_len);
+  if (slot_data == nullptr){
+    return PacketShared::ERROR_QUEUE_OVERFLOW;
+  }
+  if (_saved_output_buffer == nullptr){ //not already pointing into a queue
+    _saved_output_buffer = _output_buffer;
+    _saved_outputBufferSize = _outputBufferSize;
   }
+  _output_buffer = slot_data;
+  _outputBufferSize = max_len;
+  resetOutputBuffer();
+  return PacketShared::SUCCESS;
+}
+
+PacketShared::STATUS PacketCommand::commitOutputBuffer(PacketQueue& pq){
+  #ifdef PACKETCOMMAND_DEBUG
+  PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::commitOutputBuffer"));
+  #endif
+  PacketShared::STATUS pqs = pq.commit(_output_len, 0, _output_flags);
+  if (_saved_output_buffer != nullptr){ //restore our own buffer
+    _output_buffer = _saved_output_buffer;
+    _outputBufferSize = _saved_outputBufferSize;
+    _saved_output_buffer = nullptr;
+  }
+  resetOutputBuffer();
+  return pqs;
 }
 
 PacketShared::STATUS PacketCommand::requeueOutputBuffer(PacketQueue& pq){
@@ -915,15 +2048,9 @@ PacketShared::STATUS PacketCommand::requeueOutputBuffer(PacketQueue& pq){
   #ifdef PACKETCOMMAND_DEBUG
   PACKETCOMMAND_DEBUG_PORT.println(F("# In PacketCommand::requeueOutputBuffer"));
   #endif
-  //build a packet struct to hold current buffer state
-  PacketShared::Packet pkt;
-  pkt.length = min((size_t) _output_len, PacketShared::DATA_BUFFER_SIZE);
-  pkt.timestamp = 0;
-  pkt.flags  = _output_flags;
-  memcpy(pkt.data, _output_buffer, pkt.length);
-  PacketShared::STATUS pqs;
-  pqs = pq.requeue(pkt);
-  return pqs;
+  //copy the current buffer state straight into the slot in front of the head,
+  //a packet longer than a slot is refused
+  return pq.requeue(_output_buffer, _output_len, 0, _output_flags);
 }
 
 /******************************************************************************/
@@ -931,90 +2058,167 @@ PacketShared::STATUS PacketCommand::requeueOutputBuffer(PacketQueue& pq){
 /******************************************************************************/
 //bytes and chars
 PacketShared::STATUS PacketCommand::unpack_byte(byte& varByRef){
-  varByRef = *((byte*)(_input_buffer+_input_index));
-  return moveInputBufferIndex(sizeof(byte));
+  return unpack(varByRef);
 }
 
 PacketShared::STATUS PacketCommand::unpack_byte_array(byte* buffer, size_t len){
-  for(size_t i=0; i < len; i++){
-    buffer[i] = _input_buffer[_input_index + i];
-  }
-  return moveInputBufferIndex(len*sizeof(byte)); //FIXME should be len-1?
+  return _unpackBytes(buffer, len*sizeof(byte));
 }
 
 PacketShared::STATUS PacketCommand::unpack_char(char& varByRef){
-  varByRef = *((char*)(_input_buffer+_input_index));
-  return moveInputBufferIndex(sizeof(char));
+  return unpack(varByRef);
 }
 
 PacketShared::STATUS PacketCommand::unpack_char_array(char* buffer, size_t len){
-  for(size_t i=0; i < len; i++){
-    buffer[i] = _input_buffer[_input_index + i];
-  }
-  return moveInputBufferIndex(len*sizeof(char)); //FIXME should be len-1?
+  return _unpackBytes(buffer, len*sizeof(char));
 }
 
 //stdint types
 PacketShared::STATUS PacketCommand::unpack_int8(int8_t& varByRef){
-  varByRef = *((int8_t*)(_input_buffer + _input_index));
-  return moveInputBufferIndex(sizeof(int8_t));
+  return unpack(varByRef);
 }
 
 PacketShared::STATUS PacketCommand::unpack_uint8(uint8_t& varByRef){
-  varByRef = *((uint8_t*)(_input_buffer + _input_index));
-  return moveInputBufferIndex(sizeof(uint8_t));
+  return unpack(varByRef);
 }
 
 PacketShared::STATUS PacketCommand::unpack_int16(int16_t& varByRef){
-  varByRef = *((int16_t*)(_input_buffer + _input_index));
-  return moveInputBufferIndex(sizeof(int16_t));
+  return unpack(varByRef);
 }
 
 PacketShared::STATUS PacketCommand::unpack_uint16(uint16_t& varByRef){
-  varByRef = *((uint16_t*)(_input_buffer + _input_index));
-  return moveInputBufferIndex(sizeof(uint16_t));
+  return unpack(varByRef);
 }
 
 PacketShared::STATUS PacketCommand::unpack_int32(int32_t& varByRef){
-  varByRef = *((int32_t*)(_input_buffer + _input_index));
-  return moveInputBufferIndex(sizeof(int32_t));
+  return unpack(varByRef);
 }
 
 PacketShared::STATUS PacketCommand::unpack_uint32(uint32_t& varByRef){
-  varByRef = *((uint32_t*)(_input_buffer + _input_index));
-  return moveInputBufferIndex(sizeof(uint32_t));
+  return unpack(varByRef);
 }
 
 PacketShared::STATUS PacketCommand::unpack_int64(int64_t& varByRef){
-  varByRef = *((int64_t*)(_input_buffer + _input_index));
-  return moveInputBufferIndex(sizeof(int64_t));
+  return unpack(varByRef);
 }
 
 PacketShared::STATUS PacketCommand::unpack_uint64(uint64_t& varByRef){
-  varByRef = *((uint64_t*)(_input_buffer + _input_index));
-  return moveInputBufferIndex(sizeof(uint64_t));
+  return unpack(varByRef);
 }
 
 //floating point
 
 PacketShared::STATUS PacketCommand::unpack_float(float& varByRef){
-  varByRef = *((float*)(_input_buffer + _input_index));
-  return moveInputBufferIndex(sizeof(float));
+  return unpack(varByRef);
 }
 
 PacketShared::STATUS PacketCommand::unpack_double(double& varByRef){
-  varByRef = *((double*)(_input_buffer + _input_index));
-  return moveInputBufferIndex(sizeof(double));
+  return unpack(varByRef);
 }
 
 PacketShared::STATUS PacketCommand::unpack_float32(float32_t& varByRef){
-  varByRef = *((float32_t*)(_input_buffer + _input_index));
-  return moveInputBufferIndex(sizeof(float32_t));
+  return unpack(varByRef);
 }
 
 PacketShared::STATUS PacketCommand::unpack_float64(float64_t& varByRef){
-  varByRef = *((float64_t*)(_input_buffer + _input_index));
-  return moveInputBufferIndex(sizeof(float64_t));
+  return unpack(varByRef);
+}
+
+//arrays of numbers
+PacketShared::STATUS PacketCommand::_unpackArray(void* dest, size_t count, size_t width){
+  size_t index = _input_index;
+  size_t input_len = _input_len;
+  //check the whole array once, dividing so that a huge count cannot overflow
+  if (index > input_len || count > (input_len - index)/width){
+    return _unpackStatus(PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS);
+  }
+  if (_swap_bytes){
+    PacketByteOrder::copySwap(dest, _input_buffer + index, count, width);
+  }
+  else{
+    memcpy(dest, _input_buffer + index, count*width);
+  }
+  _input_index = index + count*width;
+  return PacketShared::SUCCESS;
+}
+
+PacketShared::STATUS PacketCommand::unpack_int16_array(int16_t* buffer, size_t len){
+  return _unpackArray(buffer, len, sizeof(int16_t));
+}
+
+PacketShared::STATUS PacketCommand::unpack_uint16_array(uint16_t* buffer, size_t len){
+  return _unpackArray(buffer, len, sizeof(uint16_t));
+}
+
+PacketShared::STATUS PacketCommand::unpack_int32_array(int32_t* buffer, size_t len){
+  return _unpackArray(buffer, len, sizeof(int32_t));
+}
+
+PacketShared::STATUS PacketCommand::unpack_uint32_array(uint32_t* buffer, size_t len){
+  return _unpackArray(buffer, len, sizeof(uint32_t));
+}
+
+PacketShared::STATUS PacketCommand::unpack_int64_array(int64_t* buffer, size_t len){
+  return _unpackArray(buffer, len, sizeof(int64_t));
+}
+
+PacketShared::STATUS PacketCommand::unpack_uint64_array(uint64_t* buffer, size_t len){
+  return _unpackArray(buffer, len, sizeof(uint64_t));
+}
+
+PacketShared::STATUS PacketCommand::unpack_float32_array(float32_t* buffer, size_t len){
+  return _unpackArray(buffer, len, sizeof(float32_t));
+}
+
+PacketShared::STATUS PacketCommand::unpack_float64_array(float64_t* buffer, size_t len){
+  return _unpackArray(buffer, len, sizeof(float64_t));
+}
+
+//variable length integers
+PacketShared::STATUS PacketCommand::unpack_varint32(uint32_t& varByRef){
+  size_t index = _input_index;
+  size_t input_len = _input_len;
+  size_t used;
+  if (index > input_len){
+    return _unpackStatus(PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS);
+  }
+  PacketShared::STATUS pcs = varintDecode(_input_buffer + index, input_len - index, varByRef, used);
+  if (pcs == PacketShared::SUCCESS){
+    _input_index = index + used;
+  }
+  return _unpackStatus(pcs);
+}
+
+PacketShared::STATUS PacketCommand::unpack_varint64(uint64_t& varByRef){
+  size_t index = _input_index;
+  size_t input_len = _input_len;
+  size_t used;
+  if (index > input_len){
+    return _unpackStatus(PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS);
+  }
+  PacketShared::STATUS pcs = varintDecode(_input_buffer + index, input_len - index, varByRef, used);
+  if (pcs == PacketShared::SUCCESS){
+    _input_index = index + used;
+  }
+  return _unpackStatus(pcs);
+}
+
+PacketShared::STATUS PacketCommand::unpack_zigzag32(int32_t& varByRef){
+  uint32_t zz;
+  PacketShared::STATUS pcs = unpack_varint32(zz);
+  if (pcs == PacketShared::SUCCESS){
+    varByRef = (int32_t) ((zz >> 1) ^ (0 - (zz & 1)));
+  }
+  return pcs;
+}
+
+PacketShared::STATUS PacketCommand::unpack_zigzag64(int64_t& varByRef){
+  uint64_t zz;
+  PacketShared::STATUS pcs = unpack_varint64(zz);
+  if (pcs == PacketShared::SUCCESS){
+    varByRef = (int64_t) ((zz >> 1) ^ (0 - (zz & 1)));
+  }
+  return pcs;
 }
 
 /******************************************************************************/
@@ -1023,85 +2227,151 @@ PacketShared::STATUS PacketCommand::unpack_float64(float64_t& varByRef){
 
 //bytes and chars
 PacketShared::STATUS PacketCommand::pack_byte(byte value){
-  memcpy( (_output_buffer + _output_index), &value, sizeof(byte));
-  return moveOutputBufferIndex(sizeof(byte));
+  return pack(value);
 }
 
 PacketShared::STATUS PacketCommand::pack_byte_array(byte* buffer, size_t len){
-  memcpy( (_output_buffer + _output_index), buffer, len*sizeof(byte)); //FIXME should be len-1?
-  return moveOutputBufferIndex(len*sizeof(byte));
+  return _packBytes(buffer, len*sizeof(byte));
 }
 
 PacketShared::STATUS PacketCommand::pack_char(char value){
-  memcpy( (_output_buffer + _output_index), &value, sizeof(char));
-  return moveOutputBufferIndex(sizeof(char));
+  return pack(value);
 }
 
 PacketShared::STATUS PacketCommand::pack_char_array(char* buffer, size_t len){
-  memcpy( (_output_buffer + _output_index), buffer, len*sizeof(char));
-  return moveOutputBufferIndex(len*sizeof(char)); //FIXME should be len-1?
+  return _packBytes(buffer, len*sizeof(char));
 }
 
 //stdint types
 PacketShared::STATUS PacketCommand::pack_int8(int8_t value){
-  memcpy( (_output_buffer + _output_index), &value, sizeof(int8_t));
-  return moveOutputBufferIndex(sizeof(int8_t));
+  return pack(value);
 }
 
 PacketShared::STATUS PacketCommand::pack_uint8(uint8_t value){
-  memcpy( (_output_buffer + _output_index), &value, sizeof(uint8_t));
-  return moveOutputBufferIndex(sizeof(uint8_t));
+  return pack(value);
 }
 
 PacketShared::STATUS PacketCommand::pack_int16(int16_t value){
-  memcpy( (_output_buffer + _output_index), &value, sizeof(int16_t));
-  return moveOutputBufferIndex(sizeof(int16_t));
+  return pack(value);
 }
 
 PacketShared::STATUS PacketCommand::pack_uint16(uint16_t value){
-  memcpy( (_output_buffer + _output_index), &value, sizeof(uint16_t));
-  return moveOutputBufferIndex(sizeof(uint16_t));
+  return pack(value);
 }
 
 PacketShared::STATUS PacketCommand::pack_int32(int32_t value){
-  memcpy( (_output_buffer + _output_index), &value, sizeof(int32_t));
-  return moveOutputBufferIndex(sizeof(int32_t));
+  return pack(value);
 }
 
 PacketShared::STATUS PacketCommand::pack_uint32(uint32_t value){
-  memcpy( (_output_buffer + _output_index), &value, sizeof(uint32_t));
-  return moveOutputBufferIndex(sizeof(uint32_t));
+  return pack(value);
 }
 
 PacketShared::STATUS PacketCommand::pack_int64(int64_t value){
-  memcpy( (_output_buffer + _output_index), &value, sizeof(int64_t));
-  return moveOutputBufferIndex(sizeof(int64_t));
+  return pack(value);
 }
 
 PacketShared::STATUS PacketCommand::pack_uint64(uint64_t value){
-  memcpy( (_output_buffer + _output_index), &value, sizeof(uint64_t));
-  return moveOutputBufferIndex(sizeof(uint64_t));
+  return pack(value);
 }
 
 //floating point
 
 PacketShared::STATUS PacketCommand::pack_float(float value){
-  memcpy( (_output_buffer + _output_index), &value, sizeof(float));
-  return moveOutputBufferIndex(sizeof(float));
+  return pack(value);
 }
 
 PacketShared::STATUS PacketCommand::pack_double(double value){
-  memcpy( (_output_buffer + _output_index), &value, sizeof(double));
-  return moveOutputBufferIndex(sizeof(double));
+  return pack(value);
 }
 
 PacketShared::STATUS PacketCommand::pack_float32(float32_t value){
-  memcpy( (_output_buffer + _output_index), &value, sizeof(float32_t));
-  return moveOutputBufferIndex(sizeof(float32_t));
+  return pack(value);
 }
 
 PacketShared::STATUS PacketCommand::pack_float64(float64_t value){
-  memcpy( (_output_buffer + _output_index), &value, sizeof(float64_t));
-  return moveOutputBufferIndex(sizeof(float64_t));
+  return pack(value);
+}
+
+//arrays of numbers
+PacketShared::STATUS PacketCommand::_packArray(const void* src, size_t count, size_t width){
+  size_t index = _output_index;
+  if (index > _outputBufferSize || count > (_outputBufferSize - index)/width){
+    return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;
+  }
+  if (_swap_bytes){
+    PacketByteOrder::copySwap(_output_buffer + index, src, count, width);
+  }
+  else{
+    memcpy(_output_buffer + index, src, count*width);
+  }
+  index += count*width;
+  _output_index = index;
+  if (index > _output_len){ //adjust output len up
+    _output_len = index;
+  }
+  return PacketShared::SUCCESS;
+}
+
+PacketShared::STATUS PacketCommand::pack_int16_array(const int16_t* buffer, size_t len){
+  return _packArray(buffer, len, sizeof(int16_t));
+}
+
+PacketShared::STATUS PacketCommand::pack_uint16_array(const uint16_t* buffer, size_t len){
+  return _packArray(buffer, len, sizeof(uint16_t));
+}
+
+PacketShared::STATUS PacketCommand::pack_int32_array(const int32_t* buffer, size_t len){
+  return _packArray(buffer, len, sizeof(int32_t));
+}
+
+PacketShared::STATUS PacketCommand::pack_uint32_array(const uint32_t* buffer, size_t len){
+  return _packArray(buffer, len, sizeof(uint32_t));
+}
+
+PacketShared::STATUS PacketCommand::pack_int64_array(const int64_t* buffer, size_t len){
+  return _packArray(buffer, len, sizeof(int64_t));
+}
+
+PacketShared::STATUS PacketCommand::pack_uint64_array(const uint64_t* buffer, size_t len){
+  return _packArray(buffer, len, sizeof(uint64_t));
+}
+
+PacketShared::STATUS PacketCommand::pack_float32_array(const float32_t* buffer, size_t len){
+  return _packArray(buffer, len, sizeof(float32_t));
+}
+
+PacketShared::STATUS PacketCommand::pack_float64_array(const float64_t* buffer, size_t len){
+  return _packArray(buffer, len, sizeof(float64_t));
+}
+
+//variable length integers
+PacketShared::STATUS PacketCommand::pack_varint32(uint32_t value){
+  size_t index = _output_index;
+  size_t n = varintSize(value);
+  if (index > _outputBufferSize || n > _outputBufferSize - index){
+    return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;
+  }
+  varintEncode(_output_buffer + index, value);
+  return setOutputBufferIndex(index + n);
+}
+
+PacketShared::STATUS PacketCommand::pack_varint64(uint64_t value){
+  size_t index = _output_index;
+  size_t n = varintSize(value);
+  if (index > _outputBufferSize || n > _outputBufferSize - index){
+    return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;
+  }
+  varintEncode(_output_buffer + index, value);
+  return setOutputBufferIndex(index + n);
+}
+
+PacketShared::STATUS PacketCommand::pack_zigzag32(int32_t value){
+  //maps 0, -1, 1, -2, ... to 0, 1, 2, 3, ...
+  return pack_varint32(((uint32_t) value << 1) ^ (uint32_t) (value >> 31));
+}
+
+PacketShared::STATUS PacketCommand::pack_zigzag64(int64_t value){
+  return pack_varint64(((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
 }
 
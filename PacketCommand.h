@@ -25,13 +25,43 @@
 
 #include <Stream.h>
 #include <stdint.h>
+#include <string.h>
 
+#include "PacketByteOrder.h"
+#include "PacketCRC.h"
+#include "PacketLZ.h"
+#include "PacketReassembly.h"
+#include "PacketLatencyHistogram.h"
+
+class PacketReliable;
+class PacketRequestTable;
 #include "PacketQueue.h"
+#include "PacketPriorityQueue.h"
 #include "PacketShared.h"
 
 // Uncomment the next line to run the library in debug mode (verbose messages)
 //#define PACKETCOMMAND_DEBUG
 
+// Uncomment the next line to count calls, handler time and errors of each
+// command (see beginProfiling); when left out none of it is compiled
+//#define PACKETCOMMAND_PROFILING
+
+// Static command tables are placed in flash on AVR, where data is otherwise
+// copied into RAM at startup
+#if defined(__AVR__)
+  #include <avr/pgmspace.h>
+  #define PACKETCOMMAND_PROGMEM PROGMEM
+#else
+  #define PACKETCOMMAND_PROGMEM
+#endif
+
+// Byte order of numbers packed by new instances, unless changed with
+// setWireByteOrder; native order costs nothing, the other order byte swaps
+// every field
+#ifndef PACKETCOMMAND_WIRE_BYTE_ORDER
+  #define PACKETCOMMAND_WIRE_BYTE_ORDER PacketByteOrder::NATIVE
+#endif
+
 #ifdef PACKETCOMMAND_DEBUG
   #ifdef DEBUG_PORT
     #define PACKETCOMMAND_DEBUG_PORT DEBUG_PORT
@@ -54,12 +84,15 @@ class PacketCommand{
     static const size_t MAX_TYPE_ID_LEN = 4;
     static const size_t INPUTBUFFERSIZE_DEFAULT = 64;   //FIXME zero means do not allocate
     static const size_t OUTPUTBUFFERSIZE_DEFAULT = 64;
+    static const size_t DISPATCH_TABLE_SIZE = 256;      //one entry per possible last byte of a type ID
+    static const size_t MAX_DISPATCH_COMMANDS = 255;    //dispatch table entries are uint8_t list positions
     
     // Command/handler info structure
     struct CommandInfo {
       byte type_id[MAX_TYPE_ID_LEN];     //limited size type ID must be respected!
       const char* name;
       void (*function)(PacketCommand&);     //handler callback function
+      byte output_flags;                    //OPFLAG_* bits added by setupOutputCommand, e.g. OPFLAG_COMPRESS
     };
     
     // Command/handler info structure
@@ -74,10 +107,52 @@ class PacketCommand{
                   size_t inputBufferSize  = INPUTBUFFERSIZE_DEFAULT,
                   size_t outputBufferSize = OUTPUTBUFFERSIZE_DEFAULT
                  );
+    // Constructor for a fixed command table declared at compile time, e.g.
+    //   constexpr PacketCommand::CommandInfo commands[] PACKETCOMMAND_PROGMEM = {
+    //     {"\x41",     "LED.ON",    LED_on},
+    //     {"\xFF\x01", "INT_FLOAT", handle_int_float},
+    //   };
+    //   static_assert(PacketCommand::validCommandTable(commands), "bad command table");
+    //   PacketCommand pCmd(commands);
+    // No heap is used for the commands and nothing is registered at startup;
+    // the table must be sorted by typeIdKey, which validCommandTable checks.
+    // Further commands may still be added at runtime with addCommand, if
+    // room for them is reserved with 'maxCommands'.
+    template<size_t N>
+    PacketCommand(const CommandInfo (&commandTable)[N],
+                  size_t inputBufferSize  = INPUTBUFFERSIZE_DEFAULT,
+                  size_t outputBufferSize = OUTPUTBUFFERSIZE_DEFAULT,
+                  size_t maxCommands      = 0
+                 ) : PacketCommand(maxCommands, inputBufferSize, outputBufferSize){
+      _staticCommands     = commandTable;
+      _staticCommandCount = N;
+    }
+    // Compile time checks for static command tables
+    static constexpr bool validTypeId(const byte* type_id, size_t i = 0){
+      return (i >= MAX_TYPE_ID_LEN)  ? false
+           : (type_id[i] == 0xFF)    ? validTypeId(type_id, i + 1)
+           : (type_id[i] == 0x00)    ? false
+           : _zeroPadded(type_id, i + 1);  //valid type ID completed
+    }
+    // Sort key of a valid type ID: its length and last byte
+    static constexpr uint16_t typeIdKey(const byte* type_id, size_t i = 0){
+      return (i + 1 < MAX_TYPE_ID_LEN && type_id[i] == 0xFF) ? typeIdKey(type_id, i + 1)
+           : (uint16_t) ((i << 8) | type_id[i]);
+    }
+    template<size_t N>
+    static constexpr bool validCommandTable(const CommandInfo (&commandTable)[N], size_t i = 0){
+      return (i >= N) ? true
+           : validTypeId(commandTable[i].type_id)
+             && commandTable[i].name != nullptr
+             && commandTable[i].function != nullptr
+             && (i == 0 || typeIdKey(commandTable[i - 1].type_id) < typeIdKey(commandTable[i].type_id))
+             && validCommandTable(commandTable, i + 1);
+    }
     PacketShared::STATUS reset();
     PacketShared::STATUS addCommand(const byte* type_id,
                       const char* name, 
-                      void(*function)(PacketCommand&));                          // Add a command to the processing dictionary.
+                      void(*function)(PacketCommand&),
+                      byte outputFlags = 0x00);                                  // Add a command to the processing dictionary.
     PacketShared::STATUS registerDefaultHandler(void (*function)(PacketCommand&));             // A handler to call when no valid command received.
     //registering callbacks for IO steps
     //input
@@ -90,8 +165,10 @@ class PacketCommand{
     PacketShared::STATUS registerReplyRecvCallback(bool (*function)(PacketCommand&));
     
     PacketShared::STATUS processInput();  //receive input, match command, and dispatch
+    size_t processQueue(PacketQueue& pq, size_t maxPackets = 0, uint32_t timeBudgetMicros = 0); //drain a batch of queued input, 0 means no limit
     
     PacketShared::STATUS lookupCommandByName(const char* name);                               //lookup and set current command by name
+    PacketShared::STATUS lookupCommandByName(const char* name, CommandInfo& command);         //lookup a command by name once, to reuse with setupOutputCommand
     CommandInfo getCurrentCommand();
     PacketShared::STATUS recv();                // Use the '_recv_callback' to put data into _input_buffer
     PacketShared::STATUS recv(bool& gotPacket); // Use the '_recv_callback' to put data into _input_buffer
@@ -104,8 +181,37 @@ class PacketCommand{
     PacketShared::STATUS send_nonblocking();    // Use the '_send_nonblocking_callback' to send _schedule the output_buffer contents to be sent, returning immediately
     PacketShared::STATUS send_buffered();       // Use the '_send_buffered_callback' to send _schedule the output_buffer contents to be sent, returning immediately
     PacketShared::STATUS set_sendTimestamp(uint32_t timestamp_micros);
+    uint32_t             get_sendTimestamp(){return _send_timestamp_micros;};
+    //coalescing: when on, send_buffered collects packets into frames of up to
+    //'maxFrameSize' bytes (at most the output buffer size) and only calls the
+    //send_buffered callback once a frame is full, 'flushDelayMicros' after
+    //its first packet (checked by send_buffered and send_buffered_poll, 0 for
+    //no deadline), or on send_buffered_flush; processInput dispatches every
+    //packet in a frame.  A zero 'maxFrameSize' turns coalescing off
+    PacketShared::STATUS setCoalescing(size_t maxFrameSize, uint32_t flushDelayMicros = 0);
+    PacketShared::STATUS send_buffered_flush();  // Send the frame being collected now, it is kept if that fails
+    PacketShared::STATUS send_buffered_poll();   // Send the frame being collected if its flush delay has passed
     PacketShared::STATUS reply_send();
     PacketShared::STATUS reply_recv();
+    //packets too long for one send: the command's type ID followed by 'data'
+    //goes out as fragments of at most 'maxPacketSize' bytes (0 means the
+    //output buffer size) through send(), using the output buffer; packets
+    //that fit are sent whole.  The receiver needs a PacketReassembly
+    PacketShared::STATUS sendFragmented(const CommandInfo& command, const byte* data, size_t len, size_t maxPacketSize = 0);
+    void attachReassembly(PacketReassembly& reassembly){_reassembly = &reassembly;};
+    //sequence numbered packets and their ACKs are handled by processInput
+    //once a PacketReliable is attached
+    void attachReliable(PacketReliable& reliable){_reliable = &reliable;};
+    //replies are routed to the callbacks of their queries once a
+    //PacketRequestTable is attached
+    void attachRequestTable(PacketRequestTable& requests){_requests = &requests;};
+    PacketShared::STATUS setupOutputReply();  //start the output packet as the reply to the query being handled
+    //optional checksum trailer, appended to every packet sent and checked
+    //and stripped by processInput before matching, where failures are counted
+    void     setChecksumMode(PacketCRC::MODE mode){_checksum_mode = mode;};
+    PacketCRC::MODE getChecksumMode(){return _checksum_mode;};
+    uint32_t getChecksumFailures(){return _checksum_failures;};
+    void     resetChecksumFailures(){_checksum_failures = 0;};
     
     PacketShared::STATUS assignInputBuffer(byte* buff, size_t len);
     void   resetInputBuffer();
@@ -118,25 +224,153 @@ class PacketCommand{
     
     void                   setInputProperties(struct InputProperties props){_input_properties=props;};
     struct InputProperties getInputProperties(){return _input_properties;};
+    bool     inputIsQuery(){return _input_flags & PacketShared::IPFLAG_IS_QUERY;};
+    uint16_t getInputRequestId(){return _input_request_id;};  //of the query being handled
+    //packets sent with flagOutputAppendSendTimestamp carry the sender's
+    //micros() taken just before its send callback; the latency pairs it with
+    //the receive timestamp (or micros() at processInput when none was set).
+    //It only means something when the two clocks agree, so give the offset
+    //of the sender's clock behind this one with setClockOffset if known;
+    //negative results are counted as zero
+    bool     inputHasSendTimestamp(){return _input_flags & PacketShared::IPFLAG_HAS_SEND_TIMESTAMP;};
+    uint32_t getInputSendTimestamp(){return _input_send_timestamp;};
+    uint32_t getInputLatency(){return _input_latency;};
+    void     setClockOffset(int32_t offsetMicros){_clock_offset = offsetMicros;};
+    //per command latency histograms of timestamped packets, in fixed memory
+    //for up to 'maxCommands' commands; later commands are not tracked
+    PacketShared::STATUS beginLatencyHistograms(size_t maxCommands);
+    const PacketLatencyHistogram* getLatencyHistogram(const CommandInfo& command); //nullptr if none yet
+    void resetLatencyHistograms();
+    #ifdef PACKETCOMMAND_PROFILING
+    //per command counters kept by processInput and dispatchCommand, in fixed
+    //memory for up to 'maxCommands' commands; later commands are not tracked
+    struct CommandProfile{
+      uint16_t key;                //typeIdKey of the command, 0 for the default handler
+      uint32_t calls;
+      uint64_t total_micros;       //time spent in the handler
+      uint32_t max_micros;
+      uint32_t unpack_errors;      //unpack calls by the handler that failed
+      PacketShared::STATUS last_unpack_error;
+    };
+    PacketShared::STATUS beginProfiling(size_t maxCommands);
+    const CommandProfile* getCommandProfile(const CommandInfo& command); //nullptr if not called yet
+    size_t   getProfileCount(){return _profile_count;};
+    const CommandProfile* getProfile(size_t index){return (index < _profile_count)? &_profiles[index] : nullptr;};
+    uint32_t getMatchFailures(){return _profile_match_failures;};  //packets no registered command matched
+    void     resetProfiling();
+    //a built-in command answering with the counters, see _handleProfiling
+    PacketShared::STATUS addProfilingCommand(const byte* type_id, const char* name = "PROFILE");
+    #endif
     
     PacketShared::STATUS enqueueInputBuffer(PacketQueue& pq);
     PacketShared::STATUS dequeueInputBuffer(PacketQueue& pq);
+    PacketShared::STATUS peekInputBuffer(PacketQueue& pq);     //point the input buffer at the oldest queued packet, no copying
+    PacketShared::STATUS releaseInputBuffer(PacketQueue& pq);  //done with the peeked packet, free its slot
     byte*  getOutputBuffer(){return _output_buffer;};
     int    getOutputBufferIndex();
     int    getOutputBufferSize(){return _outputBufferSize;};
     size_t getOutputLen(){return _output_len;};
     PacketShared::STATUS setOutputBufferIndex(int new_index);
     byte   getOutputFlags(){return _output_flags;};
+    void   setOutputFlags(byte flags){_output_flags = flags;};
     void     setOutputToAddress(uint32_t addr){_output_to_address = addr;};
     uint32_t getOutputToAddress(){return _output_to_address;};
     void   flagOutputAsQuery(){_output_flags|=PacketShared::OPFLAG_IS_QUERY;};
     void   flagOutputAppendSendTimestamp(){_output_flags|=PacketShared::OPFLAG_APPEND_SEND_TIMESTAMP;};
+    void   flagOutputCompress(){_output_flags|=PacketShared::OPFLAG_COMPRESS;}; //sent compressed if that makes it smaller
     bool   outputIsQuery(){return (bool)_output_flags&PacketShared::OPFLAG_IS_QUERY;};
     PacketShared::STATUS enqueueOutputBuffer(PacketQueue& pq);
     PacketShared::STATUS dequeueOutputBuffer(PacketQueue& pq);
     PacketShared::STATUS requeueOutputBuffer(PacketQueue& pq);
+    PacketShared::STATUS reserveOutputBuffer(PacketQueue& pq); //point the output buffer at a free queue slot, no copying
+    PacketShared::STATUS commitOutputBuffer(PacketQueue& pq);  //publish the packet built in the reserved slot
+    PacketShared::STATUS enqueueOutputBuffer(PacketPriorityQueue& ppq); //into the level chosen by the classifier
+    PacketShared::STATUS dequeueOutputBuffer(PacketPriorityQueue& ppq); //from the highest non-empty level
+    PacketShared::STATUS requeueOutputBuffer(PacketPriorityQueue& ppq);
     PacketShared::STATUS moveOutputBufferIndex(int n);
     void   resetOutputBuffer();
+    //byte order of all multi-byte numbers read and written by the unpack_*
+    //and pack_* methods (type IDs and byte arrays are never reordered)
+    void setWireByteOrder(PacketByteOrder::ORDER order){_swap_bytes = (order != PacketByteOrder::NATIVE);};
+    PacketByteOrder::ORDER getWireByteOrder(){
+      if (!_swap_bytes){ return PacketByteOrder::NATIVE;}
+      return (PacketByteOrder::NATIVE == PacketByteOrder::LITTLE)? PacketByteOrder::BIG : PacketByteOrder::LITTLE;
+    };
+    //typed field access for any plain data type T, which every unpack_* and
+    //pack_* method below goes through; numbers are converted to the wire
+    //byte order, other types are copied as they are.  On failure nothing is
+    //copied and the buffer index does not move
+    template<typename T>
+    PacketShared::STATUS unpack(T& varByRef){
+      PacketShared::STATUS pcs = _unpackBytes(&varByRef, sizeof(T));
+      if (PacketByteOrder::IsNumber<T>::value && _swap_bytes && pcs == PacketShared::SUCCESS){
+        PacketByteOrder::swapInPlace(&varByRef, sizeof(T));
+      }
+      return pcs;
+    }
+    template<typename T>
+    PacketShared::STATUS pack(const T& value){
+      if (PacketByteOrder::IsNumber<T>::value && _swap_bytes){
+        T swapped = value;
+        PacketByteOrder::swapInPlace(&swapped, sizeof(T));
+        return _packBytes(&swapped, sizeof(T));
+      }
+      return _packBytes(&value, sizeof(T));
+    }
+    //total packed size of a sequence of fields
+    template<typename T>
+    static constexpr size_t fieldsSize(){ return sizeof(T); }
+    template<typename T, typename U, typename... Ts>
+    static constexpr size_t fieldsSize(){ return sizeof(T) + fieldsSize<U, Ts...>(); }
+    //unpack several consecutive fields in one call, e.g.
+    //  pCmd.unpack_fields(myInt32, myFloat, myUInt16);
+    //the combined length is checked once, then every field is copied out in
+    //turn; if the packet is too short nothing is copied
+    template<typename T, typename... Ts>
+    PacketShared::STATUS unpack_fields(T& first, Ts&... rest){
+      const size_t total = fieldsSize<T, Ts...>();
+      size_t index = _input_index;
+      size_t input_len = _input_len;
+      if (index > input_len || total > input_len - index){
+        return _unpackStatus(PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS);
+      }
+      _copyFields(_swap_bytes, _input_buffer + index, first, rest...);
+      _input_index = index + total;
+      return PacketShared::SUCCESS;
+    }
+    //pack several fields in one call, e.g.
+    //  pCmd.pack(myInt32, myFloat, myUInt16);
+    //the packet is rejected up front if the fields would not all fit, in
+    //which case nothing is written
+    template<typename T, typename U, typename... Ts>
+    PacketShared::STATUS pack(const T& first, const U& second, const Ts&... rest){
+      const size_t total = fieldsSize<T, U, Ts...>();
+      size_t index = _output_index;
+      if (index > _outputBufferSize || total > _outputBufferSize - index){
+        return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;
+      }
+      _storeFields(_swap_bytes, _output_buffer + index, first, second, rest...);
+      index += total;
+      _output_index = index;
+      if (index > _output_len){ //adjust output len up
+        _output_len = index;
+      }
+      return PacketShared::SUCCESS;
+    }
+    //a fixed packet layout, declared once and shared by both ends, e.g.
+    //  typedef PacketCommand::Schema<int32_t, float> IntFloat;
+    //  IntFloat::pack(pCmd, myInt, myFloat);
+    //  IntFloat::unpack(pCmd, myInt, myFloat);
+    template<typename... Ts>
+    struct Schema{
+      static constexpr size_t size(){ return fieldsSize<Ts...>(); }
+      static PacketShared::STATUS pack(PacketCommand& pCmd, const Ts&... fields){
+        return pCmd.pack(fields...);
+      }
+      static PacketShared::STATUS unpack(PacketCommand& pCmd, Ts&... fields){
+        return pCmd.unpack_fields(fields...);
+      }
+    };
     //unpacking chars and bytes
     PacketShared::STATUS unpack_byte(byte& varByRef);
     PacketShared::STATUS unpack_byte_array(byte* buffer, size_t len);
@@ -156,9 +390,24 @@ class PacketCommand{
     PacketShared::STATUS unpack_double(      double& varByRef);
     PacketShared::STATUS unpack_float32(  float32_t& varByRef);
     PacketShared::STATUS unpack_float64(  float64_t& varByRef);
+    //unpacking arrays of numbers, 'len' is in elements
+    PacketShared::STATUS unpack_int16_array(int16_t* buffer, size_t len);
+    PacketShared::STATUS unpack_uint16_array(uint16_t* buffer, size_t len);
+    PacketShared::STATUS unpack_int32_array(int32_t* buffer, size_t len);
+    PacketShared::STATUS unpack_uint32_array(uint32_t* buffer, size_t len);
+    PacketShared::STATUS unpack_int64_array(int64_t* buffer, size_t len);
+    PacketShared::STATUS unpack_uint64_array(uint64_t* buffer, size_t len);
+    PacketShared::STATUS unpack_float32_array(float32_t* buffer, size_t len);
+    PacketShared::STATUS unpack_float64_array(float64_t* buffer, size_t len);
+    //unpacking variable length integers: LEB128 varints, and zigzag for
+    //signed values, so that small magnitudes take few bytes
+    PacketShared::STATUS unpack_varint32(uint32_t& varByRef);
+    PacketShared::STATUS unpack_varint64(uint64_t& varByRef);
+    PacketShared::STATUS unpack_zigzag32( int32_t& varByRef);
+    PacketShared::STATUS unpack_zigzag64( int64_t& varByRef);
     //Methods for constructing an output
     PacketShared::STATUS setupOutputCommandByName(const char* name);
-    PacketShared::STATUS setupOutputCommand(CommandInfo command);
+    PacketShared::STATUS setupOutputCommand(const CommandInfo& command);
     //packing chars and bytes
     PacketShared::STATUS pack_byte(byte value);
     PacketShared::STATUS pack_byte_array(byte* buffer, size_t len);
@@ -178,17 +427,123 @@ class PacketCommand{
     PacketShared::STATUS pack_double(      double value);
     PacketShared::STATUS pack_float32(  float32_t value);
     PacketShared::STATUS pack_float64(  float64_t value);
+    //packing arrays of numbers, 'len' is in elements
+    PacketShared::STATUS pack_int16_array(const int16_t* buffer, size_t len);
+    PacketShared::STATUS pack_uint16_array(const uint16_t* buffer, size_t len);
+    PacketShared::STATUS pack_int32_array(const int32_t* buffer, size_t len);
+    PacketShared::STATUS pack_uint32_array(const uint32_t* buffer, size_t len);
+    PacketShared::STATUS pack_int64_array(const int64_t* buffer, size_t len);
+    PacketShared::STATUS pack_uint64_array(const uint64_t* buffer, size_t len);
+    PacketShared::STATUS pack_float32_array(const float32_t* buffer, size_t len);
+    PacketShared::STATUS pack_float64_array(const float64_t* buffer, size_t len);
+    //packing variable length integers, 1 to 5 (32-bit) or 10 (64-bit) bytes
+    PacketShared::STATUS pack_varint32(uint32_t value);
+    PacketShared::STATUS pack_varint64(uint64_t value);
+    PacketShared::STATUS pack_zigzag32( int32_t value);
+    PacketShared::STATUS pack_zigzag64( int64_t value);
 
   private:
     //helper methods
+    static constexpr bool _zeroPadded(const byte* type_id, size_t i){
+      return (i >= MAX_TYPE_ID_LEN) ? true : (type_id[i] == 0x00 && _zeroPadded(type_id, i + 1));
+    }
+    static uint16_t _hashName(const char* name);
+    //every unpack failure passes through here to be counted when profiling
+    PacketShared::STATUS _unpackStatus(PacketShared::STATUS pcs){
+      #ifdef PACKETCOMMAND_PROFILING
+      if (pcs != PacketShared::SUCCESS){
+        _profile_unpack_errors++;
+        _profile_last_unpack_error = pcs;
+      }
+      #endif
+      return pcs;
+    }
+    //the whole field is bounds checked once before anything is touched, and
+    //memcpy keeps unaligned fields safe while still compiling to a single
+    //load or store on targets that allow it
+    PacketShared::STATUS _unpackBytes(void* dest, size_t len){
+      size_t index = _input_index;
+      size_t input_len = _input_len;
+      if (index > input_len || len > input_len - index){
+        return _unpackStatus(PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS);
+      }
+      memcpy(dest, _input_buffer + index, len);
+      _input_index = index + len;
+      return PacketShared::SUCCESS;
+    }
+    static void _copyFields(bool, const byte*){}
+    template<typename T, typename... Ts>
+    static void _copyFields(bool swap_bytes, const byte* src, T& first, Ts&... rest){
+      memcpy(&first, src, sizeof(T));
+      if (PacketByteOrder::IsNumber<T>::value && swap_bytes){
+        PacketByteOrder::swapInPlace(&first, sizeof(T));
+      }
+      _copyFields(swap_bytes, src + sizeof(T), rest...);
+    }
+    static void _storeFields(bool, byte*){}
+    template<typename T, typename... Ts>
+    static void _storeFields(bool swap_bytes, byte* dest, const T& first, const Ts&... rest){
+      memcpy(dest, &first, sizeof(T));
+      if (PacketByteOrder::IsNumber<T>::value && swap_bytes){
+        PacketByteOrder::swapInPlace(dest, sizeof(T));
+      }
+      _storeFields(swap_bytes, dest + sizeof(T), rest...);
+    }
+    PacketShared::STATUS _unpackArray(void* dest, size_t count, size_t width);
+    PacketShared::STATUS _packArray(const void* src, size_t count, size_t width);
+    PacketShared::STATUS _packBytes(const void* src, size_t len){
+      size_t index = _output_index;
+      if (index > _outputBufferSize || len > _outputBufferSize - index){
+        return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;
+      }
+      memcpy(_output_buffer + index, src, len);
+      index += len;
+      _output_index = index;
+      if (index > _output_len){ //adjust output len up
+        _output_len = index;
+      }
+      return PacketShared::SUCCESS;
+    }
+    void _loadStaticCommand(size_t index, CommandInfo& command);
+    PacketShared::STATUS _findStaticCommand(uint16_t key, CommandInfo& command);
+    PacketShared::STATUS _checkInput();
+    PacketShared::STATUS _processPacket(bool allowBatch);
+    PacketShared::STATUS _processBatch();
+    PacketShared::STATUS _matchAndDispatch();
+    struct OutputState{   //what _prepareOutput changed, for _restoreOutput
+      byte*  buffer;
+      size_t len;
+    };
+    PacketShared::STATUS _prepareOutput(OutputState& saved);
+    void _restoreOutput(const OutputState& saved);
+    PacketShared::STATUS _compressOutput();
+    PacketShared::STATUS _stampOutput();
+    void _recordLatency();
+    #ifdef PACKETCOMMAND_PROFILING
+    void _recordProfile(uint16_t key, uint32_t elapsed, uint32_t unpackErrors);
+    static void _handleProfiling(PacketCommand& this_pCmd);
+    #endif
+    PacketShared::STATUS _sendBuffered();
+    PacketShared::STATUS _coalesceOutput();
+    PacketShared::STATUS _unwrapInput();
+    byte* _scratchBuffer(byte*& buffer, size_t size);
+    //size of our own output buffer, even while it points into a queue slot;
+    //output scratch buffers are allocated once, so they must be this big
+    size_t _ownOutputBufferSize(){
+      return (_saved_output_buffer != nullptr)? _saved_outputBufferSize : _outputBufferSize;
+    }
     void allocateInputBuffer(size_t len);
     void allocateOutputBuffer(size_t len);
     //data members
     CommandInfo *_commandList;    //array to hold command entries
+    uint16_t    *_nameHashes;     //hash of each entry's name, parallel to _commandList
     CommandInfo _current_command; //command ready to dispatch
     CommandInfo _default_command; //called when a packet's Type ID is not recognized
     size_t  _commandCount;
     size_t  _maxCommands;
+    uint8_t* _dispatchTable[MAX_TYPE_ID_LEN]; //per type ID length: last byte -> list position + 1
+    const CommandInfo* _staticCommands; //compile time table sorted by typeIdKey, may be in PROGMEM
+    size_t  _staticCommandCount;
     //track state of input buffer
     byte*    _input_buffer;        //this will be a fixed buffer location
     size_t   _inputBufferSize;
@@ -197,6 +552,7 @@ class PacketCommand{
     volatile byte     _input_flags;
     volatile uint32_t _recv_timestamp_micros;
     struct InputProperties _input_properties;
+    byte*    _saved_input_buffer;  //own input buffer while pointing into a queue slot
     //track state of output buffer
     byte*  _output_buffer;       //this will be a fixed buffer location
     size_t _outputBufferSize;
@@ -205,6 +561,53 @@ class PacketCommand{
     volatile byte   _output_flags;
     volatile uint32_t _output_to_address;
     volatile uint32_t _send_timestamp_micros;
+    byte*  _stamp_buffer;          //timestamped output while it is sent, allocated on first use
+    byte*  _saved_output_buffer;   //own output buffer while pointing into a queue slot
+    size_t _saved_outputBufferSize;
+    bool   _swap_bytes;            //wire byte order differs from native
+    PacketCRC::MODE _checksum_mode;
+    uint32_t        _checksum_failures;
+    //scratch space for envelopes, allocated on first use
+    byte*  _pack_buffer;           //compressed output while it is sent
+    byte*  _unpack_buffer;         //decompressed input while it is dispatched
+    bool   _input_unpacked;        //the input buffer is in _unpack_buffer
+    //fragmentation
+    PacketReassembly* _reassembly;
+    int    _reassembly_slot;       //completed message being dispatched, or -1
+    byte   _fragment_msg_id;       //ID of the next fragmented packet sent
+    PacketReliable* _reliable;
+    uint16_t _reliable_seq;        //of the reliable packet being unwrapped
+    bool     _reliable_pending;    //set while it is
+    PacketRequestTable* _requests;
+    uint16_t _input_request_id;
+    //send timestamps and latency
+    uint32_t _input_send_timestamp;
+    uint32_t _input_latency;
+    int32_t  _clock_offset;
+    struct LatencyEntry{
+      uint16_t key;                //typeIdKey of the command
+      PacketLatencyHistogram histogram;
+    };
+    LatencyEntry* _latency;
+    size_t   _latency_size;
+    size_t   _latency_count;
+    #ifdef PACKETCOMMAND_PROFILING
+    CommandProfile* _profiles;
+    size_t   _profile_size;
+    size_t   _profile_count;
+    uint16_t _profile_key;         //of the command matched last, 0 for the default handler
+    uint32_t _profile_match_failures;
+    uint32_t _profile_unpack_errors;
+    PacketShared::STATUS _profile_last_unpack_error;
+    #endif
+    //coalescing of send_buffered packets into frames
+    byte*    _batch_buffer;
+    size_t   _batch_size;          //frame size, 0 when coalescing is off
+    size_t   _batch_len;
+    size_t   _batch_count;         //packets in the frame
+    byte     _batch_flags;         //output flags of the frame, from its packets
+    uint32_t _batch_delay_micros;
+    uint32_t _batch_started_micros;
     //cached callbacks
     bool (*_send_callback)(PacketCommand& this_pCmd);
     void (*_send_nonblocking_callback)(PacketCommand& this_pCmd);
@@ -0,0 +1,235 @@
+/*  PacketFraming
+
+*/
+#include <Arduino.h>
+#include "PacketFraming.h"
+
+const byte PacketFraming::SLIP_END;
+const byte PacketFraming::SLIP_ESC;
+const byte PacketFraming::SLIP_ESC_END;
+const byte PacketFraming::SLIP_ESC_ESC;
+
+PacketFraming::PacketFraming(PacketCommand& pCmd, Stream& stream, MODE mode)
+  : _pCmd(pCmd)
+  , _stream(stream)
+  , _mode(mode)
+{
+  _beginFrame();
+}
+
+void PacketFraming::reset()
+{
+  _beginFrame();
+}
+
+void PacketFraming::_beginFrame()
+{
+  //pick up the buffer afresh for every frame, in case it has been replaced
+  _buffer     = _pCmd.getInputBuffer();
+  _bufferSize = _pCmd.getInputBufferSize();
+  _len        = 0;
+  _blockCode  = 0;
+  _remaining  = 0;
+  _escaped    = false;
+  _dropping   = false;
+  _dropReason = PacketShared::SUCCESS;
+}
+
+PacketShared::STATUS PacketFraming::_endFrame()
+{
+  PacketShared::STATUS pfs;
+  if (_dropping){
+    #ifdef PACKETFRAMING_DEBUG
+    PACKETFRAMING_DEBUG_PORT.print(F("### Error: dropped frame, status code: "));
+    PACKETFRAMING_DEBUG_PORT.println(_dropReason);
+    #endif
+    pfs = _dropReason;
+  }
+  else if (_mode == COBS && _remaining > 0){ //delimiter inside a block
+    pfs = PacketShared::ERROR_INVALID_PACKET;
+  }
+  else if (_len == 0){ //empty frames only resynchronize the stream
+    pfs = PacketShared::NO_PACKET_RECEIVED;
+  }
+  else{
+    _pCmd.resetInputBuffer();
+    pfs = _pCmd.assignInputBuffer(_buffer, _len);
+  }
+  _beginFrame();
+  return pfs;
+}
+
+void PacketFraming::_drop(PacketShared::STATUS reason)
+{
+  //ignore everything up to the next delimiter
+  _dropping   = true;
+  _dropReason = reason;
+}
+
+bool PacketFraming::_append(byte c)
+{
+  if (_len >= _bufferSize){
+    _drop(PacketShared::ERROR_INPUT_BUFFER_OVERRUN);
+    return false;
+  }
+  _buffer[_len++] = c;
+  return true;
+}
+
+PacketShared::STATUS PacketFraming::feed(byte c)
+{
+  if (_mode == COBS){
+    return _feedCOBS(c);
+  }
+  return _feedSLIP(c);
+}
+
+PacketShared::STATUS PacketFraming::feed(const byte* data, size_t len, size_t& consumed)
+{
+  PacketShared::STATUS pfs = PacketShared::NO_PACKET_RECEIVED;
+  for(consumed=0; consumed < len && pfs == PacketShared::NO_PACKET_RECEIVED; consumed++){
+    pfs = feed(data[consumed]);
+  }
+  return pfs;
+}
+
+PacketShared::STATUS PacketFraming::recv(bool& gotPacket)
+{
+  PacketShared::STATUS pfs = PacketShared::NO_PACKET_RECEIVED;
+  while (pfs == PacketShared::NO_PACKET_RECEIVED && _stream.available() > 0){
+    int c = _stream.read();
+    if (c < 0){
+      break;
+    }
+    pfs = feed((byte) c);
+  }
+  gotPacket = (pfs == PacketShared::SUCCESS);
+  return pfs;
+}
+
+PacketShared::STATUS PacketFraming::_feedCOBS(byte c)
+{
+  if (c == 0x00){ //frame delimiter
+    return _endFrame();
+  }
+  if (_dropping){
+    return PacketShared::NO_PACKET_RECEIVED;
+  }
+  if (_remaining == 0){ //code byte starting a new block
+    //every block but a full one stood for a zero after its data, which is
+    //only written once another block follows, so the final one is dropped
+    if (_blockCode != 0 && _blockCode != 0xFF){
+      if (!_append(0x00)){
+        return PacketShared::NO_PACKET_RECEIVED;
+      }
+    }
+    _blockCode = c;
+    _remaining = c - 1;
+  }
+  else{
+    _append(c);
+    _remaining--;
+  }
+  return PacketShared::NO_PACKET_RECEIVED;
+}
+
+PacketShared::STATUS PacketFraming::_feedSLIP(byte c)
+{
+  if (c == SLIP_END){ //frame delimiter
+    if (_escaped && !_dropping){
+      _drop(PacketShared::ERROR_INVALID_PACKET);
+    }
+    return _endFrame();
+  }
+  if (_dropping){
+    return PacketShared::NO_PACKET_RECEIVED;
+  }
+  if (_escaped){
+    _escaped = false;
+    if (c == SLIP_ESC_END){
+      _append(SLIP_END);
+    }
+    else if (c == SLIP_ESC_ESC){
+      _append(SLIP_ESC);
+    }
+    else{
+      _drop(PacketShared::ERROR_INVALID_PACKET);
+    }
+  }
+  else if (c == SLIP_ESC){
+    _escaped = true;
+  }
+  else{
+    _append(c);
+  }
+  return PacketShared::NO_PACKET_RECEIVED;
+}
+
+PacketShared::STATUS PacketFraming::send()
+{
+  #ifdef PACKETFRAMING_DEBUG
+  PACKETFRAMING_DEBUG_PORT.println(F("# In PacketFraming::send"));
+  #endif
+  const byte* data = _pCmd.getOutputBuffer();
+  size_t len = _pCmd.getOutputLen();
+  if (data == nullptr && len > 0){
+    return PacketShared::ERROR_INVALID_PACKET;
+  }
+  if (_mode == COBS){
+    _sendCOBS(data, len);
+  }
+  else{
+    _sendSLIP(data, len);
+  }
+  return PacketShared::SUCCESS;
+}
+
+void PacketFraming::_sendCOBS(const byte* data, size_t len)
+{
+  //a leading delimiter flushes out any line noise at the receiver
+  _stream.write((byte) 0x00);
+  //each block is a code byte, one more than the length of the run of
+  //non-zero bytes that follows it, and the run is written straight from the
+  //output buffer
+  while (true){
+    size_t run = 0;
+    while (run < len && run < 254 && data[run] != 0x00){
+      run++;
+    }
+    _stream.write((byte) (run + 1));
+    _stream.write(data, run);
+    if (run == len){
+      break;
+    }
+    if (run == 254){ //full block, no zero follows
+      data += run;
+      len  -= run;
+    }
+    else{ //skip the zero the block stands for
+      data += run + 1;
+      len  -= run + 1;
+    }
+  }
+  _stream.write((byte) 0x00);
+}
+
+void PacketFraming::_sendSLIP(const byte* data, size_t len)
+{
+  //a leading delimiter flushes out any line noise at the receiver
+  _stream.write(SLIP_END);
+  size_t i = 0;
+  while (i < len){
+    size_t run = 0;
+    while (i + run < len && data[i + run] != SLIP_END && data[i + run] != SLIP_ESC){
+      run++;
+    }
+    _stream.write(data + i, run);
+    i += run;
+    if (i < len){
+      _stream.write(SLIP_ESC);
+      _stream.write((data[i] == SLIP_END)? SLIP_ESC_END : SLIP_ESC_ESC);
+      i++;
+    }
+  }
+  _stream.write(SLIP_END);
+}
@@ -0,0 +1,94 @@
+/*  
+*/
+#ifndef _PACKET_FRAMING_H_INCLUDED
+#define _PACKET_FRAMING_H_INCLUDED
+
+#include <Arduino.h>
+#include <Stream.h>
+#include <stdint.h>
+
+#include "PacketShared.h"
+#include "PacketCommand.h"
+
+//uncomment for debugging
+//#define PACKETFRAMING_DEBUG
+
+#ifdef PACKETFRAMING_DEBUG
+  #ifdef DEBUG_PORT
+    #define PACKETFRAMING_DEBUG_PORT DEBUG_PORT
+  #else
+    #define PACKETFRAMING_DEBUG_PORT Serial
+  #endif
+#endif
+
+/******************************************************************************/
+// PacketFraming - carries variable length packets over a byte stream such as
+// a serial port.  Each packet is sent as one frame, either COBS encoded
+// (zero bytes removed, frames end in 0x00) or SLIP encoded (frames delimited
+// by 0xC0, with special bytes escaped).
+//
+// The decoder is fed one byte at a time, doing a fixed amount of work per
+// byte, and decodes straight into the PacketCommand input buffer; when a
+// frame ends the packet is handed over with assignInputBuffer.  A frame that
+// is malformed or too long for the buffer is dropped, and decoding starts
+// again cleanly at the next frame delimiter, so lost or corrupted bytes only
+// ever cost the frames they belong to.  Typical use, from the callbacks:
+//   PacketFraming framing(pCmd, Serial);
+//   bool recv_callback(PacketCommand& pCmd){
+//     bool gotPacket;
+//     framing.recv(gotPacket);
+//     return gotPacket;
+//   }
+//   bool send_callback(PacketCommand& pCmd){
+//     return framing.send() == PacketShared::SUCCESS;
+//   }
+/******************************************************************************/
+class PacketFraming
+{
+public:
+  typedef enum FramingMode {
+    COBS = 0,
+    SLIP = 1
+  } MODE;
+  
+  PacketFraming(PacketCommand& pCmd, Stream& stream, MODE mode = COBS);
+  MODE getMode(){return _mode;};
+  void reset();   //drop any partly received frame
+  // Decoding: each returns SUCCESS once a whole packet has been assigned to
+  // the input buffer, an error code once a bad frame has been dropped, and
+  // NO_PACKET_RECEIVED while a frame is still incomplete
+  PacketShared::STATUS recv(bool& gotPacket); //read what the stream has available, up to the end of one frame
+  PacketShared::STATUS feed(byte c);
+  PacketShared::STATUS feed(const byte* data, size_t len, size_t& consumed); //stops after the end of one frame
+  // Encoding: write the current output buffer to the stream as one frame
+  PacketShared::STATUS send();
+  
+  static const byte SLIP_END     = 0xC0;
+  static const byte SLIP_ESC     = 0xDB;
+  static const byte SLIP_ESC_END = 0xDC;
+  static const byte SLIP_ESC_ESC = 0xDD;
+
+private:
+  void _beginFrame();
+  PacketShared::STATUS _endFrame();
+  void _drop(PacketShared::STATUS reason);
+  bool _append(byte c);
+  PacketShared::STATUS _feedCOBS(byte c);
+  PacketShared::STATUS _feedSLIP(byte c);
+  void _sendCOBS(const byte* data, size_t len);
+  void _sendSLIP(const byte* data, size_t len);
+  //data members
+  PacketCommand& _pCmd;
+  Stream&        _stream;
+  MODE           _mode;
+  byte*  _buffer;      //the input buffer being decoded into
+  size_t _bufferSize;
+  size_t _len;
+  byte   _blockCode;   //COBS code of the current block, 0 before the first
+  byte   _remaining;   //COBS data bytes left in the current block
+  bool   _escaped;     //SLIP escape byte seen
+  bool   _dropping;    //skipping the rest of a bad frame
+  PacketShared::STATUS _dropReason;
+};
+
+#endif /* _PACKET_FRAMING_H_INCLUDED */
@@ -0,0 +1,119 @@
+/*  PacketLZ
+
+*/
+#include <Arduino.h>
+#include <string.h>
+#include "PacketLZ.h"
+
+namespace PacketLZ{
+
+static const size_t HASH_SIZE = ((size_t) 1) << PACKETLZ_HASH_BITS;
+
+static inline size_t hash3(const uint8_t* p)
+{
+  uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+  return (size_t) ((v * 2654435761UL) >> (32 - PACKETLZ_HASH_BITS)) & (HASH_SIZE - 1);
+}
+
+size_t compress(const uint8_t* src, size_t len, uint8_t* dest, size_t destSize)
+{
+  //positions are stored plus one, so zero marks an empty entry
+  if (len > 0xFFFF){ //positions must fit the table entries
+    return 0;
+  }
+  uint16_t table[HASH_SIZE];
+  memset(table, 0, sizeof(table));
+  size_t out = 0;
+  size_t control_pos = 0;
+  uint8_t control_bit = 0;  //0 means a new control byte is needed
+  size_t i = 0;
+  while (i < len){
+    if (control_bit == 0){
+      if (out >= destSize){
+        return 0;
+      }
+      control_pos = out++;
+      dest[control_pos] = 0x00;
+      control_bit = 0x01;
+    }
+    size_t match_len = 0;
+    size_t offset = 0;
+    if (i + MIN_MATCH <= len){
+      size_t h = hash3(src + i);
+      size_t candidate = table[h];
+      table[h] = (uint16_t) (i + 1);
+      if (candidate > 0 && i - (candidate - 1) <= MAX_OFFSET){
+        size_t cand = candidate - 1;
+        size_t limit = len - i;
+        if (limit > MAX_MATCH){
+          limit = MAX_MATCH;
+        }
+        while (match_len < limit && src[cand + match_len] == src[i + match_len]){
+          match_len++;
+        }
+        offset = i - cand;
+      }
+    }
+    if (match_len >= MIN_MATCH){
+      if (out + 2 > destSize){
+        return 0;
+      }
+      dest[out++] = (uint8_t) (offset - 1);
+      dest[out++] = (uint8_t) ((((offset - 1) >> 4) & 0xF0) | (match_len - MIN_MATCH));
+      dest[control_pos] |= control_bit;
+      //index the positions the match covers, so later data can refer to them
+      for(size_t k=1; k < match_len && i + k + MIN_MATCH <= len; k++){
+        table[hash3(src + i + k)] = (uint16_t) (i + k + 1);
+      }
+      i += match_len;
+    }
+    else{
+      if (out >= destSize){
+        return 0;
+      }
+      dest[out++] = src[i++];
+    }
+    control_bit <<= 1;
+  }
+  return out;
+}
+
+PacketShared::STATUS decompress(const uint8_t* src, size_t len, uint8_t* dest, size_t destSize, size_t& outLen)
+{
+  size_t in = 0;
+  size_t out = 0;
+  while (in < len){
+    uint8_t control = src[in++];
+    for(uint8_t bit=0x01; bit != 0 && in < len; bit <<= 1){
+      if (control & bit){
+        if (in + 2 > len){
+          return PacketShared::ERROR_INVALID_PACKET;
+        }
+        size_t offset    = (size_t) src[in] + ((size_t) (src[in + 1] & 0xF0) << 4) + 1;
+        size_t match_len = (size_t) (src[in + 1] & 0x0F) + MIN_MATCH;
+        in += 2;
+        if (offset > out){
+          return PacketShared::ERROR_INVALID_PACKET;
+        }
+        if (match_len > destSize - out){
+          return PacketShared::ERROR_INPUT_BUFFER_OVERRUN;
+        }
+        //byte by byte, since a match may overlap the bytes it produces
+        for(size_t k=0; k < match_len; k++){
+          dest[out + k] = dest[out + k - offset];
+        }
+        out += match_len;
+      }
+      else{
+        if (out >= destSize){
+          return PacketShared::ERROR_INPUT_BUFFER_OVERRUN;
+        }
+        dest[out++] = src[in++];
+      }
+    }
+  }
+  outLen = out;
+  return PacketShared::SUCCESS;
+}
+
+} //namespace PacketLZ
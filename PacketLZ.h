@@ -0,0 +1,44 @@
+/*  
+*/
+#ifndef _PACKET_LZ_H_INCLUDED
+#define _PACKET_LZ_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "PacketShared.h"
+
+// Match finder hash table size, 2 bytes per entry on the stack while
+// compressing; smaller tables find fewer matches but cost less RAM
+#ifndef PACKETLZ_HASH_BITS
+  #if defined(__AVR__)
+    #define PACKETLZ_HASH_BITS 6
+  #else
+    #define PACKETLZ_HASH_BITS 10
+  #endif
+#endif
+
+/******************************************************************************/
+// PacketLZ - LZSS compression of whole packets, meant for payloads such as
+// log dumps or configuration blobs that repeat themselves.  The packet being
+// compressed is its own window, so the only extra memory is the hash table
+// above.  The compressed data is a series of groups, each a control byte
+// followed by up to eight items, one per control bit (least significant
+// first): a 0 bit is a literal byte, a 1 bit a two byte match of 3 to 18
+// bytes copied from 1 to 4096 bytes back,
+//   [offset - 1, low 8 bits] [offset - 1, high 4 bits | length - 3]
+// Decompression is a single pass with no memory beyond its output.
+/******************************************************************************/
+namespace PacketLZ{
+  static const size_t MIN_MATCH  = 3;
+  static const size_t MAX_MATCH  = 18;
+  static const size_t MAX_OFFSET = 4096;
+  
+  // Returns the compressed length, or 0 if it would not fit in 'destSize'
+  size_t compress(const uint8_t* src, size_t len, uint8_t* dest, size_t destSize);
+  // Returns ERROR_INVALID_PACKET for corrupt data and
+  // ERROR_INPUT_BUFFER_OVERRUN if the result would not fit in 'destSize'
+  PacketShared::STATUS decompress(const uint8_t* src, size_t len, uint8_t* dest, size_t destSize, size_t& outLen);
+}
+
+#endif /* _PACKET_LZ_H_INCLUDED */
@@ -0,0 +1,72 @@
+/*  PacketLatencyHistogram
+
+*/
+#include <Arduino.h>
+#include <string.h>
+#include "PacketLatencyHistogram.h"
+
+const size_t PacketLatencyHistogram::BUCKETS;
+
+void PacketLatencyHistogram::reset()
+{
+  memset(_buckets, 0, sizeof(_buckets));
+  _count = 0;
+  _min   = 0;
+  _max   = 0;
+  _sum   = 0;
+}
+
+void PacketLatencyHistogram::add(uint32_t sample)
+{
+  if (_count == 0 || sample < _min){ _min = sample;}
+  if (sample > _max){ _max = sample;}
+  _buckets[bucketFor(sample)]++;
+  _count++;
+  _sum += sample;
+}
+
+/**
+ * Bucket index is the position of the highest set bit, so bucket b holds
+ * [2^b, 2^(b+1)) except that bucket 0 also holds zero
+ */
+size_t PacketLatencyHistogram::bucketFor(uint32_t sample)
+{
+  size_t bucket = 0;
+  while (sample > 1 && bucket < BUCKETS - 1){
+    sample >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+uint32_t PacketLatencyHistogram::bucketLimit(size_t bucket)
+{
+  if (bucket >= BUCKETS - 1 || bucket >= 31){
+    return 0xFFFFFFFFUL;
+  }
+  return (((uint32_t) 2) << bucket) - 1;
+}
+
+/**
+ * Upper bound of the bucket holding the pct'th percentile sample, clipped
+ * to the largest sample seen; zero with no samples
+ */
+uint32_t PacketLatencyHistogram::percentile(uint8_t pct) const
+{
+  if (_count == 0){
+    return 0;
+  }
+  if (pct > 100){ pct = 100;}
+  //rank of the sample wanted, rounded up and at least the first
+  uint32_t rank = (uint32_t) (((uint64_t) _count*pct + 99)/100);
+  if (rank == 0){ rank = 1;}
+  uint32_t seen = 0;
+  for(size_t b=0; b < BUCKETS; b++){
+    seen += _buckets[b];
+    if (seen >= rank){
+      uint32_t limit = bucketLimit(b);
+      return (limit < _max)? limit : _max;
+    }
+  }
+  return _max;
+}
@@ -0,0 +1,51 @@
+/*
+*/
+#ifndef _PACKET_LATENCY_HISTOGRAM_H_INCLUDED
+#define _PACKET_LATENCY_HISTOGRAM_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Number of power of two buckets, the last one also counting everything
+// longer: 20 reach about a second in microseconds, 24 about 16 seconds
+#ifndef PACKETCOMMAND_LATENCY_BUCKETS
+  #if defined(__AVR__)
+    #define PACKETCOMMAND_LATENCY_BUCKETS 20
+  #else
+    #define PACKETCOMMAND_LATENCY_BUCKETS 24
+  #endif
+#endif
+
+/******************************************************************************/
+// PacketLatencyHistogram - latency samples in microseconds, counted in
+// buckets [0,2), [2,4), [4,8) ... so that the memory is fixed whatever the
+// spread.  The minimum and maximum are exact; percentiles are reported as
+// the upper bound of the bucket they fall in, so they are never
+// underestimated by more than a factor of two.
+/******************************************************************************/
+class PacketLatencyHistogram
+{
+public:
+  static const size_t BUCKETS = PACKETCOMMAND_LATENCY_BUCKETS;
+
+  PacketLatencyHistogram(){reset();};
+  void     reset();
+  void     add(uint32_t sample);
+  uint32_t count() const {return _count;};
+  uint32_t minimum() const {return _min;};   //zero until there are samples
+  uint32_t maximum() const {return _max;};
+  uint32_t mean() const {return (_count > 0)? (uint32_t) (_sum/_count) : 0;};
+  uint32_t percentile(uint8_t pct) const;
+  uint32_t bucketCount(size_t bucket) const {return _buckets[bucket];};
+  static uint32_t bucketLimit(size_t bucket);   //upper bound of a bucket
+  static size_t   bucketFor(uint32_t sample);
+
+private:
+  uint32_t _buckets[BUCKETS];
+  uint32_t _count;
+  uint32_t _min;
+  uint32_t _max;
+  uint64_t _sum;
+};
+
+#endif /* _PACKET_LATENCY_HISTOGRAM_H_INCLUDED */
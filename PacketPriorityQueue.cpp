@@ -0,0 +1,130 @@
+/*  PacketPriorityQueue
+
+*/
+#include <Arduino.h>
+#include "PacketPriorityQueue.h"
+
+const size_t PacketPriorityQueue::MAX_LEVELS;
+
+PacketPriorityQueue::PacketPriorityQueue()
+  : _numLevels(0)
+  , _classifier(nullptr)
+{
+  for(size_t i=0; i < MAX_LEVELS; i++){
+    _levels[i] = nullptr;
+  }
+}
+
+PacketShared::STATUS PacketPriorityQueue::attachLevel(size_t level, PacketQueue& pq)
+{
+  if (level >= MAX_LEVELS){
+    return PacketShared::ERROR_INVALID_CAPACITY;
+  }
+  _levels[level] = &pq;
+  if (level + 1 > _numLevels){
+    _numLevels = level + 1;
+  }
+  return PacketShared::SUCCESS;
+}
+
+void PacketPriorityQueue::registerClassifier(size_t (*classifier)(const byte* data, size_t len, byte flags))
+{
+  _classifier = classifier;
+}
+
+size_t PacketPriorityQueue::levelFor(const byte* data, size_t len, byte flags) const
+{
+  size_t level;
+  if (_classifier != nullptr){
+    level = (*_classifier)(data, len, flags);
+  }
+  else{
+    level = (flags & PacketShared::OPFLAG_IS_QUERY)? (_numLevels - 1) : 0;
+  }
+  //fall back to the nearest lower level that exists, or else the nearest
+  //higher one; _numLevels - 1 is always attached
+  if (level >= _numLevels){
+    level = _numLevels - 1;
+  }
+  for(size_t i=level + 1; i > 0; i--){
+    if (_levels[i - 1] != nullptr){
+      return i - 1;
+    }
+  }
+  while (_levels[level] == nullptr){
+    level++;
+  }
+  return level;
+}
+
+int PacketPriorityQueue::highestReady() const
+{
+  //at most MAX_LEVELS checks, whatever the number of packets queued
+  for(size_t i=_numLevels; i > 0; i--){
+    PacketQueue* pq = _levels[i - 1];
+    if (pq != nullptr && pq->size() > 0){
+      return (int) (i - 1);
+    }
+  }
+  return -1;
+}
+
+size_t PacketPriorityQueue::size() const
+{
+  size_t n = 0;
+  for(size_t i=0; i < _numLevels; i++){
+    if (_levels[i] != nullptr){
+      n += _levels[i]->size();
+    }
+  }
+  return n;
+}
+
+PacketShared::STATUS PacketPriorityQueue::reset()
+{
+  for(size_t i=0; i < _numLevels; i++){
+    if (_levels[i] != nullptr){
+      _levels[i]->reset();
+    }
+  }
+  return PacketShared::SUCCESS;
+}
+
+size_t PacketPriorityQueue::flush()
+{
+  size_t n = 0;
+  for(size_t i=0; i < _numLevels; i++){
+    if (_levels[i] != nullptr){
+      n += _levels[i]->flush();
+    }
+  }
+  return n;
+}
+
+PacketShared::STATUS PacketPriorityQueue::enqueue(PacketShared::Packet& pkt)
+{
+  if (_numLevels == 0){
+    return PacketShared::ERROR_QUEUE_OVERFLOW;
+  }
+  return _levels[levelFor(pkt.data, pkt.length, pkt.flags)]->enqueue(pkt);
+}
+
+PacketShared::STATUS PacketPriorityQueue::dequeue(PacketShared::Packet& pkt)
+{
+  int level = highestReady();
+  if (level < 0){
+    pkt.length = 0; //set to safe value
+    return PacketShared::ERROR_QUEUE_UNDERFLOW;
+  }
+  return _levels[level]->dequeue(pkt);
+}
+
+PacketShared::STATUS PacketPriorityQueue::requeue(PacketShared::Packet& pkt)
+{
+  //goes back to the front of its own level, so FIFO order within every other
+  //level is left alone
+  if (_numLevels == 0){
+    return PacketShared::ERROR_QUEUE_OVERFLOW;
+  }
+  return _levels[levelFor(pkt.data, pkt.length, pkt.flags)]->requeue(pkt);
+}
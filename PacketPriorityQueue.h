@@ -0,0 +1,48 @@
+/*  
+*/
+#ifndef _PACKET_PRIORITY_QUEUE_H_INCLUDED
+#define _PACKET_PRIORITY_QUEUE_H_INCLUDED
+
+#include <stdint.h>
+
+#include "PacketShared.h"
+#include "PacketQueue.h"
+
+/******************************************************************************/
+// PacketPriorityQueue - several PacketQueues, one per priority level, that
+// behave as one queue: packets are placed in a level chosen from their flags
+// or contents, and dequeue always serves the highest level that is not empty,
+// so that bulk traffic can never hold up urgent packets.  Each level is its
+// own PacketQueue (of any mode, possibly a StaticPacketQueue) supplied by the
+// caller, so its capacity is that level's limit and a full low level never
+// takes room from a higher one.  Level 0 is the lowest priority.
+/******************************************************************************/
+class PacketPriorityQueue
+{
+public:
+  static const size_t MAX_LEVELS = 8;
+  
+  PacketPriorityQueue();
+  PacketShared::STATUS attachLevel(size_t level, PacketQueue& pq);
+  // The classifier returns the level for a packet; by default packets
+  // flagged OPFLAG_IS_QUERY go to the highest level and the rest to level 0
+  void registerClassifier(size_t (*classifier)(const byte* data, size_t len, byte flags));
+  size_t levelFor(const byte* data, size_t len, byte flags) const;
+  size_t levels() const { return _numLevels; }
+  PacketQueue& level(size_t level){ return *_levels[level]; }
+  // highest attached level holding packets, or -1 when all are empty
+  int    highestReady() const;
+  size_t size() const;
+  PacketShared::STATUS reset();
+  PacketShared::STATUS enqueue(PacketShared::Packet& pkt);
+  PacketShared::STATUS dequeue(PacketShared::Packet& pkt);
+  PacketShared::STATUS requeue(PacketShared::Packet& pkt);
+  size_t flush();
+
+private:
+  PacketQueue* _levels[MAX_LEVELS];
+  size_t _numLevels;  //one past the highest attached level
+  size_t (*_classifier)(const byte* data, size_t len, byte flags);
+};
+
+#endif /* _PACKET_PRIORITY_QUEUE_H_INCLUDED */
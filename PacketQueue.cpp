@@ -4,12 +4,23 @@
 #include <Arduino.h>
 #include "PacketQueue.h"
 
+const size_t PacketQueue::COMPACT_HEADER_SIZE;
+const size_t PacketQueue::COMPACT_MAX_LENGTH;
+
 PacketQueue::PacketQueue()
-  : _beg_index(0)
-  , _end_index(0)
-  , _size(0)
+  : _head(0)
+  , _tail(0)
   , _capacity(0)
+  , _mask(0)
   , _dataBufferSize(PacketShared::DATA_BUFFER_SIZE)
+  , _slotStorage(nullptr)
+  , _slotStride(0)
+  , _ownsStorage(false)
+  , _storage(nullptr)
+  , _pushed(0)
+  , _popped(0)
+  , _reservedPos(0)
+  , _reservedLen(0)
 {
 //  //preallocate memory for all the slots
 //  _slots = (PacketShared::Packet*) calloc(_capacity, sizeof(PacketShared::Packet));
@@ -22,31 +33,84 @@ PacketQueue::PacketQueue()
 //  }
 }
 
-PacketShared::STATUS PacketQueue::begin(size_t capacity)
+PacketShared::STATUS PacketQueue::begin(size_t capacity, size_t slotSize)
 {
   #ifdef PACKETQUEUE_DEBUG
   PACKETQUEUE_DEBUG_PORT.println(F("# In PacketQueue::begin"));
   #endif
+  if (capacity == 0 || capacity > PACKETQUEUE_MAX_CAPACITY || slotSize == 0){
+    #ifdef PACKETQUEUE_DEBUG
+    PACKETQUEUE_DEBUG_PORT.println(F("### Error: invalid queue capacity!"));
+    #endif
+    return PacketShared::ERROR_INVALID_CAPACITY;
+  }
   //preallocate memory for all the slots
-  _slots = (PacketShared::Packet*) calloc(capacity, sizeof(PacketShared::Packet));
-  if (_slots == NULL){
+  byte* storage = (byte*) calloc(capacity, slotStride(slotSize));
+  if (storage == NULL){
     #ifdef PACKETQUEUE_DEBUG
     PACKETQUEUE_DEBUG_PORT.println("### Error failed to allocate memory for the queue!");
     #endif
     return PacketShared::ERROR_MEMALLOC_FAIL;
   } 
   #ifdef PACKETQUEUE_DEBUG
-  PACKETQUEUE_DEBUG_PORT.print("# \tallocated &_slots=");DEBUG_PORT.println((int) &_slots, HEX);
+  PACKETQUEUE_DEBUG_PORT.print("# \tallocated storage=");DEBUG_PORT.println((int) storage, HEX);
   #endif
-  PacketShared::Packet *pkt_slot;
-  for(size_t i=0; i < _capacity; i++){
-    pkt_slot = &(_slots[i]); //pull out the slot by address
-    //pkt_slot->data = (byte*) calloc(_dataBufferSize, sizeof(byte));
-    pkt_slot->length = 0;
-    pkt_slot->timestamp = 0;
-    pkt_slot->flags  = 0x00;
+  //power of two capacities can wrap their indices with a mask
+  size_t mask = ((capacity & (capacity - 1)) == 0)? (2*capacity - 1) : 0;
+  _attachSlots(storage, capacity, slotSize, mask);
+  _ownsStorage = true;
+  return PacketShared::SUCCESS;
+}
+
+/**
+ * Set up slot mode over caller provided storage of capacity*slotStride(slotSize)
+ * bytes, suitably aligned for a SlotHeader
+ */
+void PacketQueue::_attachSlots(byte* storage, size_t capacity, size_t slotSize, size_t mask)
+{
+  _slotStorage    = storage;
+  _slotStride     = slotStride(slotSize);
+  _dataBufferSize = slotSize;
+  SlotHeader *slot_hdr;
+  for(size_t i=0; i < capacity; i++){
+    slot_hdr = _slotHeader(i); //pull out the slot by address
+    slot_hdr->length = 0;
+    slot_hdr->timestamp = 0;
+    slot_hdr->flags  = 0x00;
   }
   _capacity = capacity;  //make sure to cache
+  _mask = mask;
+  _ownsStorage = false;
+  _head = 0;
+  _tail = 0;
+}
+
+PacketShared::STATUS PacketQueue::beginCompact(size_t bufferSize)
+{
+  #ifdef PACKETQUEUE_DEBUG
+  PACKETQUEUE_DEBUG_PORT.println(F("# In PacketQueue::beginCompact"));
+  #endif
+  if (bufferSize <= COMPACT_HEADER_SIZE + 1 || bufferSize > PACKETQUEUE_MAX_COMPACT_SIZE){
+    #ifdef PACKETQUEUE_DEBUG
+    PACKETQUEUE_DEBUG_PORT.println(F("### Error: invalid queue buffer size!"));
+    #endif
+    return PacketShared::ERROR_INVALID_CAPACITY;
+  }
+  _storage = (byte*) calloc(bufferSize, sizeof(byte));
+  if (_storage == NULL){
+    #ifdef PACKETQUEUE_DEBUG
+    PACKETQUEUE_DEBUG_PORT.println("### Error failed to allocate memory for the queue!");
+    #endif
+    return PacketShared::ERROR_MEMALLOC_FAIL;
+  }
+  _capacity = bufferSize;
+  _mask = 0;
+  //largest record that fits, leaving the gap between tail and head
+  _dataBufferSize = min(bufferSize - COMPACT_HEADER_SIZE - 1, COMPACT_MAX_LENGTH);
+  _head = 0;
+  _tail = 0;
+  _pushed = 0;
+  _popped = 0;
   return PacketShared::SUCCESS;
 }
 
@@ -57,35 +121,83 @@ PacketShared::STATUS PacketQueue::end()
   //  pkt_slot = &(_slots[i]); //pull out the slot by address
   //  //free(pkt_slot->data);
   //}
-  free(_slots);
+  if (_ownsStorage){
+    free(_slotStorage);
+  }
+  free(_storage);
+  _slotStorage = nullptr;
+  _ownsStorage = false;
+  _storage = nullptr;
+  _capacity = 0;
+  _dataBufferSize = PacketShared::DATA_BUFFER_SIZE;
   return PacketShared::SUCCESS;
 }
 
+size_t PacketQueue::size() const
+{
+  if (_storage != nullptr){
+    return (pq_index_t) (PACKETQUEUE_LOAD_ACQUIRE(_pushed) - PACKETQUEUE_LOAD_ACQUIRE(_popped));
+  }
+  return _count(PACKETQUEUE_LOAD_ACQUIRE(_head), PACKETQUEUE_LOAD_ACQUIRE(_tail));
+}
+
 PacketShared::STATUS PacketQueue::reset()
 {
+  //NOTE not safe while a producer may be running, use flush from the consumer instead
   #ifdef PACKETQUEUE_DEBUG
   PACKETQUEUE_DEBUG_PORT.println(F("# In PacketQueue::reset"));
   #endif
-  _size= 0;
-  _beg_index = 0;
-  _end_index = 0;
+  PACKETQUEUE_STORE_RELEASE(_head, 0);
+  PACKETQUEUE_STORE_RELEASE(_tail, 0);
+  PACKETQUEUE_STORE_RELEASE(_pushed, 0);
+  PACKETQUEUE_STORE_RELEASE(_popped, 0);
   return PacketShared::SUCCESS;
 }
 
+size_t PacketQueue::flush()
+{
+  //consumer side: drop everything the producer has published so far
+  if (_storage != nullptr){
+    //the count must be read first, so that no packet is dropped uncounted
+    pq_index_t pushed = PACKETQUEUE_LOAD_ACQUIRE(_pushed);
+    size_t n = (pq_index_t) (pushed - _popped);
+    size_t ignored;
+    uint32_t ignored_timestamp;
+    byte ignored_flags;
+    for(size_t i=0; i < n; i++){
+      _peekCompact(ignored, ignored_timestamp, ignored_flags);
+      _releaseCompact();
+    }
+    return n;
+  }
+  pq_index_t tail = PACKETQUEUE_LOAD_ACQUIRE(_tail);
+  size_t n = _count(_head, tail);
+  PACKETQUEUE_STORE_RELEASE(_head, tail);
+  return n;
+}
+
 PacketShared::STATUS PacketQueue::enqueue(PacketShared::Packet& pkt)
 {
   #ifdef PACKETQUEUE_DEBUG
   PACKETQUEUE_DEBUG_PORT.println(F("# In PacketQueue::enqueue"));
   #endif
-  if ((_size + 1) <= _capacity){
-    _put_at(_end_index, pkt);
-     //adjust the size and indices
-    _size++;
-    _end_index = (_end_index + 1) % _capacity; //wrap around if needed
+  if (_storage != nullptr){
+    size_t max_len;
+    byte* data = _reserveCompact(max_len, pkt.length);
+    if (data == nullptr){
+      return PacketShared::ERROR_QUEUE_OVERFLOW;
+    }
+    memcpy(data, pkt.data, pkt.length);
+    return _commitCompact(pkt.length, pkt.timestamp, pkt.flags);
+  }
+  pq_index_t tail = _tail;  //only we write it
+  if (_count(PACKETQUEUE_LOAD_ACQUIRE(_head), tail) < _capacity){
+    _put_at(_slot(tail), pkt);
+    //publish the slot only once it has been filled
+    PACKETQUEUE_STORE_RELEASE(_tail, _next(tail));
     #ifdef PACKETQUEUE_DEBUG
     PACKETQUEUE_DEBUG_PORT.println(F("# (enqueue) after copy"));
-    PACKETQUEUE_DEBUG_PORT.print(F("# \t_end_index="));DEBUG_PORT.println(_end_index);
-    PACKETQUEUE_DEBUG_PORT.print(F("# \t_size="));DEBUG_PORT.println(_size);
+    PACKETQUEUE_DEBUG_PORT.print(F("# \t_tail="));DEBUG_PORT.println(_tail);
     #endif
     return PacketShared::SUCCESS;
   }
@@ -102,15 +214,33 @@ PacketShared::STATUS PacketQueue::dequeue(PacketShared::Packet& pkt)
   #ifdef PACKETQUEUE_DEBUG
   //DEBUG_PORT.println(F("# In PacketQueue::dequeue"));
   #endif
-  if (_size > 0){
-    _get_from(_beg_index, pkt);
-    //adjust the size and indices
-    _beg_index = (_beg_index + 1) % _capacity; //wrap around if needed
-    _size--;
+  if (_storage != nullptr){
+    size_t len;
+    byte* data = _peekCompact(len, pkt.timestamp, pkt.flags);
+    if (data == nullptr){
+      pkt.length = 0; //set to safe value
+      return PacketShared::ERROR_QUEUE_UNDERFLOW;
+    }
+    if (len > PacketShared::DATA_BUFFER_SIZE){
+      pkt.length = 0; //left in the queue, to be taken with peek instead
+      return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;
+    }
+    pkt.length = len;
+    memcpy(pkt.data, data, pkt.length);
+    return _releaseCompact();
+  }
+  pq_index_t head = _head;  //only we write it
+  if (head != PACKETQUEUE_LOAD_ACQUIRE(_tail)){
+    if (_slotHeader(_slot(head))->length > PacketShared::DATA_BUFFER_SIZE){
+      pkt.length = 0; //left in the queue, to be taken with peek instead
+      return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;
+    }
+    _get_from(_slot(head), pkt);
+    //hand the slot back only once it has been copied out
+    PACKETQUEUE_STORE_RELEASE(_head, _next(head));
     #ifdef PACKETQUEUE_DEBUG
     PACKETQUEUE_DEBUG_PORT.println(F("# (dequeue) after copy"));
-    PACKETQUEUE_DEBUG_PORT.print(F("# \t_beg_index="));DEBUG_PORT.println(_beg_index);
-    PACKETQUEUE_DEBUG_PORT.print(F("# \t_size="));DEBUG_PORT.println(_size);
+    PACKETQUEUE_DEBUG_PORT.print(F("# \t_head="));DEBUG_PORT.println(_head);
     #endif
     return PacketShared::SUCCESS;
   }
@@ -123,21 +253,99 @@ PacketShared::STATUS PacketQueue::dequeue(PacketShared::Packet& pkt)
   }
 }
 
+size_t PacketQueue::enqueueBulk(PacketShared::Packet* pkts, size_t n)
+{
+  #ifdef PACKETQUEUE_DEBUG
+  PACKETQUEUE_DEBUG_PORT.println(F("# In PacketQueue::enqueueBulk"));
+  #endif
+  if (_storage != nullptr){
+    //compact records vary in size, so each one is placed and published in turn
+    size_t i;
+    for(i=0; i < n; i++){
+      if (enqueue(pkts[i]) != PacketShared::SUCCESS){
+        break;
+      }
+    }
+    return i;
+  }
+  pq_index_t tail = _tail;  //only we write it
+  size_t space = _capacity - _count(PACKETQUEUE_LOAD_ACQUIRE(_head), tail);
+  n = min(n, space);
+  for(size_t i=0; i < n; i++){
+    _put_at(_slot(tail), pkts[i]);
+    tail = _next(tail);
+  }
+  //publish the whole batch at once
+  PACKETQUEUE_STORE_RELEASE(_tail, tail);
+  return n;
+}
+
+size_t PacketQueue::dequeueBulk(PacketShared::Packet* pkts, size_t n)
+{
+  #ifdef PACKETQUEUE_DEBUG
+  PACKETQUEUE_DEBUG_PORT.println(F("# In PacketQueue::dequeueBulk"));
+  #endif
+  if (_storage != nullptr){
+    size_t i;
+    for(i=0; i < n; i++){
+      if (dequeue(pkts[i]) != PacketShared::SUCCESS){
+        break;
+      }
+    }
+    return i;
+  }
+  pq_index_t head = _head;  //only we write it
+  size_t avail = _count(head, PACKETQUEUE_LOAD_ACQUIRE(_tail));
+  n = min(n, avail);
+  for(size_t i=0; i < n; i++){
+    if (_slotHeader(_slot(head))->length > PacketShared::DATA_BUFFER_SIZE){
+      n = i;  //stop in front of a packet that does not fit in a Packet
+      break;
+    }
+    _get_from(_slot(head), pkts[i]);
+    head = _next(head);
+  }
+  //hand all the slots back at once
+  PACKETQUEUE_STORE_RELEASE(_head, head);
+  return n;
+}
+
 PacketShared::STATUS PacketQueue::requeue(PacketShared::Packet& pkt)
 {
-  //pushes packet onto the front of the queue
+  return requeue(pkt.data, pkt.length, pkt.timestamp, pkt.flags);
+}
+
+PacketShared::STATUS PacketQueue::requeue(const byte* data, size_t len, uint32_t timestamp, byte flags)
+{
+  //pushes packet onto the front of the queue, this moves the head index so
+  //it must only be called from the consumer side.  The slot in front of the
+  //head may also be the one a producer is filling at the tail, and neither
+  //side's check can see the other, so the producer must not run meanwhile
   #ifdef PACKETQUEUE_DEBUG
   PACKETQUEUE_DEBUG_PORT.println(F("# In PacketCommand::requeue"));
   #endif
-  if ((_size + 1) <= _capacity){
-    //update the size and indices ahead of time
-    _size++;
-    _beg_index = (_beg_index == 0)? (_capacity - 1) : (_beg_index - 1); //wrap around if needed
-    _put_at(_beg_index, pkt);
+  if (len > _dataBufferSize){
+    #ifdef PACKETQUEUE_DEBUG
+    PACKETQUEUE_DEBUG_PORT.println(F("### Error: packet is longer than a slot"));
+    #endif
+    return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;
+  }
+  if (_storage != nullptr){
+    return _requeueCompact(data, len, timestamp, flags);
+  }
+  pq_index_t head = _head;  //only we write it
+  if (_count(head, PACKETQUEUE_LOAD_ACQUIRE(_tail)) < _capacity){
+    head = _prev(head);
+    size_t index = _slot(head);
+    SlotHeader *slot_hdr = _slotHeader(index);
+    memcpy(_slotData(index), data, len);
+    slot_hdr->length    = len;
+    slot_hdr->timestamp = timestamp;
+    slot_hdr->flags     = flags;
+    PACKETQUEUE_STORE_RELEASE(_head, head);
     #ifdef PACKETQUEUE_DEBUG
     PACKETQUEUE_DEBUG_PORT.println(F("# (requeue) after copy"));
-    PACKETQUEUE_DEBUG_PORT.print(F("# \t_beg_index="));DEBUG_PORT.println(_beg_index);
-    PACKETQUEUE_DEBUG_PORT.print(F("# \t_size="));DEBUG_PORT.println(_size);
+    PACKETQUEUE_DEBUG_PORT.print(F("# \t_head="));DEBUG_PORT.println(_head);
     #endif
     return PacketShared::SUCCESS;
   }
@@ -149,53 +357,308 @@ PacketShared::STATUS PacketQueue::requeue(PacketShared::Packet& pkt)
   }
 }
 
+byte* PacketQueue::reserve(size_t& maxLen, size_t minLen)
+{
+  #ifdef PACKETQUEUE_DEBUG
+  PACKETQUEUE_DEBUG_PORT.println(F("# In PacketQueue::reserve"));
+  #endif
+  if (_storage != nullptr){
+    return _reserveCompact(maxLen, minLen);
+  }
+  //a slot is always the same size, longer packets get truncated by commit
+  pq_index_t tail = _tail;  //only we write it
+  if (_count(PACKETQUEUE_LOAD_ACQUIRE(_head), tail) < _capacity){
+    maxLen = _dataBufferSize;
+    return _slotData(_slot(tail));
+  }
+  else{
+    #ifdef PACKETQUEUE_DEBUG
+    PACKETQUEUE_DEBUG_PORT.println(F("\t### Error: Queue Overflow"));
+    #endif
+    maxLen = 0;
+    return nullptr;
+  }
+}
+
+PacketShared::STATUS PacketQueue::commit(size_t len, uint32_t timestamp, byte flags)
+{
+  //publishes the slot handed out by reserve, which has been filled in place
+  #ifdef PACKETQUEUE_DEBUG
+  PACKETQUEUE_DEBUG_PORT.println(F("# In PacketQueue::commit"));
+  #endif
+  if (_storage != nullptr){
+    return _commitCompact(len, timestamp, flags);
+  }
+  pq_index_t tail = _tail;  //only we write it
+  if (_count(PACKETQUEUE_LOAD_ACQUIRE(_head), tail) < _capacity){
+    SlotHeader *slot_hdr = _slotHeader(_slot(tail));
+    slot_hdr->length    = min(len, _dataBufferSize);
+    slot_hdr->timestamp = timestamp;
+    slot_hdr->flags     = flags;
+    PACKETQUEUE_STORE_RELEASE(_tail, _next(tail));
+    return PacketShared::SUCCESS;
+  }
+  else{
+    #ifdef PACKETQUEUE_DEBUG
+    PACKETQUEUE_DEBUG_PORT.println(F("\t### Error: Queue Overflow"));
+    #endif
+    return PacketShared::ERROR_QUEUE_OVERFLOW;
+  }
+}
+
+byte* PacketQueue::peek(size_t& len, uint32_t& timestamp, byte& flags)
+{
+  if (_storage != nullptr){
+    return _peekCompact(len, timestamp, flags);
+  }
+  pq_index_t head = _head;  //only we write it
+  if (head != PACKETQUEUE_LOAD_ACQUIRE(_tail)){
+    size_t index = _slot(head);
+    SlotHeader *slot_hdr = _slotHeader(index);
+    len       = slot_hdr->length;
+    timestamp = slot_hdr->timestamp;
+    flags     = slot_hdr->flags;
+    return _slotData(index);
+  }
+  else{
+    len       = 0; //set to safe values
+    timestamp = 0;
+    flags     = 0x00;
+    return nullptr;
+  }
+}
+
+PacketShared::STATUS PacketQueue::release()
+{
+  //frees the slot handed out by peek
+  if (_storage != nullptr){
+    return _releaseCompact();
+  }
+  pq_index_t head = _head;  //only we write it
+  if (head != PACKETQUEUE_LOAD_ACQUIRE(_tail)){
+    PACKETQUEUE_STORE_RELEASE(_head, _next(head));
+    return PacketShared::SUCCESS;
+  }
+  else{
+    return PacketShared::ERROR_QUEUE_UNDERFLOW;
+  }
+}
+
+/******************************************************************************/
+// Compact mode
+//
+// Records are stored contiguously, a header followed by the data, and never
+// straddle the end of the ring.  When a record does not fit in the space left
+// at the end, the producer skips to the start, leaving a length of
+// COMPACT_PAD behind (if there is room for it) to tell the consumer to do
+// the same.
+/******************************************************************************/
+static const uint16_t COMPACT_PAD = 0xFFFF;
+
+void PacketQueue::_writeHeader(size_t offset, size_t len, uint32_t timestamp, byte flags)
+{
+  byte* hdr = _storage + offset;
+  hdr[0] = (byte) (len & 0xFF);
+  hdr[1] = (byte) (len >> 8);
+  hdr[2] = flags;
+  memcpy(hdr + 3, &timestamp, sizeof(uint32_t));
+}
+
+size_t PacketQueue::_recordStart(pq_index_t offset) const
+{
+  //skip the unused end of the ring if the producer wrapped around there
+  if (_capacity - offset < 2){
+    return 0;
+  }
+  byte* hdr = _storage + offset;
+  if (hdr[0] == (COMPACT_PAD & 0xFF) && hdr[1] == (COMPACT_PAD >> 8)){
+    return 0;
+  }
+  return offset;
+}
+
+byte* PacketQueue::_reserveCompact(size_t& maxLen, size_t minLen)
+{
+  size_t head = PACKETQUEUE_LOAD_ACQUIRE(_head);
+  size_t tail = _tail;  //only we write it
+  size_t need = COMPACT_HEADER_SIZE + minLen;
+  size_t pos;
+  size_t run;
+  if (tail >= head){
+    //free space is at the end and, before the head, at the start
+    size_t end_run   = (head == 0)? (_capacity - tail - 1) : (_capacity - tail);
+    size_t start_run = (head == 0)? 0 : (head - 1);
+    if (end_run >= need && end_run > COMPACT_HEADER_SIZE){
+      pos = tail;
+      run = end_run;
+    }
+    else if (start_run >= need && start_run > COMPACT_HEADER_SIZE){
+      pos = 0;
+      run = start_run;
+    }
+    else{
+      maxLen = 0;
+      return nullptr;
+    }
+  }
+  else{
+    //free space is between the tail and the head
+    pos = tail;
+    run = head - tail - 1;
+    if (run < need || run <= COMPACT_HEADER_SIZE){
+      maxLen = 0;
+      return nullptr;
+    }
+  }
+  maxLen = min(run - COMPACT_HEADER_SIZE, COMPACT_MAX_LENGTH);
+  _reservedPos = pos;
+  _reservedLen = maxLen;
+  return _storage + pos + COMPACT_HEADER_SIZE;
+}
+
+PacketShared::STATUS PacketQueue::_commitCompact(size_t len, uint32_t timestamp, byte flags)
+{
+  if (_reservedLen == 0 || len > _reservedLen){
+    //nothing reserved or the record would overrun its reservation
+    #ifdef PACKETQUEUE_DEBUG
+    PACKETQUEUE_DEBUG_PORT.println(F("\t### Error: Queue Overflow"));
+    #endif
+    return PacketShared::ERROR_QUEUE_OVERFLOW;
+  }
+  size_t tail = _tail;  //only we write it
+  size_t pos  = _reservedPos;
+  if (pos != tail && (_capacity - tail) >= 2){ //wrapped, so mark the end as unused
+    _storage[tail]     = (byte) (COMPACT_PAD & 0xFF);
+    _storage[tail + 1] = (byte) (COMPACT_PAD >> 8);
+  }
+  _writeHeader(pos, len, timestamp, flags);
+  size_t next = pos + COMPACT_HEADER_SIZE + len;
+  if (next == _capacity){
+    next = 0;
+  }
+  _reservedLen = 0;
+  PACKETQUEUE_STORE_RELEASE(_pushed, (pq_index_t) (_pushed + 1));
+  PACKETQUEUE_STORE_RELEASE(_tail, (pq_index_t) next);
+  return PacketShared::SUCCESS;
+}
+
+byte* PacketQueue::_peekCompact(size_t& len, uint32_t& timestamp, byte& flags)
+{
+  pq_index_t head = _head;  //only we write it
+  if (head == PACKETQUEUE_LOAD_ACQUIRE(_tail)){
+    len       = 0; //set to safe values
+    timestamp = 0;
+    flags     = 0x00;
+    return nullptr;
+  }
+  byte* hdr = _storage + _recordStart(head);
+  len   = hdr[0] | ((size_t) hdr[1] << 8);
+  flags = hdr[2];
+  memcpy(&timestamp, hdr + 3, sizeof(uint32_t));
+  return hdr + COMPACT_HEADER_SIZE;
+}
+
+PacketShared::STATUS PacketQueue::_releaseCompact()
+{
+  pq_index_t head = _head;  //only we write it
+  if (head == PACKETQUEUE_LOAD_ACQUIRE(_tail)){
+    return PacketShared::ERROR_QUEUE_UNDERFLOW;
+  }
+  size_t pos = _recordStart(head);
+  size_t len = _storage[pos] | ((size_t) _storage[pos + 1] << 8);
+  size_t next = pos + COMPACT_HEADER_SIZE + len;
+  if (next == _capacity){
+    next = 0;
+  }
+  PACKETQUEUE_STORE_RELEASE(_popped, (pq_index_t) (_popped + 1));
+  PACKETQUEUE_STORE_RELEASE(_head, (pq_index_t) next);
+  return PacketShared::SUCCESS;
+}
+
+PacketShared::STATUS PacketQueue::_requeueCompact(const byte* data, size_t len, uint32_t timestamp, byte flags)
+{
+  //the record has to fit contiguously in the free space just in front of
+  //the head, otherwise this reports an overflow even if the queue has room.
+  //A producer that loaded the old head may be reserving those same bytes,
+  //so as in slot mode the producer must not run meanwhile
+  size_t head = _head;  //only we write it
+  size_t tail = PACKETQUEUE_LOAD_ACQUIRE(_tail);
+  size_t need = COMPACT_HEADER_SIZE + len;
+  size_t pos;
+  if (tail >= head && head >= need){
+    pos = head - need;
+  }
+  else if (tail >= head && head == 0 && (_capacity - tail) > need){
+    pos = _capacity - need;  //ends exactly at the end of the ring, so reading continues at the head
+  }
+  else if (tail < head && (head - tail) > need){
+    pos = head - need;
+  }
+  else{
+    #ifdef PACKETQUEUE_DEBUG
+    PACKETQUEUE_DEBUG_PORT.println(F("### Error: Queue Overflow"));
+    #endif
+    return PacketShared::ERROR_QUEUE_OVERFLOW;
+  }
+  _writeHeader(pos, len, timestamp, flags);
+  memcpy(_storage + pos + COMPACT_HEADER_SIZE, data, len);
+  PACKETQUEUE_STORE_RELEASE(_popped, (pq_index_t) (_popped - 1));
+  PACKETQUEUE_STORE_RELEASE(_head, (pq_index_t) pos);
+  return PacketShared::SUCCESS;
+}
+
 void PacketQueue::_put_at(size_t index, PacketShared::Packet& pkt)
 {
-  PacketShared::Packet *pkt_slot = &(_slots[index]); //pull out the slot by address
+  SlotHeader *slot_hdr = _slotHeader(index); //pull out the slot by address
+  byte *slot_data = _slotData(index);
+  size_t len = min(pkt.length, _dataBufferSize);
   #ifdef PACKETQUEUE_DEBUG
   PACKETQUEUE_DEBUG_PORT.println(F("# In PacketQueue::_put_at"));
   PACKETQUEUE_DEBUG_PORT.print(F("# \tindex="));DEBUG_PORT.println(index);
   PACKETQUEUE_DEBUG_PORT.print(F("# \t&pkt="));DEBUG_PORT.println((unsigned int) &pkt,HEX);
-  PACKETQUEUE_DEBUG_PORT.print(F("# \tpkt_slot="));DEBUG_PORT.println((unsigned int) pkt_slot,HEX);
+  PACKETQUEUE_DEBUG_PORT.print(F("# \tslot_hdr="));DEBUG_PORT.println((unsigned int) slot_hdr,HEX);
   PACKETQUEUE_DEBUG_PORT.print(F("# \tcopying data: "));
   #endif
   //copy the packet object into the slot
-  for(size_t i=0; i < pkt.length; i++){
+  for(size_t i=0; i < len; i++){
     #ifdef PACKETQUEUE_DEBUG
     PACKETQUEUE_DEBUG_PORT.print(pkt.data[i], HEX);DEBUG_PORT.print(F(" "));
     #endif
-    pkt_slot->data[i] = pkt.data[i];
+    slot_data[i] = pkt.data[i];
   }
   #ifdef PACKETQUEUE_DEBUG
   PACKETQUEUE_DEBUG_PORT.println();
   #endif
-  pkt_slot->length    = pkt.length; //update length field
-  pkt_slot->timestamp = pkt.timestamp;
-  pkt_slot->flags     = pkt.flags;
+  slot_hdr->length    = len; //update length field
+  slot_hdr->timestamp = pkt.timestamp;
+  slot_hdr->flags     = pkt.flags;
 }
 
 void PacketQueue::_get_from(size_t index, PacketShared::Packet& pkt)
 {
-  PacketShared::Packet *pkt_slot = &(_slots[index]); //pull out the slot by address
+  SlotHeader *slot_hdr = _slotHeader(index); //pull out the slot by address
+  byte *slot_data = _slotData(index);
   #ifdef PACKETQUEUE_DEBUG
   PACKETQUEUE_DEBUG_PORT.println(F("# In PacketQueue::_get_from"));
   PACKETQUEUE_DEBUG_PORT.print(F("# \tindex="));DEBUG_PORT.println(index);
   PACKETQUEUE_DEBUG_PORT.print(F("# \t&pkt="));DEBUG_PORT.println((unsigned int) &pkt,HEX);
-  PACKETQUEUE_DEBUG_PORT.print(F("# \tpkt_slot="));DEBUG_PORT.println((unsigned int) pkt_slot,HEX);
-  PACKETQUEUE_DEBUG_PORT.print(F("# \tpkt_slot->length="));DEBUG_PORT.println(pkt_slot->length);
+  PACKETQUEUE_DEBUG_PORT.print(F("# \tslot_hdr="));DEBUG_PORT.println((unsigned int) slot_hdr,HEX);
+  PACKETQUEUE_DEBUG_PORT.print(F("# \tslot_hdr->length="));DEBUG_PORT.println(slot_hdr->length);
   PACKETQUEUE_DEBUG_PORT.print(F("# \tcopying data: 0x"));
   #endif
-  //copy the slot data to the current the referenced packet object
-  for(size_t i=0; (i < pkt_slot->length) && (i < _dataBufferSize); i++){
+  //copy the slot data to the current the referenced packet object, which
+  //may be smaller than the slot
+  size_t len = min(slot_hdr->length, PacketShared::DATA_BUFFER_SIZE);
+  for(size_t i=0; i < len; i++){
     #ifdef PACKETQUEUE_DEBUG
-    PACKETQUEUE_DEBUG_PORT.print(pkt_slot->data[i], HEX);DEBUG_PORT.print(F(" "));
+    PACKETQUEUE_DEBUG_PORT.print(slot_data[i], HEX);DEBUG_PORT.print(F(" "));
     #endif
-    pkt.data[i] = pkt_slot->data[i];
+    pkt.data[i] = slot_data[i];
   }
   #ifdef PACKETQUEUE_DEBUG
   PACKETQUEUE_DEBUG_PORT.println();
   #endif
-  pkt.length    = min(pkt_slot->length,_dataBufferSize);
-  pkt.timestamp = pkt_slot->timestamp;
-  pkt.flags     = pkt_slot->flags;
+  pkt.length    = len;
+  pkt.timestamp = slot_hdr->timestamp;
+  pkt.flags     = slot_hdr->flags;
 }
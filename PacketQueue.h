@@ -10,6 +10,31 @@
 //uncomment for debugging
 //#define PACKETQUEUE_DEBUG
 
+// The queue is safe for one producer and one consumer running concurrently,
+// e.g. a radio interrupt handler enqueueing while loop() dequeues, without
+// disabling interrupts.  Each side only writes its own index and publishes
+// it with release ordering after the slot contents are complete.  The one
+// exception is requeue, which writes into free space the producer may be
+// filling at the same moment, so the producer must be held off while it
+// runs (e.g. with interrupts disabled).
+#if defined(__AVR__)
+  // single byte accesses are atomic on 8-bit AVR and the core has no memory
+  // reordering, so only the compiler needs to be kept from reordering
+  typedef uint8_t pq_index_t;
+  #define PACKETQUEUE_MAX_CAPACITY 127
+  #define PACKETQUEUE_MAX_COMPACT_SIZE 255
+  #define PACKETQUEUE_LOAD_ACQUIRE(var)        (__extension__({pq_index_t v = (var); __asm__ __volatile__("" ::: "memory"); v;}))
+  #define PACKETQUEUE_STORE_RELEASE(var, val)  do{__asm__ __volatile__("" ::: "memory"); (var) = (val);}while(0)
+#else
+  // the same builtins std::atomic is implemented with, which are available
+  // on every gcc based Arduino core, unlike <atomic> itself
+  typedef size_t pq_index_t;
+  #define PACKETQUEUE_MAX_CAPACITY (((size_t) -1)/2)
+  #define PACKETQUEUE_MAX_COMPACT_SIZE (((size_t) -1)/2)
+  #define PACKETQUEUE_LOAD_ACQUIRE(var)        __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+  #define PACKETQUEUE_STORE_RELEASE(var, val)  __atomic_store_n(&(var), (val), __ATOMIC_RELEASE)
+#endif
+
 #ifdef PACKETQUEUE_DEBUG
   #ifdef DEBUG_PORT
     #define PACKETQUEUE_DEBUG_PORT DEBUG_PORT
@@ -21,29 +46,141 @@
 class PacketQueue
 {
 public:
+  // Compact mode record header: 16-bit length, flags byte, 32-bit timestamp
+  static const size_t COMPACT_HEADER_SIZE = 7;
+  static const size_t COMPACT_MAX_LENGTH  = 0x7FFE;
+  
+  // Slot mode storage: each slot is a header followed by the packet data
+  struct SlotHeader {
+    size_t   length;
+    uint32_t timestamp;
+    byte     flags;
+  };
+  // bytes taken by one slot, rounded up so that every header stays aligned
+  static constexpr size_t slotStride(size_t slotSize){
+    return ((sizeof(SlotHeader) + slotSize + alignof(SlotHeader) - 1)/alignof(SlotHeader))*alignof(SlotHeader);
+  }
+  
   PacketQueue();
-  PacketShared::STATUS begin(size_t capacity);
+  // Slot mode: 'capacity' fixed size slots of 'slotSize' bytes each
+  PacketShared::STATUS begin(size_t capacity, size_t slotSize = PacketShared::DATA_BUFFER_SIZE);
+  // Compact mode: packets of any length are packed back to back, each with
+  // a small header, into one ring of 'bufferSize' bytes
+  PacketShared::STATUS beginCompact(size_t bufferSize);
   PacketShared::STATUS end();
-  size_t size() const { return _size; }
-  size_t capacity() const { return _capacity; }
+  bool   isCompact() const { return _storage != nullptr; }
+  size_t size() const;
+  size_t capacity() const { return _capacity; }  //slots, or bytes in compact mode
+  size_t slotSize() const { return _dataBufferSize; } //largest packet a slot (or compact record) holds
   PacketShared::STATUS reset();
+  // producer side
   PacketShared::STATUS enqueue(PacketShared::Packet& pkt);
+  // consumer side, requeue pushes back onto the front so it belongs here too,
+  // but it is not safe against a producer running concurrently.  A packet
+  // longer than a Packet is not cut off: dequeue returns
+  // ERROR_PACKET_INDEX_OUT_OF_BOUNDS and dequeueBulk stops in front of it,
+  // leaving it at the head to be taken with peek and release
   PacketShared::STATUS dequeue(PacketShared::Packet& pkt);
   PacketShared::STATUS requeue(PacketShared::Packet& pkt);
+  // requeue straight from a buffer into the slot in front of the head; a
+  // packet longer than slotSize() is refused rather than cut off
+  PacketShared::STATUS requeue(const byte* data, size_t len, uint32_t timestamp = 0, byte flags = 0x00);
+  // Move up to 'n' packets in one call, returning how many were moved.  In
+  // slot mode the other side's index is read once and our own index is
+  // published once for the whole batch.
+  size_t enqueueBulk(PacketShared::Packet* pkts, size_t n);  //producer side
+  size_t dequeueBulk(PacketShared::Packet* pkts, size_t n);  //consumer side
+  // Zero-copy access to the slots: a producer fills the slot returned by
+  // reserve in place and then commits it, and a consumer reads the slot
+  // returned by peek in place and then releases it.  Both return nullptr
+  // when the queue is full or empty, respectively.  In compact mode,
+  // reserve fails unless 'minLen' contiguous bytes are free, and the
+  // length committed may not exceed the 'maxLen' it handed out.
+  byte* reserve(size_t& maxLen, size_t minLen = 0);
+  PacketShared::STATUS commit(size_t len, uint32_t timestamp = 0, byte flags = 0x00);
+  byte* peek(size_t& len, uint32_t& timestamp, byte& flags);
+  PacketShared::STATUS release();
   // Empty the queue,return number of packets flushed
   size_t flush();
 
+protected:
+  void _attachSlots(byte* storage, size_t capacity, size_t slotSize, size_t mask);
+
 private:
+  SlotHeader* _slotHeader(size_t index) const {
+    return (SlotHeader*) (_slotStorage + index*_slotStride);
+  }
+  byte* _slotData(size_t index) const {
+    return _slotStorage + index*_slotStride + sizeof(SlotHeader);
+  }
   void _put_at(size_t index, PacketShared::Packet& pkt);
   void _get_from(size_t index, PacketShared::Packet& pkt);
+  // Indices run over [0, 2*capacity) so that a full queue can be told apart
+  // from an empty one without a shared size counter.  When the capacity is
+  // a power of two the wraparound is a mask, otherwise a compare.
+  size_t _slot(pq_index_t i) const {
+    return (_mask != 0) ? (i & (_capacity - 1)) : ((i >= _capacity) ? (i - _capacity) : i);
+  }
+  pq_index_t _next(pq_index_t i) const {
+    return (_mask != 0) ? ((i + 1) & _mask) : ((i + 1 == 2*_capacity) ? 0 : (i + 1));
+  }
+  pq_index_t _prev(pq_index_t i) const {
+    return (_mask != 0) ? ((i - 1) & _mask) : ((i == 0) ? (2*_capacity - 1) : (i - 1));
+  }
+  size_t _count(pq_index_t head, pq_index_t tail) const {
+    return (tail >= head) ? (tail - head) : (tail + 2*_capacity - head);
+  }
+  // Compact mode helpers; here the indices are byte offsets into _storage,
+  // and the tail is never allowed to come round onto the head
+  byte* _reserveCompact(size_t& maxLen, size_t minLen);
+  PacketShared::STATUS _commitCompact(size_t len, uint32_t timestamp, byte flags);
+  byte* _peekCompact(size_t& len, uint32_t& timestamp, byte& flags);
+  PacketShared::STATUS _releaseCompact();
+  PacketShared::STATUS _requeueCompact(const byte* data, size_t len, uint32_t timestamp, byte flags);
+  size_t _recordStart(pq_index_t offset) const;
+  void   _writeHeader(size_t offset, size_t len, uint32_t timestamp, byte flags);
   
-  volatile size_t _beg_index;
-  volatile size_t _end_index;
-  volatile size_t _size;
+  pq_index_t _head;   //next slot to read, only written by the consumer
+  pq_index_t _tail;   //next slot to write, only written by the producer
   size_t _capacity;
+  size_t _mask;       //2*capacity - 1 for power of two capacities, otherwise zero
   size_t _dataBufferSize;
-  PacketShared::Packet* _slots;
+  byte*  _slotStorage;
+  size_t _slotStride;
+  bool   _ownsStorage;  //false when the storage is static, see StaticPacketQueue
+  // compact mode state
+  byte*  _storage;
+  pq_index_t _pushed;        //packets committed, only written by the producer
+  pq_index_t _popped;        //packets released, only written by the consumer
+  pq_index_t _reservedPos;   //where the pending reservation starts
+  size_t _reservedLen;
+  
+};
+
+/******************************************************************************/
+// StaticPacketQueue - a slot mode PacketQueue whose storage is sized at 
+// compile time and allocated statically, so no begin() call or heap is needed
+//   StaticPacketQueue<8, 64> inputQueue;  //eight slots of 64 bytes
+/******************************************************************************/
+template<size_t Capacity, size_t SlotSize = PacketShared::DATA_BUFFER_SIZE>
+class StaticPacketQueue : public PacketQueue
+{
+public:
+  static_assert(Capacity > 0 && Capacity <= PACKETQUEUE_MAX_CAPACITY, "StaticPacketQueue: invalid Capacity");
+  static_assert(SlotSize > 0, "StaticPacketQueue: invalid SlotSize");
+  static constexpr size_t SLOT_STRIDE = PacketQueue::slotStride(SlotSize);
+  // wraparound mask, nonzero when Capacity is a power of two
+  static constexpr size_t MASK = ((Capacity & (Capacity - 1)) == 0) ? (2*Capacity - 1) : 0;
   
+  StaticPacketQueue(){
+    _attachSlots(_buffer, Capacity, SlotSize, MASK);
+  }
+  //a copy would still point at the original's storage
+  StaticPacketQueue(const StaticPacketQueue&) = delete;
+  StaticPacketQueue& operator=(const StaticPacketQueue&) = delete;
+
+private:
+  alignas(PacketQueue::SlotHeader) byte _buffer[Capacity*SLOT_STRIDE];
 };
 
 #endif /* _PACKET_QUEUE_H_INCLUDED */
@@ -0,0 +1,197 @@
+/*  PacketReassembly
+
+*/
+#include <Arduino.h>
+#include <string.h>
+#include "PacketReassembly.h"
+
+const size_t   PacketReassembly::HEADER_SIZE;
+const size_t   PacketReassembly::MAX_FRAGMENTS;
+const uint32_t PacketReassembly::TIMEOUT_MILLIS_DEFAULT;
+
+PacketReassembly::PacketReassembly()
+  : _slots(nullptr)
+  , _numSlots(0)
+  , _bufferSize(0)
+  , _timeoutMillis(TIMEOUT_MILLIS_DEFAULT)
+  , _dropped(0)
+  , _lastCompleted(-1)
+  , _lastCompletedMillis(0)
+{
+}
+
+PacketShared::STATUS PacketReassembly::begin(size_t slots, size_t bufferSize, uint32_t timeoutMillis)
+{
+  #ifdef PACKETREASSEMBLY_DEBUG
+  PACKETREASSEMBLY_DEBUG_PORT.println(F("# In PacketReassembly::begin"));
+  #endif
+  if (slots == 0 || bufferSize == 0){
+    return PacketShared::ERROR_INVALID_CAPACITY;
+  }
+  //preallocate the slots and all of their buffers
+  Slot* new_slots = (Slot*) calloc(slots, sizeof(Slot));
+  byte* storage   = (byte*) calloc(slots, bufferSize);
+  if (new_slots == NULL || storage == NULL){
+    #ifdef PACKETREASSEMBLY_DEBUG
+    PACKETREASSEMBLY_DEBUG_PORT.println(F("### Error failed to allocate memory for the reassembly buffers!"));
+    #endif
+    free(new_slots);
+    free(storage);
+    return PacketShared::ERROR_MEMALLOC_FAIL;
+  }
+  for(size_t i=0; i < slots; i++){
+    new_slots[i].buffer = storage + i*bufferSize;
+  }
+  if (_slots != nullptr){   //begun before, the buffers are one allocation
+    free(_slots[0].buffer);
+    free(_slots);
+  }
+  _slots         = new_slots;
+  _numSlots      = slots;
+  _bufferSize    = bufferSize;
+  _timeoutMillis = timeoutMillis;
+  reset();
+  return PacketShared::SUCCESS;
+}
+
+void PacketReassembly::reset()
+{
+  for(size_t i=0; i < _numSlots; i++){
+    _slots[i].busy     = false;
+    _slots[i].complete = false;
+  }
+  _dropped = 0;
+  _lastCompleted = -1;
+}
+
+PacketShared::STATUS PacketReassembly::add(const byte* fragment, size_t len, int& slot)
+{
+  if (_numSlots == 0){
+    return PacketShared::ERROR_INVALID_CAPACITY;
+  }
+  if (len < HEADER_SIZE){
+    return PacketShared::ERROR_INVALID_PACKET;
+  }
+  byte   msg_id = fragment[0];
+  byte   index  = fragment[1];
+  byte   count  = fragment[2];
+  size_t offset = ((size_t) fragment[3] << 8) | fragment[4];
+  const byte* data = fragment + HEADER_SIZE;
+  size_t data_len  = len - HEADER_SIZE;
+  if (count == 0 || index >= count){
+    return PacketShared::ERROR_INVALID_PACKET;
+  }
+  if (offset > _bufferSize || data_len > _bufferSize - offset){
+    #ifdef PACKETREASSEMBLY_DEBUG
+    PACKETREASSEMBLY_DEBUG_PORT.println(F("### Error: fragment lies beyond the end of the reassembly buffer"));
+    #endif
+    return PacketShared::ERROR_INPUT_BUFFER_OVERRUN;
+  }
+  expire();
+  int i = _findSlot(msg_id, count);
+  if (i == DUPLICATE){
+    return PacketShared::INCOMPLETE_PACKET;
+  }
+  if (i < 0){
+    return PacketShared::ERROR_QUEUE_OVERFLOW;  //every slot holds a completed message
+  }
+  Slot& s = _slots[i];
+  byte bit = 1 << (index & 0x07);
+  if (s.received[index >> 3] & bit){
+    return PacketShared::INCOMPLETE_PACKET;     //a duplicate
+  }
+  memcpy(s.buffer + offset, data, data_len);
+  s.received[index >> 3] |= bit;
+  s.num_received++;
+  if (offset + data_len > s.len){
+    s.len = offset + data_len;
+  }
+  if (s.num_received < s.count){
+    return PacketShared::INCOMPLETE_PACKET;
+  }
+  s.complete = true;
+  _lastCompleted       = msg_id;
+  _lastCompletedMillis = millis();
+  slot = i;
+  return PacketShared::SUCCESS;
+}
+
+void PacketReassembly::release(int slot)
+{
+  _slots[slot].busy     = false;
+  _slots[slot].complete = false;
+}
+
+size_t PacketReassembly::expire()
+{
+  uint32_t now = millis();
+  size_t n = 0;
+  //stray fragments of the last message are not expected after the timeout
+  //either, and the ID may be reused by then, e.g. by a restarted sender
+  if (_lastCompleted >= 0 && (now - _lastCompletedMillis) >= _timeoutMillis){
+    _lastCompleted = -1;
+  }
+  for(size_t i=0; i < _numSlots; i++){
+    Slot& s = _slots[i];
+    if (s.busy && !s.complete && (now - s.started_millis) >= _timeoutMillis){
+      _drop(s);
+      n++;
+    }
+  }
+  return n;
+}
+
+/**
+ * The slot collecting this message, or else a free one, or else the one
+ * holding the oldest incomplete message, which is dropped.  Fragments of the
+ * message completed last are stray duplicates and get no slot, until the
+ * timeout has passed since it completed.
+ */
+int PacketReassembly::_findSlot(byte msg_id, byte count)
+{
+  int free_slot = -1;
+  int oldest    = -1;
+  uint32_t now  = millis();
+  for(size_t i=0; i < _numSlots; i++){
+    Slot& s = _slots[i];
+    if (!s.busy){
+      if (free_slot < 0){ free_slot = i;}
+    }
+    else if (!s.complete){
+      if (s.msg_id == msg_id && s.count == count){
+        return i;
+      }
+      if (oldest < 0 || (now - s.started_millis) > (now - _slots[oldest].started_millis)){
+        oldest = i;
+      }
+    }
+  }
+  if (msg_id == _lastCompleted){
+    return DUPLICATE;
+  }
+  if (free_slot < 0 && oldest >= 0){
+    #ifdef PACKETREASSEMBLY_DEBUG
+    PACKETREASSEMBLY_DEBUG_PORT.println(F("# PacketReassembly: all buffers busy, dropping the oldest message"));
+    #endif
+    _drop(_slots[oldest]);
+    free_slot = oldest;
+  }
+  if (free_slot >= 0){
+    Slot& s = _slots[free_slot];
+    memset(s.received, 0, sizeof(s.received));
+    s.len            = 0;
+    s.started_millis = now;
+    s.msg_id         = msg_id;
+    s.count          = count;
+    s.num_received   = 0;
+    s.busy           = true;
+    s.complete       = false;
+  }
+  return free_slot;
+}
+
+void PacketReassembly::_drop(Slot& slot)
+{
+  slot.busy = false;
+  _dropped++;
+}
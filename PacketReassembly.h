@@ -0,0 +1,84 @@
+/*
+*/
+#ifndef _PACKET_REASSEMBLY_H_INCLUDED
+#define _PACKET_REASSEMBLY_H_INCLUDED
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "PacketShared.h"
+
+//uncomment for debugging
+//#define PACKETREASSEMBLY_DEBUG
+
+#ifdef PACKETREASSEMBLY_DEBUG
+  #ifdef DEBUG_PORT
+    #define PACKETREASSEMBLY_DEBUG_PORT DEBUG_PORT
+  #else
+    #define PACKETREASSEMBLY_DEBUG_PORT Serial
+  #endif
+#endif
+
+/******************************************************************************/
+// PacketReassembly - a fixed pool of buffers in which packets sent in
+// fragments by PacketCommand::sendFragmented are put back together.  Each
+// fragment carries a header after its envelope bytes,
+//   [message ID] [fragment index] [fragment count] [offset, big endian uint16]
+// so fragments may arrive in any order and duplicates are ignored, including
+// late ones of the last message completed, for as long as the timeout.  A
+// message that is not complete within the timeout is dropped, as is the
+// oldest incomplete message when a new one arrives and every buffer is busy.
+// Attach one to the receiving PacketCommand, which then hands each whole
+// packet to its handler as if it had arrived in one piece:
+//   PacketReassembly reassembly;
+//   reassembly.begin(2, 1024);
+//   pCmd.attachReassembly(reassembly);
+/******************************************************************************/
+class PacketReassembly
+{
+public:
+  static const size_t   HEADER_SIZE    = 5;
+  static const size_t   MAX_FRAGMENTS  = 255;
+  static const uint32_t TIMEOUT_MILLIS_DEFAULT = 1000;
+
+  PacketReassembly();
+  PacketShared::STATUS begin(size_t slots, size_t bufferSize, uint32_t timeoutMillis = TIMEOUT_MILLIS_DEFAULT);
+  void   reset();   //drop every message, complete or not
+  size_t getBufferSize(){return _bufferSize;};
+  // Store one fragment (the bytes after the envelope prefix and type).
+  // Returns SUCCESS with 'slot' set once it completes its message,
+  // INCOMPLETE_PACKET while more fragments are needed, or an error if the
+  // fragment is malformed or lies beyond the end of the buffers
+  PacketShared::STATUS add(const byte* fragment, size_t len, int& slot);
+  byte*  getBuffer(int slot){return _slots[slot].buffer;};
+  size_t getLength(int slot){return _slots[slot].len;};
+  void   release(int slot);   //done with a completed message
+  size_t expire();            //drop timed out messages, returns how many
+  uint32_t getDropped(){return _dropped;};  //messages lost to timeouts or eviction
+
+private:
+  struct Slot {
+    byte*    buffer;
+    size_t   len;
+    uint32_t started_millis;
+    byte     received[(MAX_FRAGMENTS + 7)/8]; //one bit per fragment index
+    byte     msg_id;
+    byte     count;
+    byte     num_received;
+    bool     busy;
+    bool     complete;
+  };
+  static const int DUPLICATE = -2;
+  int  _findSlot(byte msg_id, byte count);  //-1 if none is free, DUPLICATE for a completed message
+  void _drop(Slot& slot);
+  //data members
+  Slot*    _slots;
+  size_t   _numSlots;
+  size_t   _bufferSize;
+  uint32_t _timeoutMillis;
+  uint32_t _dropped;
+  int      _lastCompleted;   //message ID of the last completed message, or -1
+  uint32_t _lastCompletedMillis;
+};
+
+#endif /* _PACKET_REASSEMBLY_H_INCLUDED */
@@ -0,0 +1,281 @@
+/*  PacketReliable
+
+*/
+#include <Arduino.h>
+#include <string.h>
+#include "PacketReliable.h"
+
+const size_t   PacketReliable::MAX_WINDOW;
+const size_t   PacketReliable::HEADER_SIZE;
+const size_t   PacketReliable::ACK_SIZE;
+const uint32_t PacketReliable::RTO_INITIAL_MICROS;
+const uint32_t PacketReliable::RTO_MIN_MICROS_DEFAULT;
+const uint32_t PacketReliable::RTO_MAX_MICROS_DEFAULT;
+
+PacketReliable::PacketReliable(PacketCommand& pCmd, PacketQueue& backlog)
+  : _pCmd(pCmd)
+  , _backlog(backlog)
+  , _slots(nullptr)
+  , _window(0)
+  , _slotMask(0)
+  , _slotSize(0)
+  , _rtoMin(RTO_MIN_MICROS_DEFAULT)
+  , _rtoMax(RTO_MAX_MICROS_DEFAULT)
+  , _ackDelay(0)
+{
+  reset();
+}
+
+PacketShared::STATUS PacketReliable::begin(size_t windowSize)
+{
+  #ifdef PACKETRELIABLE_DEBUG
+  PACKETRELIABLE_DEBUG_PORT.println(F("# In PacketReliable::begin"));
+  #endif
+  if (windowSize == 0 || windowSize > MAX_WINDOW){
+    return PacketShared::ERROR_INVALID_CAPACITY;
+  }
+  //preallocate the window, with room for a whole queued packet per slot
+  size_t slot_count = 1;
+  while (slot_count < windowSize){ slot_count <<= 1;}
+  size_t slot_size = _backlog.slotSize();
+  Slot* slots   = (Slot*) calloc(slot_count, sizeof(Slot));
+  byte* storage = (byte*) calloc(slot_count, slot_size);
+  if (slots == NULL || storage == NULL){
+    #ifdef PACKETRELIABLE_DEBUG
+    PACKETRELIABLE_DEBUG_PORT.println(F("### Error failed to allocate memory for the window!"));
+    #endif
+    free(slots);
+    free(storage);
+    return PacketShared::ERROR_MEMALLOC_FAIL;
+  }
+  for(size_t i=0; i < slot_count; i++){
+    slots[i].data = storage + i*slot_size;
+  }
+  _slots    = slots;
+  _window   = windowSize;
+  _slotMask = slot_count - 1;
+  _slotSize = slot_size;
+  reset();
+  return PacketShared::SUCCESS;
+}
+
+void PacketReliable::reset()
+{
+  _baseSeq     = 0;
+  _nextSeq     = 0;
+  _srtt        = 0;
+  _rttvar      = 0;
+  _rto         = RTO_INITIAL_MICROS;
+  _retransmits = 0;
+  _recvNext    = 0;
+  _recvBits    = 0;
+  _ackPending  = false;
+  _ackDueMicros = 0;
+  _duplicates  = 0;
+}
+
+PacketShared::STATUS PacketReliable::send()
+{
+  if (_pCmd.getOutputLen() + HEADER_SIZE > (size_t) _pCmd.getOutputBufferSize()){
+    #ifdef PACKETRELIABLE_DEBUG
+    PACKETRELIABLE_DEBUG_PORT.println(F("### Error: no room in the output buffer for the sequence number"));
+    #endif
+    return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;
+  }
+  if (_pCmd.getOutputLen() > _backlog.slotSize()){
+    #ifdef PACKETRELIABLE_DEBUG
+    PACKETRELIABLE_DEBUG_PORT.println(F("### Error: packet is longer than a backlog slot"));
+    #endif
+    return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;   //the backlog would cut it short
+  }
+  return _pCmd.enqueueOutputBuffer(_backlog);
+}
+
+/**
+ * Send an ACK if one is due, retransmit packets whose timeout has passed,
+ * then move packets from the backlog into the window while it has room.
+ */
+size_t PacketReliable::poll()
+{
+  if (_window == 0){
+    return 0;
+  }
+  uint32_t now = micros();
+  size_t n = 0;
+  if (_ackPending && (now - _ackDueMicros) < 0x80000000UL){
+    _sendAck();
+  }
+  bool timed_out = false;
+  for(uint16_t seq = _baseSeq; seq != _nextSeq; seq++){
+    Slot& slot = _slot(seq);
+    if (!slot.acked && (now - slot.sent_micros) >= _rto){
+      #ifdef PACKETRELIABLE_DEBUG
+      PACKETRELIABLE_DEBUG_PORT.print(F("# PacketReliable: retransmitting "));
+      PACKETRELIABLE_DEBUG_PORT.println(seq);
+      #endif
+      slot.retransmitted = true;
+      _retransmits++;
+      timed_out = true;
+      _transmit(seq);
+      n++;
+    }
+  }
+  if (timed_out){
+    _rto = min(2*_rto, _rtoMax);   //back off until an ACK gives a new sample
+  }
+  while ((uint16_t) (_nextSeq - _baseSeq) < _window){
+    size_t   len;
+    uint32_t timestamp;
+    byte     flags;
+    byte* data = _backlog.peek(len, timestamp, flags);
+    if (data == nullptr){
+      break;
+    }
+    Slot& slot = _slot(_nextSeq);
+    slot.len   = min(len, _slotSize);
+    slot.flags = flags;
+    slot.acked = false;
+    slot.retransmitted = false;
+    memcpy(slot.data, data, slot.len);
+    _backlog.release();
+    _transmit(_nextSeq++);
+    n++;
+  }
+  return n;
+}
+
+PacketShared::STATUS PacketReliable::receiveData(uint16_t seq)
+{
+  uint16_t diff = seq - _recvNext;
+  if (diff == 0){
+    return PacketShared::SUCCESS;
+  }
+  if (diff <= MAX_WINDOW){
+    if ((_recvBits & (((uint32_t) 1) << (diff - 1))) == 0){
+      return PacketShared::SUCCESS;
+    }
+  }
+  else if (diff < 0x8000){
+    _scheduleAck();
+    return PacketShared::PACKET_CONSUMED;   //too far ahead to track, it will come again
+  }
+  //already delivered, so only the ACK was lost
+  _duplicates++;
+  _scheduleAck();
+  return PacketShared::PACKET_CONSUMED;
+}
+
+/**
+ * Record a packet that receiveData accepted as delivered, once its contents
+ * have been handled, so that the next ACK reports it
+ */
+void PacketReliable::delivered(uint16_t seq)
+{
+  _scheduleAck();
+  uint16_t diff = seq - _recvNext;
+  if (diff == 0){
+    //the next in order, also step over any that arrived early
+    _recvNext++;
+    while (_recvBits & 1){
+      _recvBits >>= 1;
+      _recvNext++;
+    }
+    _recvBits >>= 1;
+  }
+  else if (diff <= MAX_WINDOW){
+    _recvBits |= ((uint32_t) 1) << (diff - 1);
+  }
+}
+
+void PacketReliable::_scheduleAck()
+{
+  if (!_ackPending){
+    _ackPending   = true;
+    _ackDueMicros = micros() + _ackDelay;
+  }
+}
+
+PacketShared::STATUS PacketReliable::receiveAck(const byte* data, size_t len)
+{
+  if (len < ACK_SIZE - 2){
+    return PacketShared::ERROR_INVALID_PACKET;
+  }
+  uint16_t cum  = ((uint16_t) data[0] << 8) | data[1];
+  uint32_t sack = ((uint32_t) data[2] << 24) | ((uint32_t) data[3] << 16) |
+                  ((uint32_t) data[4] << 8)  |  (uint32_t) data[5];
+  //ignore ACKs for packets never sent, they belong to some older exchange
+  if ((uint16_t) (cum - _baseSeq) > (uint16_t) (_nextSeq - _baseSeq)){
+    return PacketShared::PACKET_CONSUMED;
+  }
+  uint32_t now = micros();
+  for(uint16_t seq = _baseSeq; seq != _nextSeq; seq++){
+    Slot& slot = _slot(seq);
+    if (slot.acked){ continue;}
+    uint16_t diff = seq - cum;
+    bool acked = (diff >= 0x8000) || (diff >= 1 && diff <= MAX_WINDOW && (sack & (((uint32_t) 1) << (diff - 1))));
+    if (acked){
+      slot.acked = true;
+      if (!slot.retransmitted){   //Karn's rule, retransmits give ambiguous samples
+        _sampleRTT(now - slot.sent_micros);
+      }
+    }
+  }
+  while (_baseSeq != _nextSeq && _slot(_baseSeq).acked){
+    _baseSeq++;
+  }
+  return PacketShared::PACKET_CONSUMED;
+}
+
+/**
+ * RTO = SRTT + 4*RTTVAR, with the usual gains of 1/8 and 1/4
+ */
+void PacketReliable::_sampleRTT(uint32_t rtt)
+{
+  if (_srtt == 0){
+    _srtt   = rtt;
+    _rttvar = rtt/2;
+  }
+  else{
+    uint32_t err = (rtt > _srtt)? rtt - _srtt : _srtt - rtt;
+    _rttvar = _rttvar - _rttvar/4 + err/4;
+    _srtt   = _srtt - _srtt/8 + rtt/8;
+  }
+  _rto = _srtt + 4*_rttvar;
+  if (_rto < _rtoMin){ _rto = _rtoMin;}
+  if (_rto > _rtoMax){ _rto = _rtoMax;}
+}
+
+/**
+ * Returns whether the send callback took the packet; one that was not taken
+ * is simply sent again when its timeout passes
+ */
+bool PacketReliable::_transmit(uint16_t seq)
+{
+  Slot& slot = _slot(seq);
+  slot.sent_micros = micros();
+  _pCmd.resetOutputBuffer();
+  _pCmd.pack_byte(PacketShared::ENVELOPE_PREFIX);
+  _pCmd.pack_byte(PacketShared::ENVELOPE_RELIABLE);
+  _pCmd.pack_byte((byte) (seq >> 8));
+  _pCmd.pack_byte((byte) (seq & 0xFF));
+  _pCmd.pack_byte_array(slot.data, slot.len);
+  _pCmd.setOutputFlags(slot.flags);
+  bool sent = false;
+  PacketShared::STATUS pcs = _pCmd.send(sent);
+  return (pcs == PacketShared::SUCCESS) && sent;
+}
+
+void PacketReliable::_sendAck()
+{
+  _pCmd.resetOutputBuffer();
+  _pCmd.pack_byte(PacketShared::ENVELOPE_PREFIX);
+  _pCmd.pack_byte(PacketShared::ENVELOPE_ACK);
+  _pCmd.pack_byte((byte) (_recvNext >> 8));
+  _pCmd.pack_byte((byte) (_recvNext & 0xFF));
+  for(int shift = 24; shift >= 0; shift -= 8){
+    _pCmd.pack_byte((byte) (_recvBits >> shift));
+  }
+  bool sent = false;
+  _pCmd.send(sent);
+  _ackPending = !sent;   //try again on the next poll
+}
@@ -0,0 +1,126 @@
+/*
+*/
+#ifndef _PACKET_RELIABLE_H_INCLUDED
+#define _PACKET_RELIABLE_H_INCLUDED
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "PacketShared.h"
+#include "PacketQueue.h"
+#include "PacketCommand.h"
+
+//uncomment for debugging
+//#define PACKETRELIABLE_DEBUG
+
+#ifdef PACKETRELIABLE_DEBUG
+  #ifdef DEBUG_PORT
+    #define PACKETRELIABLE_DEBUG_PORT DEBUG_PORT
+  #else
+    #define PACKETRELIABLE_DEBUG_PORT Serial
+  #endif
+#endif
+
+/******************************************************************************/
+// PacketReliable - delivery guarantees over a lossy link.  Packets sent with
+// send() get a sequence number,
+//   [ENVELOPE_PREFIX] [ENVELOPE_RELIABLE] [sequence number, big endian uint16] [packet]
+// and up to 'windowSize' of them may be unacknowledged at once; the rest
+// wait in a PacketQueue backlog.  The receiver answers with
+//   [ENVELOPE_PREFIX] [ENVELOPE_ACK] [next expected sequence number] [SACK bits, big endian uint32]
+// where bit i of the selective ACK bits reports the packet numbered next
+// expected + 1 + i as received, so only packets that were actually lost are
+// sent again.  Retransmit timeouts adapt to the measured round trip time
+// (smoothed RTT plus four times its mean deviation, not sampled from
+// retransmitted packets, and doubled on every timeout).  Packets are handed
+// to their handlers in the order they arrive, each exactly once.
+// Both ends attach one to their PacketCommand and call poll() from the main
+// loop, which sends new packets, retransmits and ACKs:
+//   PacketQueue backlog;
+//   backlog.begin(16);
+//   PacketReliable reliable(pCmd, backlog);
+//   reliable.begin(8);
+//   pCmd.attachReliable(reliable);
+// Like PacketSender, it sends through the output buffer and send callback.
+// Both ends must start from sequence number zero together: if only one end
+// calls reset() or begin(), e.g. after a reboot, the other takes its new
+// packets for old duplicates and ignores its ACKs, and the link stalls, so
+// restart both (say with an application level handshake) when either does.
+/******************************************************************************/
+class PacketReliable
+{
+public:
+  static const size_t   MAX_WINDOW  = 32;
+  static const size_t   HEADER_SIZE = 4;   //envelope and sequence number
+  static const size_t   ACK_SIZE    = 8;
+  static const uint32_t RTO_INITIAL_MICROS = 250000;
+  static const uint32_t RTO_MIN_MICROS_DEFAULT = 10000;
+  static const uint32_t RTO_MAX_MICROS_DEFAULT = 4000000;
+
+  PacketReliable(PacketCommand& pCmd, PacketQueue& backlog);
+  PacketShared::STATUS begin(size_t windowSize);
+  void reset();   //start both directions again from sequence number zero, see above
+  void setTimeoutLimits(uint32_t minMicros, uint32_t maxMicros){_rtoMin = minMicros; _rtoMax = maxMicros;};
+  void setAckDelay(uint32_t delayMicros){_ackDelay = delayMicros;};  //lets one ACK cover several packets
+  // queue the output buffer for delivery, ERROR_QUEUE_OVERFLOW when the backlog is full
+  // and ERROR_PACKET_INDEX_OUT_OF_BOUNDS for a packet longer than a backlog slot
+  PacketShared::STATUS send();
+  size_t poll();        //returns the number of packets sent, new or again
+  size_t inFlight(){return (uint16_t) (_nextSeq - _baseSeq);};
+  size_t backlog(){return _backlog.size();};
+  uint32_t getRTO(){return _rto;};
+  uint32_t getSmoothedRTT(){return _srtt;};
+  uint32_t getRetransmits(){return _retransmits;};
+  uint32_t getDuplicates(){return _duplicates;};
+  // Called by PacketCommand::processInput for the two envelopes; each
+  // returns PACKET_CONSUMED when there is nothing to dispatch.  A packet
+  // receiveData lets through is only acknowledged once processInput calls
+  // delivered for it, after its contents were unwrapped without error, so
+  // that a fragment or compressed packet that could not be taken is sent
+  // again
+  PacketShared::STATUS receiveData(uint16_t seq);
+  void delivered(uint16_t seq);
+  PacketShared::STATUS receiveAck(const byte* data, size_t len);
+
+private:
+  struct Slot {
+    byte*    data;
+    size_t   len;
+    uint32_t sent_micros;
+    byte     flags;
+    bool     acked;
+    bool     retransmitted;
+  };
+  //slots are a power of two in number, so that sequence numbers map to the
+  //same slot on both sides of their wrap at 65536
+  Slot& _slot(uint16_t seq){return _slots[seq & _slotMask];};
+  bool _transmit(uint16_t seq);
+  void _sendAck();
+  void _scheduleAck();
+  void _sampleRTT(uint32_t rtt);
+  //data members
+  PacketCommand& _pCmd;
+  PacketQueue&   _backlog;
+  Slot*    _slots;
+  size_t   _window;
+  size_t   _slotMask;    //slot count - 1, the window rounded up to a power of two
+  size_t   _slotSize;
+  //sending
+  uint16_t _baseSeq;     //oldest unacknowledged
+  uint16_t _nextSeq;
+  uint32_t _srtt;
+  uint32_t _rttvar;
+  uint32_t _rto;
+  uint32_t _rtoMin;
+  uint32_t _rtoMax;
+  uint32_t _retransmits;
+  //receiving
+  uint16_t _recvNext;    //every packet before this one has arrived
+  uint32_t _recvBits;    //bit i: packet _recvNext + 1 + i has arrived
+  bool     _ackPending;
+  uint32_t _ackDueMicros;
+  uint32_t _ackDelay;
+  uint32_t _duplicates;
+};
+
+#endif /* _PACKET_RELIABLE_H_INCLUDED */
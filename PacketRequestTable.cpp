@@ -0,0 +1,138 @@
+/*  PacketRequestTable
+
+*/
+#include <Arduino.h>
+#include "PacketRequestTable.h"
+
+const size_t PacketRequestTable::HEADER_SIZE;
+
+PacketRequestTable::PacketRequestTable(PacketCommand& pCmd)
+  : _pCmd(pCmd)
+  , _entries(nullptr)
+  , _size(0)
+  , _outstanding(0)
+  , _nextId(0)
+  , _lastRTT(0)
+  , _srtt(0)
+  , _timeouts(0)
+{
+}
+
+PacketShared::STATUS PacketRequestTable::begin(size_t maxOutstanding)
+{
+  #ifdef PACKETREQUESTTABLE_DEBUG
+  PACKETREQUESTTABLE_DEBUG_PORT.println(F("# In PacketRequestTable::begin"));
+  #endif
+  if (maxOutstanding == 0){
+    return PacketShared::ERROR_INVALID_CAPACITY;
+  }
+  Entry* entries = (Entry*) calloc(maxOutstanding, sizeof(Entry));
+  if (entries == NULL){
+    #ifdef PACKETREQUESTTABLE_DEBUG
+    PACKETREQUESTTABLE_DEBUG_PORT.println(F("### Error failed to allocate memory for the request table!"));
+    #endif
+    return PacketShared::ERROR_MEMALLOC_FAIL;
+  }
+  _entries     = entries;
+  _size        = maxOutstanding;
+  _outstanding = 0;
+  return PacketShared::SUCCESS;
+}
+
+PacketShared::STATUS PacketRequestTable::beginQuery(uint16_t& requestId, ReplyCallback callback, uint32_t timeoutMicros)
+{
+  if (_outstanding >= _size){
+    return PacketShared::ERROR_QUEUE_OVERFLOW;
+  }
+  //the next ID not still waiting for its reply
+  while (_find(_nextId) >= 0){ _nextId++;}
+  Entry* entry = _entries;
+  while (entry->busy){ entry++;}
+  entry->callback       = callback;
+  entry->timeout_micros = timeoutMicros;
+  entry->request_id     = _nextId;
+  entry->busy           = true;
+  _outstanding++;
+  requestId = _nextId++;
+  _pCmd.resetOutputBuffer();
+  _pCmd.pack_byte(PacketShared::ENVELOPE_PREFIX);
+  _pCmd.pack_byte(PacketShared::ENVELOPE_QUERY);
+  _pCmd.pack_byte((byte) (requestId >> 8));
+  _pCmd.pack_byte((byte) (requestId & 0xFF));
+  _pCmd.flagOutputAsQuery();
+  entry->sent_micros = micros();
+  return PacketShared::SUCCESS;
+}
+
+PacketShared::STATUS PacketRequestTable::cancel(uint16_t requestId)
+{
+  int i = _find(requestId);
+  if (i < 0){
+    return PacketShared::ERROR_INVALID_PACKET;   //not outstanding
+  }
+  _entries[i].busy = false;
+  _outstanding--;
+  return PacketShared::SUCCESS;
+}
+
+size_t PacketRequestTable::expire()
+{
+  uint32_t now = micros();
+  size_t n = 0;
+  for(size_t i=0; i < _size; i++){
+    Entry& entry = _entries[i];
+    if (entry.busy && (now - entry.sent_micros) >= entry.timeout_micros){
+      #ifdef PACKETREQUESTTABLE_DEBUG
+      PACKETREQUESTTABLE_DEBUG_PORT.print(F("# PacketRequestTable: timed out request "));
+      PACKETREQUESTTABLE_DEBUG_PORT.println(entry.request_id);
+      #endif
+      entry.busy = false;
+      _outstanding--;
+      _timeouts++;
+      n++;
+      if (entry.callback != nullptr){
+        (*entry.callback)(_pCmd, entry.request_id, PacketShared::ERROR_TIMEOUT, 0);
+      }
+    }
+  }
+  return n;
+}
+
+PacketShared::STATUS PacketRequestTable::deliverReply(uint16_t requestId)
+{
+  uint32_t now = micros();
+  int i = _find(requestId);
+  if (i < 0){
+    #ifdef PACKETREQUESTTABLE_DEBUG
+    PACKETREQUESTTABLE_DEBUG_PORT.print(F("# PacketRequestTable: dropped reply to unknown request "));
+    PACKETREQUESTTABLE_DEBUG_PORT.println(requestId);
+    #endif
+    return PacketShared::PACKET_CONSUMED;
+  }
+  Entry& entry = _entries[i];
+  entry.busy = false;
+  _outstanding--;
+  uint32_t rtt = now - entry.sent_micros;
+  _lastRTT = rtt;
+  _srtt = (_srtt == 0)? rtt : _srtt - _srtt/8 + rtt/8;
+  //a reply whose type ID does not parse still completes the query
+  PacketShared::STATUS pcs = _pCmd.matchCommand();
+  if (pcs == PacketShared::ERROR_NO_TYPE_ID_MATCH){
+    //the reply need not be a registered command, step over its type ID
+    pcs = _pCmd.moveInputBufferIndex(1);
+  }
+  if (entry.callback != nullptr){
+    (*entry.callback)(_pCmd, requestId, pcs, rtt);
+  }
+  return PacketShared::PACKET_CONSUMED;
+}
+
+int PacketRequestTable::_find(uint16_t requestId)
+{
+  for(size_t i=0; i < _size; i++){
+    if (_entries[i].busy && _entries[i].request_id == requestId){
+      return i;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,87 @@
+/*
+*/
+#ifndef _PACKET_REQUEST_TABLE_H_INCLUDED
+#define _PACKET_REQUEST_TABLE_H_INCLUDED
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "PacketShared.h"
+#include "PacketCommand.h"
+
+//uncomment for debugging
+//#define PACKETREQUESTTABLE_DEBUG
+
+#ifdef PACKETREQUESTTABLE_DEBUG
+  #ifdef DEBUG_PORT
+    #define PACKETREQUESTTABLE_DEBUG_PORT DEBUG_PORT
+  #else
+    #define PACKETREQUESTTABLE_DEBUG_PORT Serial
+  #endif
+#endif
+
+/******************************************************************************/
+// PacketRequestTable - matches replies to the queries that asked for them,
+// so that many queries can be outstanding on one link at once.  A query
+// carries a request ID,
+//   [ENVELOPE_PREFIX] [ENVELOPE_QUERY] [request ID, big endian uint16] [packet]
+// and the handler answering it starts its reply with setupOutputReply, which
+// echoes the ID back,
+//   [ENVELOPE_PREFIX] [ENVELOPE_REPLY] [request ID, big endian uint16] [packet]
+// When the reply arrives, processInput matches its type ID and passes it to
+// the callback given for that query, along with the round trip time, instead
+// of dispatching it.  Queries that get no reply by their deadline are
+// completed with ERROR_TIMEOUT by expire(), and late replies are dropped.
+//   PacketRequestTable requests(pCmd);
+//   requests.begin(8);
+//   pCmd.attachRequestTable(requests);
+//   ...
+//   requests.beginQuery(id, on_reply, 50000);   //starts the output packet
+//   pCmd.setupOutputCommand(cmd);
+//   pCmd.pack_uint16(channel);
+//   pCmd.send();
+// The round trip is timed from beginQuery, so build and send the query
+// straight after it.
+/******************************************************************************/
+class PacketRequestTable
+{
+public:
+  static const size_t HEADER_SIZE = 4;   //envelope and request ID
+  typedef void (*ReplyCallback)(PacketCommand& pCmd, uint16_t requestId, PacketShared::STATUS status, uint32_t rttMicros);
+
+  PacketRequestTable(PacketCommand& pCmd);
+  PacketShared::STATUS begin(size_t maxOutstanding);
+  // Register a query and start the output packet with its header; returns
+  // ERROR_QUEUE_OVERFLOW while the table is full
+  PacketShared::STATUS beginQuery(uint16_t& requestId, ReplyCallback callback, uint32_t timeoutMicros);
+  PacketShared::STATUS cancel(uint16_t requestId);  //forget a query, its callback is not called
+  size_t expire();    //complete overdue queries with ERROR_TIMEOUT, returns how many
+  size_t outstanding(){return _outstanding;};
+  uint32_t getLastRTT(){return _lastRTT;};
+  uint32_t getSmoothedRTT(){return _srtt;};  //moving average with a gain of 1/8
+  uint32_t getTimeouts(){return _timeouts;};
+  // Called by PacketCommand::processInput with the input positioned at the
+  // reply packet; returns PACKET_CONSUMED whether or not the query was known
+  PacketShared::STATUS deliverReply(uint16_t requestId);
+
+private:
+  struct Entry {
+    ReplyCallback callback;
+    uint32_t sent_micros;
+    uint32_t timeout_micros;
+    uint16_t request_id;
+    bool     busy;
+  };
+  int _find(uint16_t requestId);
+  //data members
+  PacketCommand& _pCmd;
+  Entry*   _entries;
+  size_t   _size;
+  size_t   _outstanding;
+  uint16_t _nextId;
+  uint32_t _lastRTT;
+  uint32_t _srtt;
+  uint32_t _timeouts;
+};
+
+#endif /* _PACKET_REQUEST_TABLE_H_INCLUDED */
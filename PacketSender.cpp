@@ -0,0 +1,218 @@
+/*  PacketSender
+
+*/
+#include <Arduino.h>
+#include <string.h>
+#include "PacketSender.h"
+
+PacketSender::PacketSender(PacketCommand& pCmd, PacketQueue& queue)
+  : _pCmd(pCmd)
+  , _queue(queue)
+  , _slots(nullptr)
+  , _maxInFlight(0)
+  , _inFlightCount(0)
+  , _pending(nullptr)
+  , _maxQueued(0)
+  , _pendingHead(0)
+  , _pendingCount(0)
+  , _maxRetries(0)
+  , _nextTicket(0)
+  , _transmitTicket(0)
+{
+}
+
+PacketShared::STATUS PacketSender::begin(size_t maxInFlight, size_t maxQueued, size_t maxRetries)
+{
+  #ifdef PACKETSENDER_DEBUG
+  PACKETSENDER_DEBUG_PORT.println(F("# In PacketSender::begin"));
+  #endif
+  if (maxInFlight == 0 || maxQueued == 0){
+    return PacketShared::ERROR_INVALID_CAPACITY;
+  }
+  //preallocate the in-flight slots, with room for a whole queued packet each
+  size_t slot_size  = _queue.slotSize();
+  Slot*    slots    = (Slot*) calloc(maxInFlight, sizeof(Slot));
+  byte*    storage  = (byte*) calloc(maxInFlight, slot_size);
+  Pending* pending  = (Pending*) calloc(maxQueued, sizeof(Pending));
+  if (slots == NULL || storage == NULL || pending == NULL){
+    #ifdef PACKETSENDER_DEBUG
+    PACKETSENDER_DEBUG_PORT.println(F("### Error failed to allocate memory for the sender!"));
+    #endif
+    free(slots);
+    free(storage);
+    free(pending);
+    return PacketShared::ERROR_MEMALLOC_FAIL;
+  }
+  for(size_t i=0; i < maxInFlight; i++){
+    slots[i].data  = storage + i*slot_size;
+    slots[i].state = SLOT_FREE;
+  }
+  _slots         = slots;
+  _maxInFlight   = maxInFlight;
+  _inFlightCount = 0;
+  _pending       = pending;
+  _maxQueued     = maxQueued;
+  _pendingHead   = 0;
+  _pendingCount  = 0;
+  _maxRetries    = maxRetries;
+  return PacketShared::SUCCESS;
+}
+
+PacketShared::STATUS PacketSender::send(CompletionCallback callback)
+{
+  uint16_t ticket;
+  return send(ticket, callback);
+}
+
+PacketShared::STATUS PacketSender::send(uint16_t& ticket, CompletionCallback callback)
+{
+  if (_pendingCount >= _maxQueued){
+    return PacketShared::ERROR_QUEUE_OVERFLOW;
+  }
+  if (_pCmd.getOutputLen() > _queue.slotSize()){
+    #ifdef PACKETSENDER_DEBUG
+    PACKETSENDER_DEBUG_PORT.println(F("### Error: packet is longer than a queue slot"));
+    #endif
+    return PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS;   //the queue would cut it short
+  }
+  PacketShared::STATUS pqs = _pCmd.enqueueOutputBuffer(_queue);
+  if (pqs != PacketShared::SUCCESS){
+    return pqs;
+  }
+  ticket = _nextTicket++;
+  Pending& p = _pending[(_pendingHead + _pendingCount) % _maxQueued];
+  p.ticket   = ticket;
+  p.callback = callback;
+  _pendingCount++;
+  return PacketShared::SUCCESS;
+}
+
+/**
+ * Offer packets waiting for a retry first, then fill free in-flight slots
+ * from the queue, stopping as soon as the transport turns one down.
+ */
+size_t PacketSender::poll()
+{
+  size_t started = 0;
+  for(size_t i=0; i < _maxInFlight; i++){
+    if (_slots[i].state == SLOT_WAITING){
+      if (!_transmit(_slots[i], started)){
+        return started;
+      }
+    }
+  }
+  while (_pendingCount > 0 && _inFlightCount < _maxInFlight){
+    size_t   len;
+    uint32_t timestamp;
+    byte     flags;
+    byte* data = _queue.peek(len, timestamp, flags);
+    if (data == nullptr){
+      break;
+    }
+    Slot* slot = _slots;
+    while (slot->state != SLOT_FREE){ slot++;}
+    slot->len   = min(len, _queue.slotSize());
+    slot->flags = flags;
+    memcpy(slot->data, data, slot->len);
+    _queue.release();
+    Pending& p = _pending[_pendingHead];
+    _pendingHead = (_pendingHead + 1) % _maxQueued;
+    _pendingCount--;
+    slot->ticket   = p.ticket;
+    slot->callback = p.callback;
+    slot->tries    = 0;
+    slot->state    = SLOT_WAITING;
+    _inFlightCount++;
+    if (!_transmit(*slot, started)){
+      break;
+    }
+  }
+  return started;
+}
+
+PacketShared::STATUS PacketSender::complete(uint16_t ticket, bool ok)
+{
+  for(size_t i=0; i < _maxInFlight; i++){
+    Slot& slot = _slots[i];
+    if (slot.state == SLOT_IN_FLIGHT && slot.ticket == ticket){
+      if (ok){
+        _finish(slot, PacketShared::SUCCESS);
+      }
+      else if (slot.tries <= _maxRetries){
+        #ifdef PACKETSENDER_DEBUG
+        PACKETSENDER_DEBUG_PORT.print(F("# PacketSender: will retry ticket "));
+        PACKETSENDER_DEBUG_PORT.println(ticket);
+        #endif
+        slot.state = SLOT_WAITING;
+      }
+      else{
+        _finish(slot, PacketShared::ERROR_SEND_FAILED);
+      }
+      return PacketShared::SUCCESS;
+    }
+  }
+  return PacketShared::ERROR_INVALID_PACKET;   //no such packet in flight
+}
+
+size_t PacketSender::flush()
+{
+  size_t n = _pendingCount;
+  _queue.flush();
+  while (_pendingCount > 0){
+    Pending p = _pending[_pendingHead];
+    _pendingHead = (_pendingHead + 1) % _maxQueued;
+    _pendingCount--;
+    if (p.callback != nullptr){
+      (*p.callback)(p.ticket, PacketShared::ERROR_SEND_FAILED);
+    }
+  }
+  return n;
+}
+
+/**
+ * Hand a slot's packet to the send callback through the output buffer,
+ * counting it in 'started' if it is taken.  Returns false if the transport
+ * is busy, leaving the packet waiting.  A packet that can never be sent, say
+ * for want of a send callback, is completed with the error at once.
+ */
+bool PacketSender::_transmit(Slot& slot, size_t& started)
+{
+  uint16_t ticket = slot.ticket;
+  _pCmd.resetOutputBuffer();
+  PacketShared::STATUS pcs = _pCmd.pack_byte_array(slot.data, slot.len);
+  _pCmd.setOutputFlags(slot.flags);
+  slot.state = SLOT_IN_FLIGHT;
+  slot.tries++;
+  _transmitTicket = ticket;
+  bool sent = false;
+  if (pcs == PacketShared::SUCCESS){
+    pcs = _pCmd.send(sent);
+  }
+  if (pcs != PacketShared::SUCCESS){
+    #ifdef PACKETSENDER_DEBUG
+    PACKETSENDER_DEBUG_PORT.print(F("### Error: PacketSender could not send, status: "));
+    PACKETSENDER_DEBUG_PORT.println(pcs);
+    #endif
+    if (slot.state == SLOT_IN_FLIGHT && slot.ticket == ticket){
+      _finish(slot, pcs);
+    }
+    return true;
+  }
+  if (!sent && slot.state == SLOT_IN_FLIGHT && slot.ticket == ticket){
+    slot.state = SLOT_WAITING;   //not taken, so it was not a try
+    slot.tries--;
+    return false;
+  }
+  started++;
+  return true;
+}
+
+void PacketSender::_finish(Slot& slot, PacketShared::STATUS status)
+{
+  //free the slot first, the callback may well send again
+  slot.state = SLOT_FREE;
+  _inFlightCount--;
+  if (slot.callback != nullptr){
+    (*slot.callback)(slot.ticket, status);
+  }
+}
@@ -0,0 +1,98 @@
+/*
+*/
+#ifndef _PACKET_SENDER_H_INCLUDED
+#define _PACKET_SENDER_H_INCLUDED
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "PacketShared.h"
+#include "PacketQueue.h"
+#include "PacketCommand.h"
+
+//uncomment for debugging
+//#define PACKETSENDER_DEBUG
+
+#ifdef PACKETSENDER_DEBUG
+  #ifdef DEBUG_PORT
+    #define PACKETSENDER_DEBUG_PORT DEBUG_PORT
+  #else
+    #define PACKETSENDER_DEBUG_PORT Serial
+  #endif
+#endif
+
+/******************************************************************************/
+// PacketSender - an asynchronous send pipeline.  send() copies the output
+// buffer into an outbound queue and returns a ticket at once, so handlers
+// never wait on the transport.  poll(), called from the main loop, moves
+// queued packets into a bounded set of in-flight slots and hands each to the
+// PacketCommand send callback, which should start the transmission and
+// return true, or return false if the transport is busy (the packet is then
+// offered again on the next poll).  The transport reports how each packet
+// ended with complete(getTransmitTicket(), ok), either from inside the send
+// callback or later; failed packets are sent again up to 'maxRetries' times.
+// Each packet's completion callback gets SUCCESS or ERROR_SEND_FAILED.
+//   PacketQueue outbound;
+//   outbound.begin(8);
+//   PacketSender sender(pCmd, outbound);
+//   sender.begin(2, 8, 3);
+// The queue must only be used through the sender, and poll() overwrites the
+// PacketCommand output buffer.
+/******************************************************************************/
+class PacketSender
+{
+public:
+  typedef void (*CompletionCallback)(uint16_t ticket, PacketShared::STATUS status);
+
+  PacketSender(PacketCommand& pCmd, PacketQueue& queue);
+  // 'maxQueued' bounds the packets waiting in the queue, for which the
+  // completion callbacks are kept in order
+  PacketShared::STATUS begin(size_t maxInFlight, size_t maxQueued, size_t maxRetries = 0);
+  // queue a copy of the output buffer, returns ERROR_QUEUE_OVERFLOW when full
+  // and ERROR_PACKET_INDEX_OUT_OF_BOUNDS for a packet longer than a slot
+  PacketShared::STATUS send(uint16_t& ticket, CompletionCallback callback = nullptr);
+  PacketShared::STATUS send(CompletionCallback callback = nullptr);
+  size_t poll();      //start what the transport will take, returns how many
+  PacketShared::STATUS complete(uint16_t ticket, bool ok);
+  uint16_t getTransmitTicket(){return _transmitTicket;};  //of the packet being handed to the send callback
+  size_t queued(){return _pendingCount;};
+  size_t inFlight(){return _inFlightCount;};   //including those waiting to be retried
+  size_t flush();     //drop queued packets, which complete with ERROR_SEND_FAILED
+
+private:
+  enum SlotState {
+    SLOT_FREE = 0,
+    SLOT_WAITING,       //taken from the queue, not yet accepted by the transport
+    SLOT_IN_FLIGHT
+  };
+  struct Slot {
+    byte*    data;
+    size_t   len;
+    byte     flags;
+    uint16_t ticket;
+    CompletionCallback callback;
+    size_t   tries;
+    byte     state;
+  };
+  struct Pending {
+    uint16_t ticket;
+    CompletionCallback callback;
+  };
+  bool _transmit(Slot& slot, size_t& started);
+  void _finish(Slot& slot, PacketShared::STATUS status);
+  //data members
+  PacketCommand& _pCmd;
+  PacketQueue&   _queue;
+  Slot*    _slots;
+  size_t   _maxInFlight;
+  size_t   _inFlightCount;
+  Pending* _pending;      //ring of callbacks, in queue order
+  size_t   _maxQueued;
+  size_t   _pendingHead;
+  size_t   _pendingCount;
+  size_t   _maxRetries;
+  uint16_t _nextTicket;
+  uint16_t _transmitTicket;
+};
+
+#endif /* _PACKET_SENDER_H_INCLUDED */
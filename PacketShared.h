@@ -9,6 +9,8 @@
 namespace PacketShared{
   // Status and Error  Codes
   typedef enum StatusCode {
+    PACKET_CONSUMED             = 3,   //used by the library itself, nothing to dispatch
+    INCOMPLETE_PACKET           = 2,   //part of a packet was received and kept
     NO_PACKET_RECEIVED          = 1,
     SUCCESS = 0,
     ERROR_EXCEDED_MAX_COMMANDS  = -1,
@@ -21,10 +23,29 @@ namespace PacketShared{
     ERROR_INPUT_BUFFER_OVERRUN   = -8,
     ERROR_QUEUE_OVERFLOW         = -9,
     ERROR_QUEUE_UNDERFLOW        = -10,
-    ERROR_MEMALLOC_FAIL          = -11
+    ERROR_MEMALLOC_FAIL          = -11,
+    ERROR_INVALID_CAPACITY       = -12,
+    ERROR_CHECKSUM_MISMATCH      = -13,
+    ERROR_SEND_FAILED            = -14,
+    ERROR_TIMEOUT                = -15
   } STATUS;
 
   static const size_t DATA_BUFFER_SIZE = 32;
+  // A type ID can never start with 0x00, so a packet starting with 0x00 is
+  // an envelope wrapped around another packet, and the next byte says what
+  // kind; the library adds and removes envelopes itself
+  static const byte ENVELOPE_PREFIX = 0x00;
+  enum EnvelopeType {
+       ENVELOPE_COMPRESSED = 0x01,  //PacketLZ compressed packet follows
+       ENVELOPE_FRAGMENT   = 0x02,  //PacketReassembly fragment header and data follow
+       ENVELOPE_BATCH      = 0x03,  //packets follow, each preceded by its varint length
+       ENVELOPE_RELIABLE   = 0x04,  //PacketReliable sequence number and packet follow
+       ENVELOPE_ACK        = 0x05,  //PacketReliable acknowledgement, nothing to dispatch
+       ENVELOPE_QUERY      = 0x06,  //request ID and a query packet follow
+       ENVELOPE_REPLY      = 0x07,  //request ID and the reply to that query follow
+       ENVELOPE_TIMESTAMP  = 0x08   //sender's micros() when sent, big endian uint32, and a packet follow
+  };
+  
   // Packet structure
   struct Packet {
     byte     data[DATA_BUFFER_SIZE];
@@ -35,7 +56,7 @@ namespace PacketShared{
   
   enum InputPacketFlags {
        IPFLAG_IS_QUERY = 0x01,
-       //IPFLAG_1 = 0x02,
+       IPFLAG_HAS_SEND_TIMESTAMP = 0x02,
        //IPFLAG_2 = 0x04,
        //IPFLAG_3 = 0x08,
        //IPFLAG_4 = 0x10,
@@ -47,7 +68,7 @@ namespace PacketShared{
   enum OutputPacketFlags {
        OPFLAG_IS_QUERY = 0x01,
        OPFLAG_APPEND_SEND_TIMESTAMP = 0x02,
-       //OPFLAG_2 = 0x04,
+       OPFLAG_COMPRESS = 0x04,
        //OPFLAG_3 = 0x08,
        //OPFLAG_4 = 0x10,
        //OPFLAG_5 = 0x20,
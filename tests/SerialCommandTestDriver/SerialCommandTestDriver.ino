@@ -6,11 +6,34 @@
 
 #include <PacketCommand.h>
 #include <PacketQueue.h>
+#include <PacketPriorityQueue.h>
+#include <PacketFraming.h>
+#include <PacketCRC.h>
+#include <PacketLZ.h>
+#include <PacketReassembly.h>
+#include <PacketSender.h>
+#include <PacketReliable.h>
+#include <PacketRequestTable.h>
 
 #define arduinoLED 13   // Arduino LED on board
 #define SC_MAX_COMMANDS 20
 #define PC_MAX_COMMANDS 20
 #define PQ_CAPACITY 3
+#define PQ_BULK 4
+#define LOOP_MAX_COMMANDS 8
+#define LOOP_BUFFER_SIZE 64
+#define LOOP_QUEUE_CAPACITY 16
+#define LOOP_BLOB_MAX 256
+#define LOOP_STREAM_SIZE 256
+#define LZ_MAX_LEN 256
+#define REL_WINDOW 6           //not a power of two, so the sequence number wrap tests the slot mapping
+#define REL_RTO_MIN_MICROS 2000
+#define REL_TIMEOUT_MILLIS 600000UL
+#define SENDER_IN_FLIGHT 2
+#define SENDER_QUEUED 4
+#define SENDER_RETRIES 2
+#define REQ_MAX_OUTSTANDING 4
+#define REQ_TIMEOUT_MICROS 20000
 
 typedef float  float32_t;
 typedef double float64_t;
@@ -31,6 +54,94 @@ SerialCommand sCmd(Serial,SC_MAX_COMMANDS);         // The demo PacketCommand ob
 
 PacketCommand pCmd(PC_MAX_COMMANDS);
 PacketQueue pQ(PQ_CAPACITY);
+PacketQueue pqSlots;    //slot mode queue, set up by PQS.RT
+StaticPacketQueue<5, 48> pqStatic5;
+StaticPacketQueue<8, 40> pqStatic8;
+// Three priority levels, the highest with the least room
+StaticPacketQueue<4, 16> pqPrio0;
+StaticPacketQueue<4, 16> pqPrio1;
+StaticPacketQueue<2, 16> pqPrio2;
+PacketPriorityQueue pqPrio;
+PacketQueue pqCompact;  //compact mode queue, set up by PQC.RT
+
+// Loopback pair for the wire format round trips: pTx sends into loopTxRx,
+// which pRx drains, and pRx answers (ACKs) through loopRxTx
+PacketCommand pTx(LOOP_MAX_COMMANDS, LOOP_BUFFER_SIZE, LOOP_BUFFER_SIZE);
+PacketCommand pRx(LOOP_MAX_COMMANDS, LOOP_BUFFER_SIZE, LOOP_BUFFER_SIZE);
+PacketQueue loopTxRx;
+PacketQueue loopRxTx;
+PacketQueue relBacklogTx;
+PacketQueue relBacklogRx;
+PacketReliable relTx(pTx, relBacklogTx);
+PacketReliable relRx(pRx, relBacklogRx);
+PacketQueue senderQueue;
+PacketSender sender(pTx, senderQueue);
+PacketRequestTable requests(pTx);
+PacketReassembly reassembly;
+
+// A byte stream that reads back what was written to it, for carrying the
+// loopback pair's packets in frames
+class LoopStream : public Stream {
+public:
+  using Print::write;
+  size_t write(uint8_t c){
+    if (_count >= LOOP_STREAM_SIZE){
+      return 0;
+    }
+    _buffer[(_head + _count) % LOOP_STREAM_SIZE] = c;
+    _count++;
+    return 1;
+  }
+  int available(){return _count;}
+  int peek(){return (_count > 0)? _buffer[_head] : -1;}
+  int read(){
+    int c = peek();
+    if (_count > 0){
+      _head = (_head + 1) % LOOP_STREAM_SIZE;
+      _count--;
+    }
+    return c;
+  }
+  void flush(){}
+  void clear(){_head = 0; _count = 0;}
+private:
+  byte   _buffer[LOOP_STREAM_SIZE];
+  size_t _head  = 0;
+  size_t _count = 0;
+};
+LoopStream loopStream;
+PacketFraming framingTxCOBS(pTx, loopStream, PacketFraming::COBS);
+PacketFraming framingRxCOBS(pRx, loopStream, PacketFraming::COBS);
+PacketFraming framingTxSLIP(pTx, loopStream, PacketFraming::SLIP);
+PacketFraming framingRxSLIP(pRx, loopStream, PacketFraming::SLIP);
+PacketFraming* framingTx = &framingTxCOBS;
+PacketFraming* framingRx = &framingRxCOBS;
+PacketCommand::CommandInfo loopDataCommand;
+PacketCommand::CommandInfo loopDataRxCommand;   //pRx's own, to find its latency histogram
+PacketCommand::CommandInfo loopBlobCommand;
+PacketCommand::CommandInfo loopVarintCommand;
+PacketCommand::CommandInfo loopQueryCommand;
+PacketCommand::CommandInfo loopQueryRxCommand;   //pRx's own, to reply with
+
+// What pRx has received since the last LOOP.RESET
+uint32_t loopReceived = 0;
+uint32_t loopErrors   = 0;
+uint32_t loopSum      = 0;
+uint32_t loopNext     = 0;      //next value expected when packets arrive in order
+bool     loopInOrder  = true;
+uint32_t loopFrames   = 0;      //frames pTx put on the link
+size_t   loopLastLen  = 0;      //length of the last frame pTx put on the link
+uint16_t loopDropEvery   = 0;   //lose the first transmission of every sequence number n*k - 1
+int32_t  loopLastDropped = -1;
+PacketShared::STATUS loopUnpackStatus = PacketShared::SUCCESS;
+uint32_t loopVarint = 0;
+int32_t  loopZigzag = 0;
+byte     loopBlob[LOOP_BLOB_MAX];
+size_t   loopBlobLen = 0;
+
+byte lzSrc[LZ_MAX_LEN];
+byte lzPacked[LZ_MAX_LEN + LZ_MAX_LEN/8 + 1];
+byte lzOut[LZ_MAX_LEN];
 
 
 
@@ -59,6 +170,72 @@ void setup() {
   sCmd.addCommand("PQ.ENQ", PQ_ENQ_sCmd_action_handler);     //enqueue a string
   sCmd.addCommand("PQ.DEQ", PQ_DEQ_sCmd_action_handler);     //dequeue packet
   sCmd.addCommand("PQ.REQ", PQ_REQ_sCmd_action_handler);     //requeue a string
+  sCmd.addCommand("PQS.RT", PQS_RT_sCmd_action_handler);     //cycle packets through a slot queue
+  sCmd.addCommand("PQS.STATIC", PQS_STATIC_sCmd_action_handler); //cycle packets through a static slot queue
+  sCmd.addCommand("PQ.BULK", PQ_BULK_sCmd_action_handler);   //move packets in and out in batches
+  sCmd.addCommand("PQC.RT", PQC_RT_sCmd_action_handler);     //cycle packets through a compact queue
+  sCmd.addCommand("PRIO.RT", PRIO_RT_sCmd_action_handler);   //serve packets from priority levels
+  // Round trips of the wire formats, over the loopback pair
+  sCmd.addCommand("CRC.CHECK",  CRC_CHECK_sCmd_query_handler);     //check values of the CRCs
+  sCmd.addCommand("LZ.RT",      LZ_RT_sCmd_action_handler);        //compress and decompress a pattern
+  sCmd.addCommand("LOOP.RESET", LOOP_RESET_sCmd_action_handler);   //reset the loopback pair, set the checksum mode
+  sCmd.addCommand("VARINT.RT",  VARINT_RT_sCmd_action_handler);    //send a varint and a zigzag integer
+  sCmd.addCommand("BATCH.RT",   BATCH_RT_sCmd_action_handler);     //send coalesced packets
+  sCmd.addCommand("FRAG.RT",    FRAG_RT_sCmd_action_handler);      //send fragmented packets
+  sCmd.addCommand("REL.RT",     REL_RT_sCmd_action_handler);       //send reliable packets over a lossy link
+  sCmd.addCommand("FRAME.RT",   FRAME_RT_sCmd_action_handler);     //send packets in COBS or SLIP frames
+  sCmd.addCommand("SENDER.RT",  SENDER_RT_sCmd_action_handler);    //send packets through a PacketSender
+  sCmd.addCommand("REQ.RT",     REQ_RT_sCmd_action_handler);       //send queries and match their replies
+  sCmd.addCommand("LAT.RT",     LAT_RT_sCmd_action_handler);       //send timestamped packets, report the latency histogram
+  sCmd.addCommand("DRAIN.RT",   DRAIN_RT_sCmd_action_handler);     //drain queued input in limited batches
+  sCmd.addCommand("PROF.RT",    PROF_RT_sCmd_action_handler);      //ask pRx for its profiling counters
+  
+  // Setup the loopback pair
+  byte data_type_id[]   = {0x41,0x00};
+  byte blob_type_id[]   = {0x42,0x00};
+  byte varint_type_id[] = {0x43,0x00};
+  byte query_type_id[]  = {0x44,0x00};
+  byte profile_type_id[] = {0x45,0x00};
+  pTx.addCommand(data_type_id,   "LOOP.DATA",   LOOP_DATA_pCmd_handler);
+  pTx.addCommand(blob_type_id,   "LOOP.BLOB",   LOOP_BLOB_pCmd_handler);
+  pTx.addCommand(varint_type_id, "LOOP.VARINT", LOOP_VARINT_pCmd_handler);
+  pTx.addCommand(query_type_id,  "LOOP.QUERY",  LOOP_QUERY_pCmd_handler);
+  pTx.addCommand(profile_type_id, "LOOP.PROFILE", LOOP_PROFILE_pCmd_handler);  //the replies
+  pRx.addCommand(data_type_id,   "LOOP.DATA",   LOOP_DATA_pCmd_handler);
+  pRx.addCommand(blob_type_id,   "LOOP.BLOB",   LOOP_BLOB_pCmd_handler);
+  pRx.addCommand(varint_type_id, "LOOP.VARINT", LOOP_VARINT_pCmd_handler);
+  pRx.addCommand(query_type_id,  "LOOP.QUERY",  LOOP_QUERY_pCmd_handler);
+  #ifdef PACKETCOMMAND_PROFILING
+  pRx.addProfilingCommand(profile_type_id, "LOOP.PROFILE");
+  #endif
+  pTx.lookupCommandByName("LOOP.DATA",   loopDataCommand);
+  pRx.lookupCommandByName("LOOP.DATA",   loopDataRxCommand);
+  pTx.lookupCommandByName("LOOP.BLOB",   loopBlobCommand);
+  pTx.lookupCommandByName("LOOP.VARINT", loopVarintCommand);
+  pTx.lookupCommandByName("LOOP.QUERY",  loopQueryCommand);
+  pRx.lookupCommandByName("LOOP.QUERY",  loopQueryRxCommand);
+  loopTxRx.begin(LOOP_QUEUE_CAPACITY, LOOP_BUFFER_SIZE);
+  loopRxTx.begin(LOOP_QUEUE_CAPACITY, LOOP_BUFFER_SIZE);
+  relBacklogTx.begin(LOOP_QUEUE_CAPACITY, LOOP_BUFFER_SIZE);
+  relBacklogRx.begin(1, LOOP_BUFFER_SIZE);
+  senderQueue.begin(SENDER_QUEUED, LOOP_BUFFER_SIZE);
+  sender.begin(SENDER_IN_FLIGHT, SENDER_QUEUED, SENDER_RETRIES);
+  requests.begin(REQ_MAX_OUTSTANDING);
+  pRx.beginLatencyHistograms(LOOP_MAX_COMMANDS);
+  #ifdef PACKETCOMMAND_PROFILING
+  pRx.beginProfiling(LOOP_MAX_COMMANDS);
+  #endif
+  pTx.attachRequestTable(requests);
+  relTx.begin(REL_WINDOW);
+  relRx.begin(1);
+  pTx.attachReliable(relTx);
+  pRx.attachReliable(relRx);
+  reassembly.begin(1, LOOP_BLOB_MAX);
+  pRx.attachReassembly(reassembly);
+  pqPrio.attachLevel(0, pqPrio0);
+  pqPrio.attachLevel(1, pqPrio1);
+  pqPrio.attachLevel(2, pqPrio2);
+  pqPrio.registerClassifier(PRIO_classifier);
   
 /*  //prepare a test packet*/
 /*  test_pkt.data = (byte*) calloc(PQ_DATA_BUFFER_SIZE,sizeof(byte));*/
@@ -219,7 +396,1219 @@ void PQ_REQ_sCmd_action_handler(SerialCommand this_sCmd) {
   this_sCmd.println(F("..."));
 }
 
+// Byte 'i' of packet number 'n' in the queue tests
+byte pq_byte(uint32_t n, size_t i){
+  return (byte) (n*7 + i*31 + 1);
+}
+
+// Fill a slot mode queue until it refuses more, then run 'count' packets
+// through it, keeping it all but full so that the indices wrap many times,
+// and drain it.  Packets go in by enqueue and by reserve and commit in
+// turn, and come out by dequeue (when they fit in a Packet) or by peek and
+// release, and must come out whole and in order.  Every third one is taken
+// off and requeued straight from a buffer first, after checking that one a
+// byte longer than a slot is refused.
+void pq_cycle(SerialCommand this_sCmd, PacketQueue& pq, uint32_t count){
+  PacketShared::STATUS pqs = PacketShared::SUCCESS;
+  uint32_t pushed = 0;
+  uint32_t popped = 0;
+  uint32_t errors = 0;
+  uint32_t filled = 0;
+  bool overflow_ok  = false;
+  bool underflow_ok = false;
+  uint32_t requeued = 0;
+  PacketShared::Packet pkt;
+  byte buffer[LOOP_BUFFER_SIZE];
+  while (pqs == PacketShared::SUCCESS && popped < count){
+    if (pushed < count && (filled == 0 || pq.size() < max(pq.capacity() - 1, (size_t) 1))){
+      size_t len = 1 + (pushed*13) % pq.slotSize();
+      if (pushed % 2 == 0 && len <= PacketShared::DATA_BUFFER_SIZE){
+        for(size_t i=0; i < len; i++){
+          pkt.data[i] = pq_byte(pushed, i);
+        }
+        pkt.length    = len;
+        pkt.timestamp = pushed;
+        pkt.flags     = (byte) pushed;
+        pqs = pq.enqueue(pkt);
+      }
+      else{
+        size_t room = 0;
+        byte* slot = pq.reserve(room);
+        if (slot == nullptr){
+          pqs = PacketShared::ERROR_QUEUE_OVERFLOW;
+        }
+        else if (room != pq.slotSize()){
+          errors++;
+        }
+        else{
+          for(size_t i=0; i < len; i++){
+            slot[i] = pq_byte(pushed, i);
+          }
+          pqs = pq.commit(len, pushed, (byte) pushed);
+        }
+      }
+      if (pqs == PacketShared::ERROR_QUEUE_OVERFLOW && filled == 0){
+        //full, both ways in must now be refused
+        size_t room;
+        filled = pq.size();
+        overflow_ok = (pq.reserve(room) == nullptr && room == 0 && pq.enqueue(pkt) == PacketShared::ERROR_QUEUE_OVERFLOW);
+        pqs = PacketShared::SUCCESS;
+        continue;
+      }
+      pushed++;
+      continue;
+    }
+    size_t   len;
+    uint32_t n;
+    byte     flags;
+    byte* data = pq.peek(len, n, flags);
+    if (data == nullptr){
+      pqs = PacketShared::ERROR_QUEUE_UNDERFLOW;
+      break;
+    }
+    if (n % 3 == 0 && len <= sizeof(buffer)){
+      memcpy(buffer, data, len);
+      pq.release();
+      if (pq.requeue(buffer, pq.slotSize() + 1, n, flags) != PacketShared::ERROR_PACKET_INDEX_OUT_OF_BOUNDS){
+        errors++;
+      }
+      pqs = pq.requeue(buffer, len, n, flags);
+      data = pq.peek(len, n, flags);
+      if (pqs != PacketShared::SUCCESS || data == nullptr){
+        break;
+      }
+      requeued++;
+    }
+    if (len != 1 + (n*13) % pq.slotSize() || n != popped || flags != (byte) n){
+      errors++;
+    }
+    for(size_t i=0; i < len; i++){
+      if (data[i] != pq_byte(n, i)){
+        errors++;
+        break;
+      }
+    }
+    if (len <= PacketShared::DATA_BUFFER_SIZE && n % 2 == 1){
+      pqs = pq.dequeue(pkt);
+      if (pkt.length != len || pkt.timestamp != n){
+        errors++;
+      }
+    }
+    else{
+      pqs = pq.release();
+    }
+    popped++;
+  }
+  if (pqs == PacketShared::SUCCESS){
+    size_t   len;
+    uint32_t timestamp;
+    byte     flags;
+    underflow_ok = (pq.size() == 0 && pq.peek(len, timestamp, flags) == nullptr && len == 0 &&
+                    pq.release() == PacketShared::ERROR_QUEUE_UNDERFLOW &&
+                    pq.dequeue(pkt) == PacketShared::ERROR_QUEUE_UNDERFLOW);
+  }
+  this_sCmd.print(F("pqs: "));this_sCmd.println(pqs);
+  this_sCmd.print(F("capacity: "));this_sCmd.println(pq.capacity());
+  this_sCmd.print(F("filled: "));this_sCmd.println(filled);
+  this_sCmd.print(F("overflow_ok: "));this_sCmd.println(overflow_ok? 1 : 0);
+  this_sCmd.print(F("underflow_ok: "));this_sCmd.println(underflow_ok? 1 : 0);
+  this_sCmd.print(F("pushed: "));this_sCmd.println(pushed);
+  this_sCmd.print(F("popped: "));this_sCmd.println(popped);
+  this_sCmd.print(F("requeued: "));this_sCmd.println(requeued);
+  this_sCmd.print(F("errors: "));this_sCmd.println(errors);
+}
+
+void PQS_RT_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: PQS_RT_sCmd_action_handler"));
+  char *arg1 = this_sCmd.next();
+  char *arg2 = this_sCmd.next();
+  char *arg3 = this_sCmd.next();
+  if (arg1 == NULL || arg2 == NULL || arg3 == NULL){
+    this_sCmd.print(F("### Error: PQS.RT requires 3 arguments (int capacity, int slotSize, int count)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  size_t   capacity = strtoul(arg1, NULL, 0);
+  size_t   slotSize = strtoul(arg2, NULL, 0);
+  uint32_t count    = strtoul(arg3, NULL, 0);
+  pqSlots.end();
+  PacketShared::STATUS pqs = pqSlots.begin(capacity, slotSize);
+  if (pqs != PacketShared::SUCCESS){
+    this_sCmd.print(F("pqs: "));this_sCmd.println(pqs);
+  }
+  else{
+    pq_cycle(this_sCmd, pqSlots, count);
+  }
+  this_sCmd.println(F("..."));
+}
+
+void PQS_STATIC_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: PQS_STATIC_sCmd_action_handler"));
+  char *arg1 = this_sCmd.next();
+  char *arg2 = this_sCmd.next();
+  if (arg1 == NULL || arg2 == NULL){
+    this_sCmd.print(F("### Error: PQS.STATIC requires 2 arguments (int capacity, int count)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  size_t   capacity = strtoul(arg1, NULL, 0);
+  uint32_t count    = strtoul(arg2, NULL, 0);
+  //no begin() needed, their storage is part of them
+  PacketQueue& pq = (capacity == 8)? (PacketQueue&) pqStatic8 : (PacketQueue&) pqStatic5;
+  pq.reset();
+  pq_cycle(this_sCmd, pq, count);
+  this_sCmd.println(F("..."));
+}
+
+// Check the packets 'pkts' against packets 'first' onwards of the bulk test
+uint32_t pq_bulk_check(PacketShared::Packet* pkts, size_t n, uint32_t first){
+  uint32_t errors = 0;
+  for(size_t k=0; k < n; k++){
+    if (pkts[k].length != 1 + 5*(first + k) || pkts[k].timestamp != first + k){
+      errors++;
+      continue;
+    }
+    for(size_t i=0; i < pkts[k].length; i++){
+      if (pkts[k].data[i] != pq_byte(first + k, i)){
+        errors++;
+        break;
+      }
+    }
+  }
+  return errors;
+}
 
+// Move a batch of packets into a slot queue (mode 0) or a compact queue
+// (mode 1), then a packet too long for a Packet, then the batch again as
+// far as it fits.  Batches taken out must stop in front of the long one,
+// which is taken with peek and release.
+void PQ_BULK_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: PQ_BULK_sCmd_action_handler"));
+  char *arg = this_sCmd.next();
+  if (arg == NULL){
+    this_sCmd.print(F("### Error: PQ.BULK requires 1 argument (int mode)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  bool compact = (strtoul(arg, NULL, 0) == 1);
+  PacketQueue& pq = compact? pqCompact : pqSlots;
+  pq.end();
+  PacketShared::STATUS pqs = compact? pq.beginCompact(256) : pq.begin(PQ_BULK + 2, 48);
+  PacketShared::Packet pkts[PQ_BULK];
+  for(size_t k=0; k < PQ_BULK; k++){
+    pkts[k].length    = 1 + 5*k;
+    pkts[k].timestamp = k;
+    pkts[k].flags     = 0x00;
+    for(size_t i=0; i < pkts[k].length; i++){
+      pkts[k].data[i] = pq_byte(k, i);
+    }
+  }
+  size_t in1 = pq.enqueueBulk(pkts, PQ_BULK);
+  size_t room = 0;
+  byte* slot = pq.reserve(room, 40);
+  if (slot != nullptr){
+    for(size_t i=0; i < 40; i++){
+      slot[i] = pq_byte(100, i);
+    }
+    pq.commit(40, 100);
+  }
+  size_t in2 = pq.enqueueBulk(pkts, PQ_BULK);
+  uint32_t errors = 0;
+  size_t out1 = pq.dequeueBulk(pkts, PQ_BULK);
+  errors += pq_bulk_check(pkts, out1, 0);
+  size_t out2 = pq.dequeueBulk(pkts, PQ_BULK);
+  size_t   long_len;
+  uint32_t timestamp;
+  byte     flags;
+  byte* data = pq.peek(long_len, timestamp, flags);
+  if (data == nullptr || timestamp != 100){
+    errors++;
+  }
+  else{
+    for(size_t i=0; i < long_len; i++){
+      if (data[i] != pq_byte(100, i)){
+        errors++;
+        break;
+      }
+    }
+    pq.release();
+  }
+  size_t out3 = pq.dequeueBulk(pkts, PQ_BULK);
+  errors += pq_bulk_check(pkts, out3, 0);
+  this_sCmd.print(F("pqs: "));this_sCmd.println(pqs);
+  this_sCmd.print(F("in1: "));this_sCmd.println(in1);
+  this_sCmd.print(F("in2: "));this_sCmd.println(in2);
+  this_sCmd.print(F("out1: "));this_sCmd.println(out1);
+  this_sCmd.print(F("out2: "));this_sCmd.println(out2);
+  this_sCmd.print(F("long_len: "));this_sCmd.println(long_len);
+  this_sCmd.print(F("out3: "));this_sCmd.println(out3);
+  this_sCmd.print(F("errors: "));this_sCmd.println(errors);
+  this_sCmd.print(F("size: "));this_sCmd.println(pq.size());
+  this_sCmd.println(F("..."));
+}
+
+// Run 'count' packets of 1 to 'maxLen' bytes through a compact queue of
+// 'bufferSize' bytes, a few at a time, so that the records wrap around the
+// end of the ring many times.  They go in by enqueue and by reserve and
+// commit in turn, and come out by dequeue (when they fit in a Packet) or
+// by peek and release; every third one is requeued onto the front first.
+void PQC_RT_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: PQC_RT_sCmd_action_handler"));
+  char *arg1 = this_sCmd.next();
+  char *arg2 = this_sCmd.next();
+  char *arg3 = this_sCmd.next();
+  if (arg1 == NULL || arg2 == NULL || arg3 == NULL){
+    this_sCmd.print(F("### Error: PQC.RT requires 3 arguments (int bufferSize, int count, int maxLen)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  size_t   bufferSize = strtoul(arg1, NULL, 0);
+  uint32_t count      = strtoul(arg2, NULL, 0);
+  size_t   maxLen     = max((size_t) strtoul(arg3, NULL, 0), (size_t) 1);
+  pqCompact.end();
+  PacketShared::STATUS pqs = pqCompact.beginCompact(bufferSize);
+  uint32_t pushed = 0;
+  uint32_t popped = 0;
+  uint32_t errors = 0;
+  uint32_t bytes  = 0;
+  PacketShared::Packet pkt;
+  while (pqs == PacketShared::SUCCESS && popped < count){
+    //keep two packets queued
+    if (pushed < count && pqCompact.size() < 2){
+      size_t len = 1 + (pushed*13) % maxLen;
+      if (pushed % 2 == 0 && len <= PacketShared::DATA_BUFFER_SIZE){
+        for(size_t i=0; i < len; i++){
+          pkt.data[i] = pq_byte(pushed, i);
+        }
+        pkt.length    = len;
+        pkt.timestamp = pushed;
+        pkt.flags     = 0x00;
+        pqs = pqCompact.enqueue(pkt);
+      }
+      else{
+        size_t room = 0;
+        byte* slot = pqCompact.reserve(room, len);
+        if (slot == nullptr){
+          pqs = PacketShared::ERROR_QUEUE_OVERFLOW;
+          break;
+        }
+        for(size_t i=0; i < len; i++){
+          slot[i] = pq_byte(pushed, i);
+        }
+        pqs = pqCompact.commit(len, pushed);
+      }
+      pushed++;
+      continue;
+    }
+    size_t   len;
+    uint32_t n;
+    byte     flags;
+    byte* data = pqCompact.peek(len, n, flags);
+    if (data == nullptr){
+      pqs = PacketShared::ERROR_QUEUE_UNDERFLOW;
+      break;
+    }
+    if (n % 3 == 0 && len <= PacketShared::DATA_BUFFER_SIZE){
+      //take it off and put it back on the front, where it must come out next
+      pqs = pqCompact.dequeue(pkt);
+      if (pqs == PacketShared::SUCCESS){
+        pqs = pqCompact.requeue(pkt);
+      }
+      data = pqCompact.peek(len, n, flags);
+    }
+    if (pqs != PacketShared::SUCCESS || data == nullptr){
+      break;
+    }
+    if (len != 1 + (n*13) % maxLen || n != popped){
+      errors++;
+    }
+    for(size_t i=0; i < len; i++){
+      if (data[i] != pq_byte(n, i)){
+        errors++;
+        break;
+      }
+    }
+    if (len <= PacketShared::DATA_BUFFER_SIZE && n % 2 == 1){
+      pqs = pqCompact.dequeue(pkt);
+    }
+    else{
+      pqs = pqCompact.release();
+    }
+    bytes += len;
+    popped++;
+  }
+  this_sCmd.print(F("pqs: "));this_sCmd.println(pqs);
+  this_sCmd.print(F("pushed: "));this_sCmd.println(pushed);
+  this_sCmd.print(F("popped: "));this_sCmd.println(popped);
+  this_sCmd.print(F("errors: "));this_sCmd.println(errors);
+  this_sCmd.print(F("bytes: "));this_sCmd.println(bytes);
+  this_sCmd.print(F("size: "));this_sCmd.println(pqCompact.size());
+  this_sCmd.println(F("..."));
+}
+
+// The priority test packets are [level] [number] followed by a few bytes
+size_t PRIO_classifier(const byte* data, size_t len, byte flags){
+  return (len > 0)? data[0] : 0;
+}
+
+PacketShared::STATUS prio_enqueue(byte level, byte n){
+  PacketShared::Packet pkt;
+  pkt.data[0] = level;
+  pkt.data[1] = n;
+  pkt.length  = 2 + n % 5;
+  for(size_t i=2; i < pkt.length; i++){
+    pkt.data[i] = pq_byte(n, i);
+  }
+  pkt.timestamp = 0;
+  pkt.flags     = 0x00;
+  return pqPrio.enqueue(pkt);
+}
+
+// Dequeue one packet and write it to the reply as "p<level>.<number>"
+PacketShared::STATUS prio_dequeue(SerialCommand this_sCmd, PacketShared::Packet& pkt, uint32_t& errors){
+  PacketShared::STATUS pqs = pqPrio.dequeue(pkt);
+  if (pqs != PacketShared::SUCCESS){
+    return pqs;
+  }
+  if (pkt.length != 2 + (size_t) pkt.data[1] % 5u){
+    errors++;
+  }
+  for(size_t i=2; i < pkt.length; i++){
+    if (pkt.data[i] != pq_byte(pkt.data[1], i)){
+      errors++;
+      break;
+    }
+  }
+  this_sCmd.print(F(" p"));this_sCmd.print(pkt.data[0]);
+  this_sCmd.print(F("."));this_sCmd.print(pkt.data[1]);
+  return pqs;
+}
+
+// Queue packets at mixed levels until the levels are full, then serve
+// them: the highest level first and each level in order, with a late
+// urgent packet overtaking the rest and one requeued onto its own level
+void PRIO_RT_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: PRIO_RT_sCmd_action_handler"));
+  const byte levels[] = {0, 1, 2, 0, 0, 1, 2, 1, 0};
+  pqPrio.reset();
+  PacketShared::STATUS pqs = PacketShared::SUCCESS;
+  byte n = 0;
+  for(size_t i=0; i < sizeof(levels) && pqs == PacketShared::SUCCESS; i++){
+    pqs = prio_enqueue(levels[i], n++);
+  }
+  this_sCmd.print(F("pqs: "));this_sCmd.println(pqs);
+  this_sCmd.print(F("size: "));this_sCmd.println(pqPrio.size());
+  //a full level does not take room from the others
+  this_sCmd.print(F("full0_pqs: "));this_sCmd.println(prio_enqueue(0, n++));
+  this_sCmd.print(F("full2_pqs: "));this_sCmd.println(prio_enqueue(2, n++));
+  this_sCmd.print(F("room1_pqs: "));this_sCmd.println(prio_enqueue(1, n++));
+  uint32_t errors = 0;
+  PacketShared::Packet pkt;
+  this_sCmd.print(F("order:"));
+  for(size_t i=0; i < 3; i++){
+    prio_dequeue(this_sCmd, pkt, errors);
+  }
+  //an urgent packet comes in late, and is put back once
+  PacketShared::STATUS late_pqs = prio_enqueue(2, n++);
+  PacketShared::STATUS requeue_pqs = pqPrio.dequeue(pkt);
+  if (requeue_pqs == PacketShared::SUCCESS){
+    requeue_pqs = pqPrio.requeue(pkt);
+  }
+  while (prio_dequeue(this_sCmd, pkt, errors) == PacketShared::SUCCESS){}
+  this_sCmd.println();
+  this_sCmd.print(F("late_pqs: "));this_sCmd.println(late_pqs);
+  this_sCmd.print(F("requeue_pqs: "));this_sCmd.println(requeue_pqs);
+  this_sCmd.print(F("empty_pqs: "));this_sCmd.println(pqPrio.dequeue(pkt));
+  this_sCmd.print(F("errors: "));this_sCmd.println(errors);
+  this_sCmd.println(F("..."));
+}
+
+
+
+//------------------------------------------------------------------------------
+// Wire format round trips
+
+// Deterministic test data: byte 'i' of a pattern repeating every 'period' bytes
+byte pattern_byte(size_t i, size_t period){
+  uint32_t x = (uint32_t) (i % period) * 2654435761UL + 12345;
+  return (byte) (x >> 24);
+}
+
+bool LOOP_Tx_send_callback(PacketCommand& this_pCmd){
+  byte*  pkt = this_pCmd.getOutputBuffer();
+  size_t len = this_pCmd.getOutputLen();
+  if (loopDropEvery > 0 && len >= 4 && pkt[0] == PacketShared::ENVELOPE_PREFIX
+      && pkt[1] == PacketShared::ENVELOPE_RELIABLE){
+    uint16_t seq = (((uint16_t) pkt[2]) << 8) | pkt[3];
+    if (seq % loopDropEvery == loopDropEvery - 1 && (int32_t) seq != loopLastDropped){
+      loopLastDropped = seq;  //lost on the link, only the first time
+      return true;
+    }
+  }
+  loopFrames++;
+  loopLastLen = len;
+  return (this_pCmd.enqueueOutputBuffer(loopTxRx) == PacketShared::SUCCESS);
+}
+
+void LOOP_Tx_send_buffered_callback(PacketCommand& this_pCmd){
+  LOOP_Tx_send_callback(this_pCmd);
+}
+
+bool LOOP_Rx_send_callback(PacketCommand& this_pCmd){
+  return (this_pCmd.enqueueOutputBuffer(loopRxTx) == PacketShared::SUCCESS);
+}
+
+void LOOP_DATA_pCmd_handler(PacketCommand& this_pCmd){
+  uint32_t value;
+  if (this_pCmd.unpack_uint32(value) != PacketShared::SUCCESS){
+    loopErrors++;
+    return;
+  }
+  if (value != loopNext){
+    loopInOrder = false;
+  }
+  loopNext = value + 1;
+  loopSum += value;
+  loopReceived++;
+}
+
+void LOOP_BLOB_pCmd_handler(PacketCommand& this_pCmd){
+  size_t n = 0;
+  byte b;
+  while (this_pCmd.unpack_byte(b) == PacketShared::SUCCESS){
+    if (n >= loopBlobLen || b != loopBlob[n]){
+      loopErrors++;
+      return;
+    }
+    n++;
+  }
+  if (n != loopBlobLen){
+    loopErrors++;
+    return;
+  }
+  loopReceived++;
+}
+
+void LOOP_VARINT_pCmd_handler(PacketCommand& this_pCmd){
+  loopUnpackStatus = this_pCmd.unpack_varint32(loopVarint);
+  if (loopUnpackStatus == PacketShared::SUCCESS){
+    loopUnpackStatus = this_pCmd.unpack_zigzag32(loopZigzag);
+  }
+  loopReceived++;
+}
+
+void print_loop_counters(SerialCommand this_sCmd){
+  this_sCmd.print(F("received: "));this_sCmd.println(loopReceived);
+  this_sCmd.print(F("errors: "));this_sCmd.println(loopErrors);
+  this_sCmd.print(F("sum: "));this_sCmd.println(loopSum);
+  this_sCmd.print(F("in_order: "));this_sCmd.println(loopInOrder? 1 : 0);
+  this_sCmd.print(F("frames: "));this_sCmd.println(loopFrames);
+  this_sCmd.print(F("checksum_failures: "));this_sCmd.println(pRx.getChecksumFailures());
+}
+
+void CRC_CHECK_sCmd_query_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: CRC_CHECK_sCmd_query_handler"));
+  const uint8_t check[] = "123456789";
+  this_sCmd.print(F("crc16: "));this_sCmd.println(PacketCRC::crc16(check, 9));
+  this_sCmd.print(F("crc32: "));this_sCmd.println(PacketCRC::crc32(check, 9));
+  //the same data fed in two pieces
+  this_sCmd.print(F("crc16_split: "));this_sCmd.println(PacketCRC::crc16(check + 4, 5, PacketCRC::crc16(check, 4)));
+  this_sCmd.print(F("crc32_split: "));this_sCmd.println(PacketCRC::crc32(check + 4, 5, PacketCRC::crc32(check, 4)));
+  this_sCmd.println(F("..."));
+}
+
+void LZ_RT_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: LZ_RT_sCmd_action_handler"));
+  char *arg1 = this_sCmd.next();
+  char *arg2 = this_sCmd.next();
+  if (arg1 == NULL || arg2 == NULL){
+    this_sCmd.print(F("### Error: LZ.RT requires 2 arguments (int length, int period)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  size_t len    = min((size_t) strtoul(arg1, NULL, 0), (size_t) LZ_MAX_LEN);
+  size_t period = max((size_t) strtoul(arg2, NULL, 0), (size_t) 1);
+  for(size_t i=0; i < len; i++){
+    lzSrc[i] = pattern_byte(i, period);
+  }
+  size_t clen = PacketLZ::compress(lzSrc, len, lzPacked, sizeof(lzPacked));
+  size_t outLen = 0;
+  PacketShared::STATUS pcs = PacketLZ::decompress(lzPacked, clen, lzOut, sizeof(lzOut), outLen);
+  this_sCmd.print(F("pcs: "));this_sCmd.println(pcs);
+  this_sCmd.print(F("len: "));this_sCmd.println(len);
+  this_sCmd.print(F("clen: "));this_sCmd.println(clen);
+  this_sCmd.print(F("match: "));this_sCmd.println((outLen == len && memcmp(lzSrc, lzOut, len) == 0)? 1 : 0);
+  this_sCmd.println(F("..."));
+}
+
+void LOOP_RESET_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: LOOP_RESET_sCmd_action_handler"));
+  char *arg = this_sCmd.next();
+  PacketCRC::MODE mode = (arg == NULL)? PacketCRC::NONE : (PacketCRC::MODE) strtoul(arg, NULL, 0);
+  pTx.registerSendCallback(LOOP_Tx_send_callback);
+  pTx.registerSendBufferedCallback(LOOP_Tx_send_buffered_callback);
+  pRx.registerSendCallback(LOOP_Rx_send_callback);
+  pTx.setChecksumMode(mode);
+  pRx.setChecksumMode(mode);
+  pRx.resetChecksumFailures();
+  PacketShared::STATUS pcs = pTx.setCoalescing(0);
+  loopTxRx.reset();
+  loopRxTx.reset();
+  relBacklogTx.reset();
+  relTx.reset();
+  relRx.reset();
+  loopReceived = 0;
+  loopErrors   = 0;
+  loopSum      = 0;
+  loopNext     = 0;
+  loopInOrder  = true;
+  loopFrames   = 0;
+  loopDropEvery   = 0;
+  loopLastDropped = -1;
+  this_sCmd.print(F("pcs: "));this_sCmd.println(pcs);
+  this_sCmd.println(F("..."));
+}
+
+void VARINT_RT_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: VARINT_RT_sCmd_action_handler"));
+  char *arg1 = this_sCmd.next();
+  char *arg2 = this_sCmd.next();
+  if (arg1 == NULL || arg2 == NULL){
+    this_sCmd.print(F("### Error: VARINT.RT requires 2 arguments (uint32 value, int32 value)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  uint32_t value  = strtoul(arg1, NULL, 0);
+  int32_t  svalue = strtol(arg2, NULL, 0);
+  pTx.resetOutputBuffer();
+  pTx.setupOutputCommand(loopVarintCommand);
+  pTx.pack_varint32(value);
+  pTx.pack_zigzag32(svalue);
+  PacketShared::STATUS pcs = pTx.send();
+  pRx.processQueue(loopTxRx);
+  this_sCmd.print(F("pcs: "));this_sCmd.println(pcs);
+  this_sCmd.print(F("len: "));this_sCmd.println(loopLastLen);
+  this_sCmd.print(F("received: "));this_sCmd.println(loopReceived);
+  this_sCmd.print(F("unpack_pcs: "));this_sCmd.println(loopUnpackStatus);
+  this_sCmd.print(F("value: "));this_sCmd.println(loopVarint);
+  this_sCmd.print(F("svalue: "));this_sCmd.println(loopZigzag);
+  this_sCmd.println(F("..."));
+}
+
+void BATCH_RT_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: BATCH_RT_sCmd_action_handler"));
+  char *arg = this_sCmd.next();
+  if (arg == NULL){
+    this_sCmd.print(F("### Error: BATCH.RT requires 1 argument (int count)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  uint32_t count = strtoul(arg, NULL, 0);
+  PacketShared::STATUS pcs = pTx.setCoalescing(LOOP_BUFFER_SIZE/2);
+  for(uint32_t i=0; i < count && pcs == PacketShared::SUCCESS; i++){
+    pTx.resetOutputBuffer();
+    pTx.setupOutputCommand(loopDataCommand);
+    pTx.pack_uint32(i);
+    pcs = pTx.send_buffered();
+    pRx.processQueue(loopTxRx);
+  }
+  if (pcs == PacketShared::SUCCESS){
+    pcs = pTx.send_buffered_flush();
+  }
+  pRx.processQueue(loopTxRx);
+  pTx.setCoalescing(0);
+  this_sCmd.print(F("pcs: "));this_sCmd.println(pcs);
+  print_loop_counters(this_sCmd);
+  this_sCmd.println(F("..."));
+}
+
+void FRAG_RT_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: FRAG_RT_sCmd_action_handler"));
+  char *arg1 = this_sCmd.next();
+  char *arg2 = this_sCmd.next();
+  char *arg3 = this_sCmd.next();
+  if (arg1 == NULL || arg2 == NULL || arg3 == NULL){
+    this_sCmd.print(F("### Error: FRAG.RT requires 3 arguments (int length, int maxPacketSize, int repeat)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  size_t   len    = min((size_t) strtoul(arg1, NULL, 0), (size_t) LOOP_BLOB_MAX);
+  size_t   mtu    = strtoul(arg2, NULL, 0);
+  uint32_t repeat = strtoul(arg3, NULL, 0);
+  PacketShared::STATUS pcs = PacketShared::SUCCESS;
+  //enough messages for the message ID to wrap around
+  for(uint32_t r=0; r < repeat && pcs == PacketShared::SUCCESS; r++){
+    for(size_t i=0; i < len; i++){
+      loopBlob[i] = pattern_byte(i + r, 251);
+    }
+    loopBlobLen = len;
+    pcs = pTx.sendFragmented(loopBlobCommand, loopBlob, len, mtu);
+    pRx.processQueue(loopTxRx);
+  }
+  this_sCmd.print(F("pcs: "));this_sCmd.println(pcs);
+  print_loop_counters(this_sCmd);
+  this_sCmd.println(F("..."));
+}
+
+void REL_RT_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: REL_RT_sCmd_action_handler"));
+  char *arg1 = this_sCmd.next();
+  char *arg2 = this_sCmd.next();
+  if (arg1 == NULL || arg2 == NULL){
+    this_sCmd.print(F("### Error: REL.RT requires 2 arguments (int count, int dropEvery)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  uint32_t count = strtoul(arg1, NULL, 0);
+  loopDropEvery   = strtoul(arg2, NULL, 0);
+  loopLastDropped = -1;
+  relTx.setTimeoutLimits(REL_RTO_MIN_MICROS, PacketReliable::RTO_MAX_MICROS_DEFAULT);
+  PacketShared::STATUS pcs = PacketShared::SUCCESS;
+  uint32_t sent = 0;
+  uint32_t start_millis = millis();
+  while (loopReceived < count || relTx.inFlight() > 0 || relTx.backlog() > 0){
+    while (sent < count){
+      pTx.resetOutputBuffer();
+      pTx.setupOutputCommand(loopDataCommand);
+      pTx.pack_uint32(sent);
+      if (relTx.send() != PacketShared::SUCCESS){
+        break;  //the backlog is full
+      }
+      sent++;
+    }
+    relTx.poll();
+    relRx.poll();
+    pRx.processQueue(loopTxRx);
+    pTx.processQueue(loopRxTx);
+    if (millis() - start_millis > REL_TIMEOUT_MILLIS){
+      pcs = PacketShared::ERROR_TIMEOUT;
+      break;
+    }
+  }
+  loopDropEvery = 0;
+  this_sCmd.print(F("pcs: "));this_sCmd.println(pcs);
+  print_loop_counters(this_sCmd);
+  this_sCmd.print(F("retransmits: "));this_sCmd.println(relTx.getRetransmits());
+  this_sCmd.print(F("duplicates: "));this_sCmd.println(relRx.getDuplicates());
+  this_sCmd.println(F("..."));
+}
+
+
+bool FRAME_Tx_send_callback(PacketCommand& this_pCmd){
+  loopFrames++;
+  return (framingTx->send() == PacketShared::SUCCESS);
+}
+
+// Send 'count' packets from pTx to pRx over the loop stream, in COBS (mode
+// 0) or SLIP (mode 1) frames, with the bytes those encodings must escape
+// all through them.  Every 'junkEvery'th packet is preceded by a cut off
+// frame, which the decoder must drop without losing the next one.
+void FRAME_RT_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: FRAME_RT_sCmd_action_handler"));
+  char *arg1 = this_sCmd.next();
+  char *arg2 = this_sCmd.next();
+  char *arg3 = this_sCmd.next();
+  if (arg1 == NULL || arg2 == NULL || arg3 == NULL){
+    this_sCmd.print(F("### Error: FRAME.RT requires 3 arguments (int mode, int count, int junkEvery)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  bool     slip      = (strtoul(arg1, NULL, 0) == PacketFraming::SLIP);
+  uint32_t count     = strtoul(arg2, NULL, 0);
+  uint32_t junkEvery = strtoul(arg3, NULL, 0);
+  const byte specials[] = {0x00, PacketFraming::SLIP_END, PacketFraming::SLIP_ESC, 0xFF};
+  const byte junk[]     = {slip? PacketFraming::SLIP_ESC : (byte) 0x09, 0x41, 0x01};
+  framingTx = slip? &framingTxSLIP : &framingTxCOBS;
+  framingRx = slip? &framingRxSLIP : &framingRxCOBS;
+  framingRx->reset();
+  loopStream.clear();
+  pTx.registerSendCallback(FRAME_Tx_send_callback);
+  PacketShared::STATUS pcs = PacketShared::SUCCESS;
+  uint32_t dropped = 0;
+  //room for the type ID and the largest checksum trailer
+  size_t maxLen = LOOP_BUFFER_SIZE - 1 - 4;
+  for(uint32_t i=0; i < count && pcs == PacketShared::SUCCESS; i++){
+    size_t len = i % (maxLen + 1);
+    for(size_t j=0; j < len; j++){
+      loopBlob[j] = (j % 3 == 0)? specials[(i + j) % 4] : pattern_byte(i + j, 251);
+    }
+    loopBlobLen = len;
+    if (junkEvery > 0 && i % junkEvery == junkEvery - 1){
+      loopStream.write(junk, sizeof(junk));
+    }
+    pTx.resetOutputBuffer();
+    pTx.setupOutputCommand(loopBlobCommand);
+    pTx.pack_byte_array(loopBlob, len);
+    pcs = pTx.send();
+    while (pcs == PacketShared::SUCCESS && loopStream.available() > 0){
+      bool gotPacket;
+      PacketShared::STATUS pfs = framingRx->recv(gotPacket);
+      if (gotPacket){
+        pRx.processInput();
+      }
+      else if (pfs < 0){
+        dropped++;
+      }
+    }
+  }
+  pTx.registerSendCallback(LOOP_Tx_send_callback);
+  this_sCmd.print(F("pcs: "));this_sCmd.println(pcs);
+  this_sCmd.print(F("dropped: "));this_sCmd.println(dropped);
+  print_loop_counters(this_sCmd);
+  this_sCmd.println(F("..."));
+}
+
+// The transport behind the PacketSender: it turns down every 'busyEvery'th
+// packet offered, and loses the first 'failTimes' tries of every packet
+// numbered n*failEvery - 1, reporting how each try ended after poll returns
+uint16_t senderFirstTicket = 0;
+uint32_t senderOffers      = 0;
+uint16_t senderBusyEvery   = 0;
+uint16_t senderFailEvery   = 0;
+uint16_t senderFailTimes   = 0;
+uint16_t senderFailTicket  = 0;
+uint16_t senderFailTries   = 0;
+uint16_t senderDoneTickets[SENDER_IN_FLIGHT];
+bool     senderDoneOk[SENDER_IN_FLIGHT];
+size_t   senderDoneCount   = 0;
+uint32_t senderCompletedOk     = 0;
+uint32_t senderCompletedFailed = 0;
+uint32_t senderFailedSum       = 0;
+
+bool SENDER_Tx_send_callback(PacketCommand& this_pCmd){
+  senderOffers++;
+  if (senderBusyEvery > 0 && senderOffers % senderBusyEvery == 0){
+    return false;
+  }
+  uint16_t ticket = sender.getTransmitTicket();
+  uint16_t n = ticket - senderFirstTicket;
+  bool ok = true;
+  if (senderFailEvery > 0 && n % senderFailEvery == senderFailEvery - 1){
+    if (ticket != senderFailTicket){
+      senderFailTicket = ticket;
+      senderFailTries  = 0;
+    }
+    ok = (++senderFailTries > senderFailTimes);
+  }
+  if (ok){
+    loopFrames++;
+    ok = (this_pCmd.enqueueOutputBuffer(loopTxRx) == PacketShared::SUCCESS);
+  }
+  senderDoneTickets[senderDoneCount] = ticket;
+  senderDoneOk[senderDoneCount] = ok;
+  senderDoneCount++;
+  return true;
+}
+
+void SENDER_completion_callback(uint16_t ticket, PacketShared::STATUS status){
+  if (status == PacketShared::SUCCESS){
+    senderCompletedOk++;
+  }
+  else{
+    senderCompletedFailed++;
+    senderFailedSum += (uint16_t) (ticket - senderFirstTicket);
+  }
+}
+
+void SENDER_RT_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: SENDER_RT_sCmd_action_handler"));
+  char *arg1 = this_sCmd.next();
+  char *arg2 = this_sCmd.next();
+  char *arg3 = this_sCmd.next();
+  char *arg4 = this_sCmd.next();
+  if (arg1 == NULL || arg2 == NULL || arg3 == NULL || arg4 == NULL){
+    this_sCmd.print(F("### Error: SENDER.RT requires 4 arguments (int count, int busyEvery, int failEvery, int failTimes)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  uint32_t count  = strtoul(arg1, NULL, 0);
+  senderBusyEvery = strtoul(arg2, NULL, 0);
+  senderFailEvery = strtoul(arg3, NULL, 0);
+  senderFailTimes = strtoul(arg4, NULL, 0);
+  senderOffers    = 0;
+  senderDoneCount = 0;
+  senderCompletedOk     = 0;
+  senderCompletedFailed = 0;
+  senderFailedSum       = 0;
+  pTx.registerSendCallback(SENDER_Tx_send_callback);
+  PacketShared::STATUS pcs = PacketShared::SUCCESS;
+  uint32_t sent = 0;
+  uint32_t start_millis = millis();
+  while (sent < count || sender.queued() > 0 || sender.inFlight() > 0){
+    while (sent < count){
+      pTx.resetOutputBuffer();
+      pTx.setupOutputCommand(loopDataCommand);
+      pTx.pack_uint32(sent);
+      uint16_t ticket;
+      if (sender.send(ticket, SENDER_completion_callback) != PacketShared::SUCCESS){
+        break;  //the queue is full
+      }
+      if (sent == 0){
+        senderFirstTicket = ticket;
+      }
+      sent++;
+    }
+    sender.poll();
+    size_t done = senderDoneCount;
+    senderDoneCount = 0;
+    for(size_t i=0; i < done && pcs == PacketShared::SUCCESS; i++){
+      pcs = sender.complete(senderDoneTickets[i], senderDoneOk[i]);
+    }
+    pRx.processQueue(loopTxRx);
+    if (pcs != PacketShared::SUCCESS){
+      break;
+    }
+    if (millis() - start_millis > REL_TIMEOUT_MILLIS){
+      pcs = PacketShared::ERROR_TIMEOUT;
+      break;
+    }
+  }
+  pTx.registerSendCallback(LOOP_Tx_send_callback);
+  this_sCmd.print(F("pcs: "));this_sCmd.println(pcs);
+  print_loop_counters(this_sCmd);
+  this_sCmd.print(F("offers: "));this_sCmd.println(senderOffers);
+  this_sCmd.print(F("completed_ok: "));this_sCmd.println(senderCompletedOk);
+  this_sCmd.print(F("completed_failed: "));this_sCmd.println(senderCompletedFailed);
+  this_sCmd.print(F("failed_sum: "));this_sCmd.println(senderFailedSum);
+  this_sCmd.println(F("..."));
+}
+
+// Queries carry a number, which pRx answers with 3*n + 1, except that it
+// ignores every n*k - 1 when 'loopDropEvery' is k.  Request IDs are handed
+// out in turn, so query n has ID reqFirstId + n.
+uint16_t reqFirstId  = 0;
+uint32_t reqSent     = 0;
+uint32_t reqReplies  = 0;
+uint32_t reqTimeouts = 0;
+uint32_t reqErrors   = 0;
+uint32_t reqMinRTT   = 0;
+
+void LOOP_QUERY_pCmd_handler(PacketCommand& this_pCmd){
+  uint32_t value;
+  if (this_pCmd.unpack_uint32(value) != PacketShared::SUCCESS){
+    loopErrors++;
+    return;
+  }
+  loopReceived++;
+  if (loopDropEvery > 0 && value % loopDropEvery == loopDropEvery - 1u){
+    return;
+  }
+  this_pCmd.setupOutputReply();
+  this_pCmd.setupOutputCommand(loopQueryRxCommand);
+  this_pCmd.pack_uint32(3*value + 1);
+  this_pCmd.send();
+}
+
+void REQ_reply_callback(PacketCommand& this_pCmd, uint16_t requestId, PacketShared::STATUS status, uint32_t rttMicros){
+  uint32_t value = (uint16_t) (requestId - reqFirstId);
+  if (value >= reqSent){
+    reqErrors++;
+    return;
+  }
+  if (status == PacketShared::ERROR_TIMEOUT){
+    reqTimeouts++;
+    if (loopDropEvery == 0 || value % loopDropEvery != loopDropEvery - 1u){
+      reqErrors++;  //should have been answered
+    }
+    return;
+  }
+  uint32_t reply;
+  if (status != PacketShared::SUCCESS || this_pCmd.unpack_uint32(reply) != PacketShared::SUCCESS
+      || reply != 3*value + 1){
+    reqErrors++;
+    return;
+  }
+  if (reqReplies == 0 || rttMicros < reqMinRTT){
+    reqMinRTT = rttMicros;
+  }
+  reqReplies++;
+}
+
+void REQ_RT_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: REQ_RT_sCmd_action_handler"));
+  char *arg1 = this_sCmd.next();
+  char *arg2 = this_sCmd.next();
+  if (arg1 == NULL || arg2 == NULL){
+    this_sCmd.print(F("### Error: REQ.RT requires 2 arguments (int count, int dropEvery)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  uint32_t count = strtoul(arg1, NULL, 0);
+  loopDropEvery  = strtoul(arg2, NULL, 0);
+  reqReplies  = 0;
+  reqTimeouts = 0;
+  reqErrors   = 0;
+  reqMinRTT   = 0;
+  uint32_t table_timeouts = requests.getTimeouts();
+  PacketShared::STATUS pcs = PacketShared::SUCCESS;
+  reqSent = 0;
+  uint32_t start_millis = millis();
+  while (reqSent < count || requests.outstanding() > 0){
+    while (reqSent < count){
+      uint16_t requestId;
+      if (requests.beginQuery(requestId, REQ_reply_callback, REQ_TIMEOUT_MICROS) != PacketShared::SUCCESS){
+        break;  //the table is full
+      }
+      if (reqSent == 0){
+        reqFirstId = requestId;
+      }
+      pTx.setupOutputCommand(loopQueryCommand);
+      pTx.pack_uint32(reqSent);
+      reqSent++;
+      pcs = pTx.send();
+      if (pcs != PacketShared::SUCCESS){
+        break;
+      }
+    }
+    pRx.processQueue(loopTxRx);
+    pTx.processQueue(loopRxTx);
+    requests.expire();
+    if (pcs != PacketShared::SUCCESS){
+      break;
+    }
+    if (millis() - start_millis > REL_TIMEOUT_MILLIS){
+      pcs = PacketShared::ERROR_TIMEOUT;
+      break;
+    }
+  }
+  loopDropEvery = 0;
+  this_sCmd.print(F("pcs: "));this_sCmd.println(pcs);
+  print_loop_counters(this_sCmd);
+  this_sCmd.print(F("replies: "));this_sCmd.println(reqReplies);
+  this_sCmd.print(F("timeouts: "));this_sCmd.println(reqTimeouts);
+  this_sCmd.print(F("table_timeouts: "));this_sCmd.println(requests.getTimeouts() - table_timeouts);
+  this_sCmd.print(F("reply_errors: "));this_sCmd.println(reqErrors);
+  this_sCmd.print(F("min_rtt: "));this_sCmd.println(reqMinRTT);
+  this_sCmd.print(F("srtt: "));this_sCmd.println(requests.getSmoothedRTT());
+  this_sCmd.print(F("outstanding: "));this_sCmd.println(requests.outstanding());
+  this_sCmd.println(F("..."));
+}
+
+// Send 'count' packets, every 'stampEvery'th one with a send timestamp,
+// with pRx's clock taken to be 'offset' micros ahead of pTx's, and report
+// the latency histogram pRx kept for them
+void LAT_RT_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: LAT_RT_sCmd_action_handler"));
+  char *arg1 = this_sCmd.next();
+  char *arg2 = this_sCmd.next();
+  char *arg3 = this_sCmd.next();
+  if (arg1 == NULL || arg2 == NULL || arg3 == NULL){
+    this_sCmd.print(F("### Error: LAT.RT requires 3 arguments (int count, int stampEvery, int offset)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  uint32_t count      = strtoul(arg1, NULL, 0);
+  uint32_t stampEvery = max(strtoul(arg2, NULL, 0), 1UL);
+  int32_t  offset     = strtol(arg3, NULL, 0);
+  pRx.resetLatencyHistograms();
+  pRx.setClockOffset(offset);
+  PacketShared::STATUS pcs = PacketShared::SUCCESS;
+  for(uint32_t i=0; i < count && pcs == PacketShared::SUCCESS; i++){
+    pTx.resetOutputBuffer();
+    pTx.setupOutputCommand(loopDataCommand);
+    if (i % stampEvery == 0){
+      pTx.flagOutputAppendSendTimestamp();
+    }
+    pTx.pack_uint32(i);
+    pcs = pTx.send();
+    pRx.processQueue(loopTxRx);
+  }
+  pRx.setClockOffset(0);
+  const PacketLatencyHistogram* histogram = pRx.getLatencyHistogram(loopDataRxCommand);
+  this_sCmd.print(F("pcs: "));this_sCmd.println(pcs);
+  print_loop_counters(this_sCmd);
+  this_sCmd.print(F("count: "));this_sCmd.println((histogram != nullptr)? histogram->count() : 0);
+  if (histogram != nullptr){
+    this_sCmd.print(F("min: "));this_sCmd.println(histogram->minimum());
+    this_sCmd.print(F("max: "));this_sCmd.println(histogram->maximum());
+    this_sCmd.print(F("mean: "));this_sCmd.println(histogram->mean());
+    this_sCmd.print(F("p50: "));this_sCmd.println(histogram->percentile(50));
+    this_sCmd.print(F("p99: "));this_sCmd.println(histogram->percentile(99));
+  }
+  this_sCmd.println(F("..."));
+}
+
+// What pTx took from the last profiling reply: the header, and the entry
+// for LOOP.DATA if it was there
+uint32_t profReplies       = 0;
+uint32_t profMatchFailures = 0;
+byte     profFirst         = 0;
+byte     profEntries       = 0;
+uint32_t profDataCalls     = 0;
+uint32_t profDataUnpackErrors = 0;
+uint64_t profTotalMicros   = 0;
+uint32_t profMaxMicros     = 0;
+
+void LOOP_PROFILE_pCmd_handler(PacketCommand& this_pCmd){
+  profDataCalls = 0;
+  profDataUnpackErrors = 0;
+  if (this_pCmd.unpack_uint32(profMatchFailures) != PacketShared::SUCCESS ||
+      this_pCmd.unpack_byte(profFirst) != PacketShared::SUCCESS ||
+      this_pCmd.unpack_byte(profEntries) != PacketShared::SUCCESS){
+    loopErrors++;
+    return;
+  }
+  for(byte i=0; i < profEntries; i++){
+    uint16_t key;
+    uint32_t calls;
+    uint64_t total_micros;
+    uint32_t max_micros;
+    uint32_t unpack_errors;
+    if (this_pCmd.unpack_uint16(key) != PacketShared::SUCCESS ||
+        this_pCmd.unpack_uint32(calls) != PacketShared::SUCCESS ||
+        this_pCmd.unpack_uint64(total_micros) != PacketShared::SUCCESS ||
+        this_pCmd.unpack_uint32(max_micros) != PacketShared::SUCCESS ||
+        this_pCmd.unpack_uint32(unpack_errors) != PacketShared::SUCCESS){
+      loopErrors++;  //fewer entries than the header said
+      return;
+    }
+    if (key == PacketCommand::typeIdKey(loopDataCommand.type_id)){
+      profDataCalls        = calls;
+      profDataUnpackErrors = unpack_errors;
+      profTotalMicros      = total_micros;
+      profMaxMicros        = max_micros;
+    }
+  }
+  byte extra;
+  if (this_pCmd.unpack_byte(extra) == PacketShared::SUCCESS){
+    loopErrors++;    //more entries than the header said
+  }
+  profReplies++;
+}
+
+// Send pRx 'count' LOOP.DATA packets, one more with its value cut off, a
+// LOOP.VARINT and a LOOP.BLOB, so that more commands are profiled than
+// fit in one reply, and two packets it has no command for.  Then ask it
+// for its profiling counters starting at entry 'first'.  Only with
+// PACKETCOMMAND_PROFILING defined.
+void PROF_RT_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: PROF_RT_sCmd_action_handler"));
+  char *arg1 = this_sCmd.next();
+  char *arg2 = this_sCmd.next();
+  if (arg1 == NULL || arg2 == NULL){
+    this_sCmd.print(F("### Error: PROF.RT requires 2 arguments (int count, int first)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  #ifdef PACKETCOMMAND_PROFILING
+  uint32_t count = strtoul(arg1, NULL, 0);
+  byte     first = strtoul(arg2, NULL, 0);
+  PacketCommand::CommandInfo profileCommand;
+  pTx.lookupCommandByName("LOOP.PROFILE", profileCommand);
+  pRx.resetProfiling();
+  profReplies = 0;
+  PacketShared::STATUS pcs = PacketShared::SUCCESS;
+  for(uint32_t i=0; i <= count && pcs == PacketShared::SUCCESS; i++){
+    pTx.resetOutputBuffer();
+    pTx.setupOutputCommand(loopDataCommand);
+    if (i < count){
+      pTx.pack_uint32(i);
+    }
+    pcs = pTx.send();
+    pRx.processQueue(loopTxRx);
+  }
+  const PacketCommand::CommandInfo* others[] = {&loopVarintCommand, &loopBlobCommand};
+  loopBlobLen = 0;
+  for(byte i=0; i < 2 && pcs == PacketShared::SUCCESS; i++){
+    pTx.resetOutputBuffer();
+    pTx.setupOutputCommand(*others[i]);
+    if (i == 0){
+      pTx.pack_varint32(count);
+      pTx.pack_zigzag32(-1);
+    }
+    pcs = pTx.send();
+    pRx.processQueue(loopTxRx);
+  }
+  for(byte i=0; i < 2 && pcs == PacketShared::SUCCESS; i++){
+    pTx.resetOutputBuffer();
+    pTx.pack_byte(0x7E);
+    pcs = pTx.send();
+    pRx.processQueue(loopTxRx);
+  }
+  if (pcs == PacketShared::SUCCESS){
+    pTx.resetOutputBuffer();
+    pTx.setupOutputCommand(profileCommand);
+    pTx.pack_byte(first);
+    pcs = pTx.send();
+    pRx.processQueue(loopTxRx);
+    pTx.processQueue(loopRxTx);
+  }
+  this_sCmd.println(F("profiling: 1"));
+  this_sCmd.print(F("pcs: "));this_sCmd.println(pcs);
+  print_loop_counters(this_sCmd);
+  this_sCmd.print(F("profile_count: "));this_sCmd.println(pRx.getProfileCount());
+  this_sCmd.print(F("replies: "));this_sCmd.println(profReplies);
+  this_sCmd.print(F("match_failures: "));this_sCmd.println(profMatchFailures);
+  this_sCmd.print(F("first: "));this_sCmd.println(profFirst);
+  this_sCmd.print(F("entries: "));this_sCmd.println(profEntries);
+  this_sCmd.print(F("data_calls: "));this_sCmd.println(profDataCalls);
+  this_sCmd.print(F("data_unpack_errors: "));this_sCmd.println(profDataUnpackErrors);
+  this_sCmd.print(F("data_max_ok: "));this_sCmd.println((profDataCalls == 0 || profTotalMicros >= profMaxMicros)? 1 : 0);
+  #else
+  this_sCmd.println(F("profiling: 0"));
+  #endif
+  this_sCmd.println(F("..."));
+}
+
+// Queue 'count' packets for pRx, let one call with a time budget of a
+// microsecond take what it can, then drain the rest at most 'maxPackets'
+// per call
+void DRAIN_RT_sCmd_action_handler(SerialCommand this_sCmd) {
+  this_sCmd.println(F("---"));
+  this_sCmd.println(F("cmd: DRAIN_RT_sCmd_action_handler"));
+  char *arg1 = this_sCmd.next();
+  char *arg2 = this_sCmd.next();
+  if (arg1 == NULL || arg2 == NULL){
+    this_sCmd.print(F("### Error: DRAIN.RT requires 2 arguments (int count, int maxPackets)\n"));
+    this_sCmd.println(F("..."));
+    return;
+  }
+  uint32_t count      = min(strtoul(arg1, NULL, 0), (unsigned long) LOOP_QUEUE_CAPACITY);
+  size_t   maxPackets = max((size_t) strtoul(arg2, NULL, 0), (size_t) 1);
+  PacketShared::STATUS pcs = PacketShared::SUCCESS;
+  for(uint32_t i=0; i < count && pcs == PacketShared::SUCCESS; i++){
+    pTx.resetOutputBuffer();
+    pTx.setupOutputCommand(loopDataCommand);
+    pTx.pack_uint32(i);
+    pcs = pTx.send();
+  }
+  size_t queued   = loopTxRx.size();
+  size_t budget_n = pRx.processQueue(loopTxRx, 0, 1);
+  uint32_t calls = 0;
+  bool limit_ok  = true;
+  while (loopTxRx.size() > 0){
+    size_t expected = min(loopTxRx.size(), maxPackets);
+    if (pRx.processQueue(loopTxRx, maxPackets) != expected){
+      limit_ok = false;
+      break;
+    }
+    calls++;
+  }
+  this_sCmd.print(F("pcs: "));this_sCmd.println(pcs);
+  print_loop_counters(this_sCmd);
+  this_sCmd.print(F("queued: "));this_sCmd.println(queued);
+  this_sCmd.print(F("budget_n: "));this_sCmd.println(budget_n);
+  this_sCmd.print(F("calls: "));this_sCmd.println(calls);
+  this_sCmd.print(F("limit_ok: "));this_sCmd.println(limit_ok? 1 : 0);
+  this_sCmd.println(F("..."));
+}
 
 // Unrecognized command
 void UNRECOGNIZED_sCmd_default_handler(const char* command, SerialCommand this_sCmd){
@@ -9,6 +9,8 @@ def randstr(size, chars=string.ascii_uppercase + string.ascii_lowercase +string.
     return ''.join(random.choice(chars) for _ in range(size))
 
 PS_STATUS = {
+    'PACKET_CONSUMED': 3,
+    'INCOMPLETE_PACKET': 2,
     'NO_PACKET_RECEIVED': 1,
     'SUCCESS':0,
     'ERROR_EXCEDED_MAX_COMMANDS':-1,
@@ -21,6 +23,11 @@ PS_STATUS = {
     'ERROR_INPUT_BUFFER_OVERRUN':-8,
     'ERROR_QUEUE_OVERFLOW':-9,
     'ERROR_QUEUE_UNDERFLOW':-10,
+    'ERROR_MEMALLOC_FAIL':-11,
+    'ERROR_INVALID_CAPACITY':-12,
+    'ERROR_CHECKSUM_MISMATCH':-13,
+    'ERROR_SEND_FAILED':-14,
+    'ERROR_TIMEOUT':-15,
 }
 
 ################################################################################
@@ -58,6 +65,320 @@ class PackCommandTestSuite(SerialCommandDrivenTestSuite):
         self.assertEqual(resp['pcs'],0) #check for error codes
         self.assertEqual(0,0)
 ################################################################################
+def varint_len(value):
+    n = 1
+    while value >= 0x80:
+        value >>= 7
+        n += 1
+    return n
+
+def zigzag32(value):
+    return ((value << 1) ^ (value >> 31)) & 0xFFFFFFFF
+
+class WireFormatTestSuite(SerialCommandDrivenTestSuite):
+    def testCRCCheckValues(self):
+        self._send("CRC.CHECK")
+        resp = self._parse_resp().next()
+        self.assertEqual(resp['crc16'], 0x29B1)     #CRC-16/CCITT-FALSE of "123456789"
+        self.assertEqual(resp['crc32'], 0xCBF43926) #CRC-32 of "123456789"
+        self.assertEqual(resp['crc16_split'], 0x29B1)
+        self.assertEqual(resp['crc32_split'], 0xCBF43926)
+    def testLZRoundTrip(self):
+        #(length, period of the repeating pattern), the last ones incompressible
+        for length, period in [(0,1),(1,1),(3,1),(18,1),(256,1),(256,7),(256,100),(100,100),(256,256)]:
+            self._send("LZ.RT %d %d" % (length, period))
+            resp = self._parse_resp().next()
+            self.assertEqual(resp['pcs'],0) #check for error codes
+            self.assertEqual(resp['len'],length)
+            self.assertEqual(resp['match'],1)
+            if period < length/4:
+                self.assertTrue(resp['clen'] < length)
+################################################################################
+class LoopbackTestSuite(SerialCommandDrivenTestSuite):
+    CHECKSUM_MODE = 0   #PacketCRC::MODE, the size of the trailer
+    def setUp(self):
+        super(LoopbackTestSuite, self).setUp()  #call the setup of the parent
+        self._send("LOOP.RESET %d" % self.CHECKSUM_MODE)
+        resp = self._parse_resp().next()
+        self.assertEqual(resp['pcs'],0) #check for error codes
+    def testVarintRoundTrip(self):
+        values  = [0, 1, 127, 128, 16383, 16384, 2**21 - 1, 2**21, 2**28 - 1, 2**28, 2**32 - 1]
+        svalues = [0, -1, 1, -64, 63, -65, 64, 2**31 - 1, -2**31]
+        for i in range(max(len(values), len(svalues))):
+            value  = values[i % len(values)]
+            svalue = svalues[i % len(svalues)]
+            self._send("VARINT.RT %d %d" % (value, svalue))
+            resp = self._parse_resp().next()
+            self.assertEqual(resp['pcs'],0) #check for error codes
+            self.assertEqual(resp['received'],i + 1)
+            self.assertEqual(resp['unpack_pcs'],0)
+            self.assertEqual(resp['value'],value)
+            self.assertEqual(resp['svalue'],svalue)
+            #type ID, the two varints and the checksum trailer
+            self.assertEqual(resp['len'],1 + varint_len(value) + varint_len(zigzag32(svalue)) + self.CHECKSUM_MODE)
+    def testBatchRoundTrip(self):
+        count = 40
+        self._send("BATCH.RT %d" % count)
+        resp = self._parse_resp().next()
+        self.assertEqual(resp['pcs'],0) #check for error codes
+        self.assertEqual(resp['received'],count)
+        self.assertEqual(resp['errors'],0)
+        self.assertEqual(resp['in_order'],1)
+        self.assertEqual(resp['sum'],count*(count - 1)/2)
+        self.assertTrue(resp['frames'] < count) #packets were coalesced
+        self.assertEqual(resp['checksum_failures'],0)
+    def testFragmentRoundTrip(self):
+        #300 messages, so that the 8-bit message ID wraps around
+        for length, mtu in [(10,0),(250,0),(250,32),(61,40)]:
+            self._send("LOOP.RESET %d" % self.CHECKSUM_MODE)
+            self._parse_resp().next()
+            self._send("FRAG.RT %d %d %d" % (length, mtu, 300))
+            resp = self._parse_resp().next()
+            self.assertEqual(resp['pcs'],0) #check for error codes
+            self.assertEqual(resp['received'],300)
+            self.assertEqual(resp['errors'],0)
+            self.assertEqual(resp['checksum_failures'],0)
+    def testReliableNoLoss(self):
+        count = 200
+        self._send("REL.RT %d 0" % count)
+        resp = self._parse_resp().next()
+        self.assertEqual(resp['pcs'],0) #check for error codes
+        self.assertEqual(resp['received'],count)
+        self.assertEqual(resp['in_order'],1)
+        self.assertEqual(resp['retransmits'],0)
+        self.assertEqual(resp['duplicates'],0)
+    def testReliableLoss(self):
+        #losing a packet leaves later ones to be reported by the SACK bits
+        count = 3000
+        self._send("REL.RT %d 16" % count)
+        resp = self._parse_resp().next()
+        self.assertEqual(resp['pcs'],0) #check for error codes
+        self.assertEqual(resp['received'],count) #each delivered exactly once
+        self.assertEqual(resp['sum'],count*(count - 1)/2)
+        self.assertTrue(resp['retransmits'] > 0)
+    def testReliableSequenceWrap(self):
+        #past the 16-bit sequence number wrap, losing packet 65535 on the way;
+        #this takes a while on slow boards
+        count = 65600
+        self._send("REL.RT %d 64" % count)
+        resp = self._parse_resp().next()
+        self.assertEqual(resp['pcs'],0) #check for error codes
+        self.assertEqual(resp['received'],count)
+        self.assertEqual(resp['sum'],(count*(count - 1)/2) & 0xFFFFFFFF)
+        self.assertEqual(resp['checksum_failures'],0)
+    def testFramingRoundTrip(self):
+        #COBS then SLIP, with a cut off frame in front of every seventh packet
+        for mode in [0, 1]:
+            count = 300
+            self._send("LOOP.RESET %d" % self.CHECKSUM_MODE)
+            self._parse_resp().next()
+            self._send("FRAME.RT %d %d 7" % (mode, count))
+            resp = self._parse_resp().next()
+            self.assertEqual(resp['pcs'],0) #check for error codes
+            self.assertEqual(resp['received'],count)
+            self.assertEqual(resp['errors'],0)
+            self.assertEqual(resp['dropped'],count/7)
+            self.assertEqual(resp['frames'],count)
+            self.assertEqual(resp['checksum_failures'],0)
+    def testSenderRoundTrip(self):
+        #the transport is busy for every fifth offer and loses the first try
+        #of every tenth packet, which the retries make up for
+        count = 500
+        self._send("SENDER.RT %d 5 10 1" % count)
+        resp = self._parse_resp().next()
+        self.assertEqual(resp['pcs'],0) #check for error codes
+        self.assertEqual(resp['received'],count)
+        self.assertEqual(resp['errors'],0)
+        self.assertEqual(resp['sum'],count*(count - 1)/2)
+        self.assertEqual(resp['completed_ok'],count)
+        self.assertEqual(resp['completed_failed'],0)
+        self.assertTrue(resp['offers'] > resp['frames'] + count/10) #turned down and lost ones
+        self.assertEqual(resp['checksum_failures'],0)
+    def testSenderRetriesExhausted(self):
+        #every seventh packet is lost on more tries than there are retries
+        count = 500
+        self._send("SENDER.RT %d 0 7 100" % count)
+        resp = self._parse_resp().next()
+        self.assertEqual(resp['pcs'],0) #check for error codes
+        failed = [n for n in range(count) if n % 7 == 6]
+        self.assertEqual(resp['completed_ok'],count - len(failed))
+        self.assertEqual(resp['completed_failed'],len(failed))
+        self.assertEqual(resp['failed_sum'],sum(failed))
+        self.assertEqual(resp['received'],count - len(failed))
+        self.assertEqual(resp['in_order'],0)
+        self.assertEqual(resp['sum'],count*(count - 1)/2 - sum(failed))
+    def testRequestReplies(self):
+        #every query is answered and the replies matched up by request ID
+        count = 300
+        self._send("REQ.RT %d 0" % count)
+        resp = self._parse_resp().next()
+        self.assertEqual(resp['pcs'],0) #check for error codes
+        self.assertEqual(resp['received'],count)
+        self.assertEqual(resp['replies'],count)
+        self.assertEqual(resp['timeouts'],0)
+        self.assertEqual(resp['reply_errors'],0)
+        self.assertEqual(resp['outstanding'],0)
+        self.assertTrue(resp['min_rtt'] > 0)
+        self.assertTrue(resp['srtt'] > 0)
+        self.assertEqual(resp['checksum_failures'],0)
+    def testRequestTimeouts(self):
+        #every fifth query goes unanswered and must time out, while the
+        #others are still matched up
+        count = 300
+        self._send("REQ.RT %d 5" % count)
+        resp = self._parse_resp().next()
+        self.assertEqual(resp['pcs'],0) #check for error codes
+        self.assertEqual(resp['received'],count)
+        self.assertEqual(resp['replies'],count - count/5)
+        self.assertEqual(resp['timeouts'],count/5)
+        self.assertEqual(resp['table_timeouts'],count/5)
+        self.assertEqual(resp['reply_errors'],0)
+        self.assertEqual(resp['outstanding'],0)
+    def testLatencyHistogram(self):
+        #every third packet is timestamped, with the receiver's clock taken
+        #to be 10 ms ahead, so each latency is at least that
+        count = 300
+        self._send("LAT.RT %d 3 10000" % count)
+        resp = self._parse_resp().next()
+        self.assertEqual(resp['pcs'],0) #check for error codes
+        self.assertEqual(resp['received'],count)
+        self.assertEqual(resp['in_order'],1)
+        self.assertEqual(resp['count'],count/3)
+        self.assertTrue(10000 <= resp['min'] <= resp['mean'] <= resp['max'])
+        #percentiles are bucket upper bounds, clipped to the maximum
+        self.assertTrue(resp['min'] <= resp['p50'] <= resp['p99'] <= resp['max'])
+        self.assertEqual(resp['checksum_failures'],0)
+        #a sender clock that seems ahead gives negative latencies, counted as zero
+        self._send("LAT.RT %d 1 -1000000" % count)
+        resp = self._parse_resp().next()
+        self.assertEqual(resp['pcs'],0) #check for error codes
+        self.assertEqual(resp['count'],count)
+        self.assertEqual(resp['max'],0)
+    def testProfilingCounters(self):
+        #needs the sketch and library built with PACKETCOMMAND_PROFILING
+        count = 20
+        self._send("PROF.RT %d 0" % count)
+        resp = self._parse_resp().next()
+        if resp['profiling'] == 0:
+            self.skipTest("built without PACKETCOMMAND_PROFILING")
+        self.assertEqual(resp['pcs'],0) #check for error codes
+        self.assertEqual(resp['replies'],1)
+        self.assertEqual(resp['errors'],1) #only the cut off LOOP.DATA
+        self.assertEqual(resp['match_failures'],2)
+        self.assertEqual(resp['first'],0)
+        #three commands were called, two entries fit in the 64 byte reply
+        self.assertEqual(resp['entries'],2)
+        self.assertEqual(resp['data_calls'],count + 1)
+        self.assertEqual(resp['data_unpack_errors'],1)
+        self.assertEqual(resp['data_max_ok'],1)
+        #the rest are asked for starting after those
+        self._send("LOOP.RESET %d" % self.CHECKSUM_MODE)
+        self._parse_resp().next()
+        self._send("PROF.RT %d 2" % count)
+        resp = self._parse_resp().next()
+        self.assertEqual(resp['pcs'],0) #check for error codes
+        self.assertEqual(resp['replies'],1)
+        self.assertEqual(resp['errors'],1)
+        self.assertEqual(resp['first'],2)
+        self.assertTrue(resp['entries'] >= 1)
+        self.assertEqual(resp['data_calls'],0)
+    def testDrainQueue(self):
+        #(packets, most per call)
+        for count, most in [(16,5),(16,1),(7,16)]:
+            self._send("LOOP.RESET %d" % self.CHECKSUM_MODE)
+            self._parse_resp().next()
+            self._send("DRAIN.RT %d %d" % (count, most))
+            resp = self._parse_resp().next()
+            self.assertEqual(resp['pcs'],0) #check for error codes
+            self.assertEqual(resp['queued'],count)
+            #a time budget stops a batch, but never before its first packet
+            self.assertTrue(1 <= resp['budget_n'] < count)
+            self.assertEqual(resp['limit_ok'],1)
+            self.assertEqual(resp['calls'],(count - resp['budget_n'] + most - 1)/most)
+            self.assertEqual(resp['received'],count)
+            self.assertEqual(resp['in_order'],1)
+
+class LoopbackCRC16TestSuite(LoopbackTestSuite):
+    CHECKSUM_MODE = 2
+
+class LoopbackCRC32TestSuite(LoopbackTestSuite):
+    CHECKSUM_MODE = 4
+################################################################################
+class SlotQueueTestSuite(SerialCommandDrivenTestSuite):
+    def _check_cycle(self, resp, capacity, count):
+        self.assertEqual(resp['pqs'],0) #check for error codes
+        self.assertEqual(resp['capacity'],capacity)
+        self.assertEqual(resp['filled'],capacity)
+        self.assertEqual(resp['overflow_ok'],1)
+        self.assertEqual(resp['underflow_ok'],1)
+        self.assertEqual(resp['pushed'],count)
+        self.assertEqual(resp['popped'],count)
+        self.assertTrue(resp['requeued'] > count/20)
+        self.assertEqual(resp['errors'],0)
+    def testWrapAround(self):
+        #(capacity, slot size), power of two capacities wrap with a mask;
+        #packets over 32 bytes only fit a peek
+        for capacity, slotsize in [(1,8),(3,32),(4,32),(5,48),(16,16)]:
+            count = 50*capacity + 7
+            self._send("PQS.RT %d %d %d" % (capacity, slotsize, count))
+            resp = self._parse_resp().next()
+            self._check_cycle(resp, capacity, count)
+    def testStaticQueue(self):
+        #StaticPacketQueue<5, 48> and <8, 40>, twice each to start again
+        #from where the last run left the indices
+        for capacity in [5, 8, 5, 8]:
+            count = 301
+            self._send("PQS.STATIC %d %d" % (capacity, count))
+            resp = self._parse_resp().next()
+            self._check_cycle(resp, capacity, count)
+    def testBulk(self):
+        #four packets in, a long one, then four more as far as they fit;
+        #batches out stop in front of the long one
+        for mode, in2 in [(0, 1), (1, 4)]:
+            self._send("PQ.BULK %d" % mode)
+            resp = self._parse_resp().next()
+            self.assertEqual(resp['pqs'],0) #check for error codes
+            self.assertEqual(resp['in1'],4)
+            self.assertEqual(resp['in2'],in2)
+            self.assertEqual(resp['out1'],4)
+            self.assertEqual(resp['out2'],0)
+            self.assertEqual(resp['long_len'],40)
+            self.assertEqual(resp['out3'],in2)
+            self.assertEqual(resp['errors'],0)
+            self.assertEqual(resp['size'],0)
+################################################################################
+class CompactQueueTestSuite(SerialCommandDrivenTestSuite):
+    def testWrapAround(self):
+        #(buffer size, packets, longest packet), the records wrap around the
+        #end of the ring many times; those over 32 bytes only fit a peek
+        for size, count, maxlen in [(128,1000,40),(97,1000,20),(256,2000,64),(200,500,1)]:
+            self._send("PQC.RT %d %d %d" % (size, count, maxlen))
+            resp = self._parse_resp().next()
+            self.assertEqual(resp['pqs'],0) #check for error codes
+            self.assertEqual(resp['pushed'],count)
+            self.assertEqual(resp['popped'],count)
+            self.assertEqual(resp['errors'],0)
+            self.assertEqual(resp['size'],0)
+            self.assertTrue(resp['bytes'] + 7*count > 4*size) #with the record headers
+################################################################################
+class PriorityQueueTestSuite(SerialCommandDrivenTestSuite):
+    def testServiceOrder(self):
+        #packets are p<level>.<number>, levels 0 and 1 hold four and level 2 two
+        for i in range(2):
+            self._send("PRIO.RT")
+            resp = self._parse_resp().next()
+            self.assertEqual(resp['pqs'],0) #check for error codes
+            self.assertEqual(resp['size'],9)
+            self.assertEqual(resp['full0_pqs'],PS_STATUS['ERROR_QUEUE_OVERFLOW'])
+            self.assertEqual(resp['full2_pqs'],PS_STATUS['ERROR_QUEUE_OVERFLOW'])
+            self.assertEqual(resp['room1_pqs'],0)
+            self.assertEqual(resp['late_pqs'],0)
+            self.assertEqual(resp['requeue_pqs'],0)
+            self.assertEqual(resp['order'].split(),
+                ['p2.2','p2.6','p1.1','p2.12','p1.5','p1.7','p1.11','p0.0','p0.3','p0.4','p0.8'])
+            self.assertEqual(resp['empty_pqs'],PS_STATUS['ERROR_QUEUE_UNDERFLOW'])
+            self.assertEqual(resp['errors'],0)
+################################################################################
 #class PackQueueTestSuite(SerialCommandDrivenTestSuite):
 #    def setUp(self):
 #        super(PackQueueTestSuite, self).setUp()  #call the setup of the parent